@@ -0,0 +1,1121 @@
+//
+//  File:       CBLutBench.cpp
+//
+//  Function:   Benchmarks for the CBLut kernels
+//
+//  Copyright:  Andrew Willmott 2018
+//
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "CBLuts.h"
+
+#include "stb_image_mini.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <intrin.h>
+    #define CB_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define CB_RDTSC
+#endif
+
+using namespace CBLut;
+
+namespace
+{
+    double Seconds()
+    {
+        using namespace std::chrono;
+        return duration<double>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    RGBA32* CreateNoiseImage(int n)
+    {
+        RGBA32* data = new RGBA32[n];
+        uint32_t seed = 0x12345678;
+
+        for (int i = 0; i < n; i++)
+        {
+            seed = seed * 1664525 + 1013904223;     // LCG, deterministic across platforms
+            data[i].u32 = (seed >> 8) | 0xFF000000;
+        }
+
+        return data;
+    }
+
+    enum tDistribution
+    {
+        kDistNoise,         // uniformly random colours
+        kDistGradient,      // smooth ramps, so neighbouring pixels hit the same LUT cells
+        kDistPalette,       // 64 distinct colours, as in UI screenshots
+        kDistDark,          // noise in the bottom quarter of each channel
+        kNumDistributions
+    };
+
+    const char* kDistNames[] = { "noise", "gradient", "palette", "dark" };
+
+    RGBA32* CreateTestImage(int w, int h, tDistribution dist)
+    {
+        if (dist == kDistNoise)
+            return CreateNoiseImage(w * h);
+
+        RGBA32* data = new RGBA32[w * h];
+        uint32_t seed = 0x12345678;
+
+        for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+        {
+            RGBA32& c = data[y * w + x];
+            seed = seed * 1664525 + 1013904223;
+
+            switch (dist)
+            {
+            case kDistGradient:
+                c.u32 = 0xFF000000 | ((255 * (x + y) / (w + h)) << 16) | ((255 * y / h) << 8) | (255 * x / w);
+                break;
+            case kDistPalette:
+                c.u32 = (((seed >> 26) * 0x9E3779B1) >> 8) | 0xFF000000;   // one of 64 colours
+                break;
+            default:
+                c.u32 = ((seed >> 8) & 0x3F3F3F) | 0xFF000000;
+                break;
+            }
+        }
+
+        return data;
+    }
+
+    const char* kOpNames[]     = { "simulate", "daltonise", "correct" };
+    const char* kTypeNames[]   = { "p", "d", "t" };
+    const char* kInterpNames[] = { "diagonal", "tetrahedral", "trilinear" };
+    const char* kSIMDNames[]   = { "none", "sse2", "avx2" };
+
+    Vec3f ApplyOp(int op, Vec3f c, tLMS lmsType, float strength)
+    {
+        switch (op)
+        {
+        case 0:
+            return Simulate (c, lmsType, strength);
+        case 1:
+            return Daltonise(c, lmsType, strength);
+        default:
+            return Correct  (c, lmsType, strength);
+        }
+    }
+
+    void ApplyOp(int op, int n, float r[], float g[], float b[], tLMS lmsType, float strength)
+    {
+        switch (op)
+        {
+        case 0:
+            return Simulate (n, r, g, b, lmsType, strength);
+        case 1:
+            return Daltonise(n, r, g, b, lmsType, strength);
+        default:
+            return Correct  (n, r, g, b, lmsType, strength);
+        }
+    }
+
+    // Compare LUT interpolation modes and SIMD levels against the direct transform, and check each SIMD level
+    // reproduces the scalar kernel exactly. Returns the number of mismatches
+    int BenchInterp(int n, const RGBA32* dataIn, int lutSize, float shaper, float strength, int reps, int threads)
+    {
+        RGBA32* dataRef  = new RGBA32[n];
+        RGBA32* dataOut  = new RGBA32[n];
+        RGBA32* dataNone = new RGBA32[n];
+        RGBLUT  rgbaLUT  = shaper > 0.0f ? AllocShapedLUT(lutSize, shaper) : AllocLUT(lutSize);
+
+        const tSIMD maxSIMD = SIMDLevel();
+        int mismatches = 0;
+
+        printf("%-10s %-4s %-12s %-5s %9s %8s %9s %6s\n", "op", "type", "interp", "simd", "Mpixel/s", "max err", "mean err", "same");
+
+        for (int op = 0; op < 3; op++)
+        for (int type = 0; type < 3; type++)
+        {
+            tLMS lmsType = tLMS(type);
+            auto xform = [op, lmsType, strength](Vec3f c) { return ApplyOp(op, c, lmsType, strength); };
+
+            CreateLUT(xform, rgbaLUT);
+
+            double directTime = 1e30;
+
+            for (int rep = 0; rep < reps; rep++)
+            {
+                double t0 = Seconds();
+                Transform(xform, n, dataIn, dataRef);
+                double t = Seconds() - t0;
+
+                if (directTime > t)
+                    directTime = t;
+            }
+
+            printf("%-10s %-4s %-12s %-5s %9.1f %8d %9.4f %6s\n",
+                kOpNames[op], kTypeNames[type], "direct", "-", n / directTime * 1e-6, 0, 0.0, "-");
+
+            for (int interp = kInterpDiagonal; interp <= kInterpTrilinear; interp++)
+            for (int simd = kSIMDNone; simd <= maxSIMD; simd++)
+            {
+                SetSIMDLevel(tSIMD(simd));
+
+                double bestTime = 1e30;
+
+                for (int rep = 0; rep < reps; rep++)
+                {
+                    double t0 = Seconds();
+                    ApplyLUTParallel(rgbaLUT, n, dataIn, dataOut, tLUTInterp(interp), threads);
+                    double t = Seconds() - t0;
+
+                    if (bestTime > t)
+                        bestTime = t;
+                }
+
+                int    maxErr = 0;
+                double sumErr = 0.0;
+
+                for (int i = 0; i < n; i++)
+                for (int j = 0; j < 3; j++)
+                {
+                    int err = abs(dataOut[i].c[j] - dataRef[i].c[j]);
+
+                    if (maxErr < err)
+                        maxErr = err;
+
+                    sumErr += err;
+                }
+
+                bool same = true;
+
+                if (simd == kSIMDNone)
+                    memcpy(dataNone, dataOut, n * sizeof(RGBA32));
+                else if (memcmp(dataNone, dataOut, n * sizeof(RGBA32)) != 0)
+                {
+                    same = false;
+                    mismatches++;
+                }
+
+                printf("%-10s %-4s %-12s %-5s %9.1f %8d %9.4f %6s\n",
+                    kOpNames[op], kTypeNames[type], kInterpNames[interp], kSIMDNames[simd],
+                    n / bestTime * 1e-6, maxErr, sumErr / (3.0 * n), simd == kSIMDNone ? "-" : same ? "yes" : "NO");
+            }
+
+            SetSIMDLevel(maxSIMD);
+        }
+
+        FreeLUT(&rgbaLUT);
+        delete[] dataNone;
+        delete[] dataOut;
+        delete[] dataRef;
+
+        return mismatches;
+    }
+
+    // Compare the single-colour and batch versions of each op, and check each SIMD level of the
+    // latter reproduces the scalar one exactly. Returns the number of mismatches
+    int BenchBatch(int n, const RGBA32* dataIn, float strength, int reps)
+    {
+        Vec3f* colours = new Vec3f[n];
+        Vec3f* results = new Vec3f[n];
+        float* r       = new float[3 * n];  // r, g, and b are contiguous, so can be compared in one go
+        float* g       = r + n;
+        float* b       = g + n;
+        float* rgbNone = new float[3 * n];
+
+        for (int i = 0; i < n; i++)
+            colours[i] = FromRGBA32Fast(dataIn[i]);
+
+        const tSIMD maxSIMD = SIMDLevel();
+
+        int mismatches = 0;
+
+        printf("%-10s %-4s %-12s %-5s %9s %6s\n", "op", "type", "mode", "simd", "Mcolour/s", "same");
+
+        for (int op = 0; op < 3; op++)
+        for (int type = 0; type < 3; type++)
+        {
+            tLMS lmsType = tLMS(type);
+            double bestTime = 1e30;
+
+            for (int rep = 0; rep < reps; rep++)
+            {
+                double t0 = Seconds();
+
+                for (int i = 0; i < n; i++)
+                    results[i] = ApplyOp(op, colours[i], lmsType, strength);
+
+                double t = Seconds() - t0;
+
+                if (bestTime > t)
+                    bestTime = t;
+            }
+
+            printf("%-10s %-4s %-12s %-5s %9.1f %6s\n", kOpNames[op], kTypeNames[type], "single", "-", n / bestTime * 1e-6, "-");
+
+            for (int simd = kSIMDNone; simd <= maxSIMD; simd++)
+            {
+                SetSIMDLevel(tSIMD(simd));
+                bestTime = 1e30;
+
+                for (int rep = 0; rep < reps; rep++)
+                {
+                    for (int i = 0; i < n; i++)
+                    {
+                        r[i] = colours[i].x;
+                        g[i] = colours[i].y;
+                        b[i] = colours[i].z;
+                    }
+
+                    double t0 = Seconds();
+                    ApplyOp(op, n, r, g, b, lmsType, strength);
+                    double t = Seconds() - t0;
+
+                    if (bestTime > t)
+                        bestTime = t;
+                }
+
+                bool same = true;
+
+                if (simd == kSIMDNone)
+                    memcpy(rgbNone, r, 3 * n * sizeof(float));
+                else if (memcmp(rgbNone, r, 3 * n * sizeof(float)) != 0)
+                {
+                    same = false;
+                    mismatches++;
+                }
+
+                printf("%-10s %-4s %-12s %-5s %9.1f %6s\n", kOpNames[op], kTypeNames[type], "batch", kSIMDNames[simd], n / bestTime * 1e-6,
+                    simd == kSIMDNone ? "-" : same ? "yes" : "NO");
+            }
+
+            SetSIMDLevel(maxSIMD);
+        }
+
+        delete[] rgbNone;
+        delete[] r;
+        delete[] results;
+        delete[] colours;
+
+        return mismatches;
+    }
+
+    // Compare rebuilding a LUT for a new strength with applying a strength LUT stack, and the error of the latter
+    void BenchStack(int n, const RGBA32* dataIn, int lutSize, int numSlices, float strength, int reps, int threads)
+    {
+        RGBA32*     dataRef  = new RGBA32[n];
+        RGBA32*     dataOut  = new RGBA32[n];
+        RGBLUT      rgbaLUT  = AllocLUT(lutSize);
+        RGBLUT      blendLUT = AllocLUT(lutSize);
+        RGBLUTStack stack    = AllocLUTStack(lutSize, numSlices);
+
+        printf("%-10s %-4s %6s %9s %9s %9s %9s %9s %8s %9s\n", "op", "type", "slices", "build ms", "lut ms", "blend ms", "Mpixel/s", "stack", "max err", "mean err");
+
+        for (int op = 0; op < 3; op++)
+        for (int type = 0; type < 3; type++)
+        {
+            tLMS lmsType = tLMS(type);
+            auto xform = [op, lmsType](int n, float r[], float g[], float b[], float strength) { ApplyOp(op, n, r, g, b, lmsType, strength); };
+
+            double buildTime = 1e30;
+            double lutTime   = 1e30;
+            double blendTime = 1e30;
+            double applyTime = 1e30;
+            double stackTime = 1e30;
+
+            for (int rep = 0; rep < reps; rep++)
+            {
+                double t0 = Seconds();
+                CreateLUTStackBatch(xform, stack, threads);
+                double t1 = Seconds();
+                CreateLUTBatch([&xform, strength](int n, float r[], float g[], float b[]) { xform(n, r, g, b, strength); }, rgbaLUT, threads);
+                double t2 = Seconds();
+                BlendLUTStack(stack, strength, blendLUT);
+                double t3 = Seconds();
+                ApplyLUTParallel(rgbaLUT, n, dataIn, dataRef, kInterpDiagonal, threads);
+                double t4 = Seconds();
+                ApplyLUTStackParallel(stack, strength, n, dataIn, dataOut, kInterpDiagonal, threads);
+                double t5 = Seconds();
+
+                buildTime = buildTime < t1 - t0 ? buildTime : t1 - t0;
+                lutTime   = lutTime   < t2 - t1 ? lutTime   : t2 - t1;
+                blendTime = blendTime < t3 - t2 ? blendTime : t3 - t2;
+                applyTime = applyTime < t4 - t3 ? applyTime : t4 - t3;
+                stackTime = stackTime < t5 - t4 ? stackTime : t5 - t4;
+            }
+
+            int    maxErr = 0;
+            double sumErr = 0.0;
+
+            for (int i = 0; i < n; i++)
+            for (int j = 0; j < 3; j++)
+            {
+                int err = abs(dataOut[i].c[j] - dataRef[i].c[j]);
+
+                if (maxErr < err)
+                    maxErr = err;
+
+                sumErr += err;
+            }
+
+            printf("%-10s %-4s %6d %9.3f %9.3f %9.3f %9.1f %9.1f %8d %9.4f\n",
+                kOpNames[op], kTypeNames[type], numSlices, buildTime * 1e3, lutTime * 1e3, blendTime * 1e3,
+                n / applyTime * 1e-6, n / stackTime * 1e-6, maxErr, sumErr / (3.0 * n));
+        }
+
+        FreeLUTStack(&stack);
+        FreeLUT(&blendLUT);
+        FreeLUT(&rgbaLUT);
+        delete[] dataOut;
+        delete[] dataRef;
+    }
+
+    // Compare rebuilding a LUT for a new strength with updating it from an affine LUT, for the ops that allow this
+    void BenchAffine(int lutSize, float strength, int reps, int threads)
+    {
+        RGBLUT       rgbaLUT   = AllocLUT(lutSize);
+        RGBLUT       updateLUT = AllocLUT(lutSize);
+        RGBLUTAffine alut      = AllocLUTAffine(lutSize);
+
+        const int n = lutSize * lutSize * lutSize;
+
+        printf("%-10s %-4s %9s %9s %9s %8s %9s\n", "op", "type", "build ms", "lut ms", "update ms", "max err", "differ");
+
+        for (int op = 0; op < 2; op++)
+        for (int type = 0; type < 3; type++)
+        {
+            tLMS lmsType = tLMS(type);
+            auto xform = [op, lmsType](int n, float r[], float g[], float b[], float strength) { ApplyOp(op, n, r, g, b, lmsType, strength); };
+
+            double buildTime  = 1e30;
+            double lutTime    = 1e30;
+            double updateTime = 1e30;
+
+            for (int rep = 0; rep < reps; rep++)
+            {
+                double t0 = Seconds();
+                CreateLUTAffineBatch(xform, alut, threads);
+                double t1 = Seconds();
+                CreateLUTBatch([&xform, strength](int n, float r[], float g[], float b[]) { xform(n, r, g, b, strength); }, rgbaLUT, threads);
+                double t2 = Seconds();
+                UpdateLUTAffine(alut, strength, updateLUT, threads);
+                double t3 = Seconds();
+
+                buildTime  = buildTime  < t1 - t0 ? buildTime  : t1 - t0;
+                lutTime    = lutTime    < t2 - t1 ? lutTime    : t2 - t1;
+                updateTime = updateTime < t3 - t2 ? updateTime : t3 - t2;
+            }
+
+            int maxErr = 0;
+            int differ = 0;
+
+            for (int i = 0; i < n; i++)
+            {
+                for (int j = 0; j < 3; j++)
+                {
+                    int err = abs(updateLUT.data[i].c[j] - rgbaLUT.data[i].c[j]);
+
+                    if (maxErr < err)
+                        maxErr = err;
+                }
+
+                differ += updateLUT.data[i].u32 != rgbaLUT.data[i].u32;
+            }
+
+            printf("%-10s %-4s %9.3f %9.3f %9.3f %8d %9d\n",
+                kOpNames[op], kTypeNames[type], buildTime * 1e3, lutTime * 1e3, updateTime * 1e3, maxErr, differ);
+        }
+
+        FreeLUTAffine(&alut);
+        FreeLUT(&updateLUT);
+        FreeLUT(&rgbaLUT);
+    }
+
+    // Kernel micro-benchmark suite, with results as JSON
+    struct cTiming
+    {
+        double seconds;     // fastest repetition
+        double cycles;      // TSC cycles for that repetition, or 0 if unavailable
+    };
+
+    inline uint64_t Cycles()
+    {
+    #ifdef CB_RDTSC
+        return __rdtsc();
+    #else
+        return 0;
+    #endif
+    }
+
+    template<class S, class T> cTiming TimeKernel(int warmup, int reps, S setup, T func)   // setup() is called before each run of func(), untimed
+    {
+        for (int i = 0; i < warmup; i++)
+        {
+            setup();
+            func();
+        }
+
+        cTiming best = { 1e30, 0.0 };
+
+        for (int i = 0; i < reps; i++)
+        {
+            setup();
+
+            double   t0 = Seconds();
+            uint64_t c0 = Cycles();
+
+            func();
+
+            uint64_t c1 = Cycles();
+            double   t1 = Seconds();
+
+            if (best.seconds > t1 - t0)
+                best = { t1 - t0, double(c1 - c0) };
+        }
+
+        return best;
+    }
+
+    template<class T> cTiming TimeKernel(int warmup, int reps, T func)
+    {
+        return TimeKernel(warmup, reps, [] {}, func);
+    }
+
+    // Print a kernel's timing over 'items' pixels or samples, which read and wrote 'bytes' in total, as a JSON object.
+    // 'matchesNone' is whether its output matched that at kSIMDNone, as a JSON value
+    void PrintResult(int* numResults, const char* kernel, const char* variant, const char* simd, int items, double bytes, cTiming t, const char* matchesNone = "null")
+    {
+        printf("%s\n    {\"kernel\": \"%s\", \"variant\": \"%s\", \"simd\": \"%s\", \"items\": %d, "
+            "\"ns_per_item\": %.4f, \"gb_per_s\": %.4f, \"cycles_per_item\": ",
+            (*numResults)++ ? "," : "", kernel, variant, simd, items,
+            t.seconds / items * 1e9, bytes / t.seconds * 1e-9);
+
+        if (t.cycles > 0.0)
+            printf("%.3f", t.cycles / items);
+        else
+            printf("null");
+
+        printf(", \"matches_none\": %s}", matchesNone);
+    }
+
+    // Hashes of each kernel's output at kSIMDNone, by kernel and variant, to check the SIMD kernels reproduce them
+    const int kMaxCheckedKernels = 64;
+
+    struct cSIMDCheck
+    {
+        char     names [kMaxCheckedKernels][64];
+        uint32_t hashes[kMaxCheckedKernels];
+        int      numKernels    = 0;
+        int      numMismatches = 0;
+    };
+
+    uint32_t HashBytes(const void* data, size_t size)
+    {
+        const uint8_t* p = (const uint8_t*) data;
+        uint32_t h = 0x811c9dc5;    // FNV-1a
+
+        for (size_t i = 0; i < size; i++)
+            h = (h ^ p[i]) * 0x01000193;
+
+        return h;
+    }
+
+    // As above, but first compare the kernel's output, 'out', with its output at kSIMDNone
+    void PrintResult(int* numResults, const char* kernel, const char* variant, int simd, int items, double bytes, cTiming t, cSIMDCheck* check, const void* out, size_t outSize)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "%s %s", kernel, variant);
+
+        int i = 0;
+
+        while (i < check->numKernels && strcmp(check->names[i], name) != 0)
+            i++;
+
+        if (i == check->numKernels)
+        {
+            assert(simd == kSIMDNone && i < kMaxCheckedKernels);
+            strcpy(check->names[check->numKernels++], name);
+        }
+
+        uint32_t    hash        = HashBytes(out, outSize);
+        const char* matchesNone = "null";
+
+        if (simd == kSIMDNone)
+            check->hashes[i] = hash;
+        else if (hash == check->hashes[i])
+            matchesNone = "true";
+        else
+        {
+            matchesNone = "false";
+            check->numMismatches++;
+            fprintf(stderr, "%s %s output at %s differs from none\n", kernel, variant, kSIMDNames[simd]);
+        }
+
+        PrintResult(numResults, kernel, variant, kSIMDNames[simd], items, bytes, t, matchesNone);
+    }
+
+    // The SIMD levels with their own implementation of a kernel, as masks of 1 << tSIMD. At other levels
+    // the kernel runs the code of the level below, so the suite skips it, rather than timing that code twice.
+    const unsigned kImplScalar = 1 << kSIMDNone;
+    const unsigned kImplAVX2   = kImplScalar | 1 << kSIMDAVX2;
+    const unsigned kImplAll    = kImplAVX2   | 1 << kSIMDSSE2;
+
+    struct cSuite
+    {
+        int        warmup;
+        int        reps;
+        int        numResults = 0;
+        cSIMDCheck check;
+    };
+
+    // Time func(), after setup(), at the current SIMD level if 'impls' includes it, check its output, 'out', and print the result
+    template<class S, class T> void BenchKernel(cSuite* suite, const char* kernel, const char* variant, int simd, unsigned impls, int items, double bytes, S setup, T func, const void* out, size_t outSize)
+    {
+        if (impls & (1 << simd))
+            PrintResult(&suite->numResults, kernel, variant, simd, items, bytes, TimeKernel(suite->warmup, suite->reps, setup, func), &suite->check, out, outSize);
+    }
+
+    template<class T> void BenchKernel(cSuite* suite, const char* kernel, const char* variant, int simd, unsigned impls, int items, double bytes, T func, const void* out, size_t outSize)
+    {
+        BenchKernel(suite, kernel, variant, simd, impls, items, bytes, [] {}, func, out, outSize);
+    }
+
+    // Time each kernel on a single thread, at each SIMD level it implements, and print the results as JSON. Also checks
+    // each SIMD kernel's output matches the scalar one, and returns the number that don't
+    int BenchSuite(int n, const RGBA32* dataIn, const char* source, int lutSize, float strength, int warmup, int reps)
+    {
+        RGBA32* dataOut   = new RGBA32[n];
+        RGBLUT  rgbaLUT   = AllocLUT(lutSize);
+        RGBLUT  shapedLUT = AllocShapedLUT(lutSize);
+        float*  r         = new float[3 * n];   // contiguous, so the batch ops' output can be checked in one go
+        float*  g         = r + n;
+        float*  b         = g + n;
+        Vec3f*  colours   = new Vec3f[n];
+        Vec3f*  results   = new Vec3f[n];
+
+        RGBA32 monoLUT[256];
+
+        for (int i = 0; i < 256; i++)
+            monoLUT[i].u32 = 0xFF000000 | (i << 16) | ((255 - i) << 8) | (i ^ 0x80);
+
+        for (int i = 0; i < n; i++)
+            colours[i] = FromRGBA32Fast(dataIn[i]);
+
+        // 4:2:0 frames with the source's channels as Y/Cb/Cr, for the YCbCr kernels
+        const int frameW      = n < 1024 ? n & ~1 : 1024;
+        const int frameH      = (n / frameW) & ~1;
+        const int framePixels = frameW * frameH;
+        const int frameBytes  = framePixels + framePixels / 2;
+
+        uint8_t* i420Data = new uint8_t[frameBytes];
+        uint8_t* nv12Data = new uint8_t[frameBytes];
+        uint8_t* yuvOut   = new uint8_t[frameBytes];
+        RGBLUT   yuvLUT   = AllocLUT(lutSize);
+
+        YUVPlanes i420In  = I420Planes(frameW, frameH, i420Data);
+        YUVPlanes nv12In  = NV12Planes(frameW, frameH, nv12Data);
+        YUVPlanes i420Out = I420Planes(frameW, frameH, yuvOut);
+        YUVPlanes nv12Out = NV12Planes(frameW, frameH, yuvOut);
+
+        for (int y = 0; y < frameH; y++)
+            for (int x = 0; x < frameW; x++)
+            {
+                RGBA32 c = dataIn[y * frameW + x];
+
+                i420In.y[y * i420In.yStride + x] = c.c[0];
+                nv12In.y[y * nv12In.yStride + x] = c.c[0];
+
+                if ((x | y) & 1)
+                    continue;
+
+                int ci = (y >> 1) * i420In.cStride + (x >> 1) * i420In.cStep;
+                int cn = (y >> 1) * nv12In.cStride + (x >> 1) * nv12In.cStep;
+
+                i420In.cb[ci] = nv12In.cb[cn] = c.c[1];
+                i420In.cr[ci] = nv12In.cr[cn] = c.c[2];
+            }
+
+        // 16-bit and half-float versions of the source, for the deep colour kernels
+        RGBA64*  deepIn  = new RGBA64[n];
+        RGBA64*  deepOut = new RGBA64[n];
+        RGBA16F* halfIn  = new RGBA16F[n];
+        RGBA16F* halfOut = new RGBA16F[n];
+        RGBLUT64 lut64   = AllocLUT64(lutSize);
+        RGBLUTF  lutF    = AllocLUTF(lutSize);
+
+        for (int i = 0; i < n; i++)
+        {
+            for (int j = 0; j < 4; j++)
+                deepIn[i].c[j] = uint16_t(dataIn[i].c[j] * 257);
+
+            halfIn[i].c[0] = ToHalf(colours[i].x);
+            halfIn[i].c[1] = ToHalf(colours[i].y);
+            halfIn[i].c[2] = ToHalf(colours[i].z);
+            halfIn[i].c[3] = 0x3C00;
+        }
+
+        const tSIMD  maxSIMD    = SIMDLevel();
+        const int    lutItems   = lutSize * lutSize * lutSize;
+        const double lutBytes   = lutItems * sizeof(RGBA32);
+        const double imageBytes = 2.0 * n * sizeof(RGBA32);
+
+        cSuite suite;
+        suite.warmup = warmup;
+        suite.reps   = reps;
+
+        printf("{\n  \"benchmark\": \"cblutbench\",\n  \"format\": 3,\n");
+        printf("  \"config\": {\"pixels\": %d, \"source\": \"%s\", \"lut_size\": %d, \"strength\": %g, "
+            "\"warmup\": %d, \"reps\": %d, \"threads\": 1, \"max_simd\": \"%s\", \"cycles\": \"%s\"},\n",
+            n, source, lutSize, strength, warmup, reps, kSIMDNames[maxSIMD], Cycles() ? "tsc" : "none");
+        printf("  \"results\": [");
+
+        CreateIdentityLUT(rgbaLUT);
+        PrintResult(&suite.numResults, "CreateIdentityLUT", "-", "-", lutItems, lutBytes,
+            TimeKernel(warmup, reps, [&] { CreateIdentityLUT(rgbaLUT); }));
+
+        for (int simd = kSIMDNone; simd <= maxSIMD; simd++)
+        {
+            SetSIMDLevel(tSIMD(simd));
+
+            for (int op = 0; op < 3; op++)
+            {
+                char variant[64];
+                snprintf(variant, sizeof(variant), "%s_p", kOpNames[op]);
+
+                BenchKernel(&suite, "CreateLUTBatch", variant, simd, kImplAll, lutItems, lutBytes,
+                    [&] { CreateLUTBatch([op, strength](int n, float r[], float g[], float b[]) { ApplyOp(op, n, r, g, b, kL, strength); }, rgbaLUT); }, rgbaLUT.data, lutItems * sizeof(RGBA32));
+            }
+
+            CreateLUTBatch([strength](int n, float r[], float g[], float b[]) { Simulate(n, r, g, b, kL, strength); }, rgbaLUT);
+
+            for (int interp = kInterpDiagonal; interp <= kInterpTrilinear; interp++)
+                BenchKernel(&suite, "ApplyLUT", kInterpNames[interp], simd, kImplAVX2, n, imageBytes,
+                    [&] { ApplyLUT(rgbaLUT, n, dataIn, dataOut, tLUTInterp(interp)); }, dataOut, n * sizeof(RGBA32));
+
+            BenchKernel(&suite, "ApplyLUTNoLerp", "nearest", simd, kImplScalar, n, imageBytes,
+                [&] { ApplyLUTNoLerp(rgbaLUT, n, dataIn, dataOut); }, dataOut, n * sizeof(RGBA32));
+
+            CreateLUTBatch([strength](int n, float r[], float g[], float b[]) { Simulate(n, r, g, b, kL, strength); }, shapedLUT);
+
+            for (int interp = kInterpDiagonal; interp <= kInterpTrilinear; interp++)
+            {
+                char variant[64];
+                snprintf(variant, sizeof(variant), "shaped_%s", kInterpNames[interp]);
+
+                BenchKernel(&suite, "ApplyLUT", variant, simd, kImplAVX2, n, imageBytes,
+                    [&] { ApplyLUT(shapedLUT, n, dataIn, dataOut, tLUTInterp(interp)); }, dataOut, n * sizeof(RGBA32));
+            }
+
+            BenchKernel(&suite, "CreateLUTBatch", "simulate_p_rgba64", simd, kImplAll, lutItems, 2.0 * lutBytes,
+                [&] { CreateLUTBatch([strength](int n, float r[], float g[], float b[]) { Simulate(n, r, g, b, kL, strength); }, lut64); }, lut64.data, lutItems * sizeof(RGBA64));
+
+            for (int interp = kInterpDiagonal; interp <= kInterpTrilinear; interp++)
+            {
+                char variant[64];
+                snprintf(variant, sizeof(variant), "rgba64_%s", kInterpNames[interp]);
+
+                BenchKernel(&suite, "ApplyLUT", variant, simd, kImplAVX2, n, 2.0 * imageBytes,
+                    [&] { ApplyLUT(lut64, n, deepIn, deepOut, tLUTInterp(interp)); }, deepOut, n * sizeof(RGBA64));
+            }
+
+            BenchKernel(&suite, "ApplyLUT", "rgba16f", simd, kImplAVX2, n, 2.0 * imageBytes,
+                [&] { ApplyLUT(lut64, n, halfIn, halfOut); }, halfOut, n * sizeof(RGBA16F));
+
+            BenchKernel(&suite, "CreateLUTBatch", "simulate_p_linear", simd, kImplAll, lutItems, 4.0 * lutBytes,
+                [&] { CreateLUTBatch([strength](int n, float r[], float g[], float b[]) { Simulate(n, r, g, b, kL, strength); }, lutF); }, lutF.data, lutItems * sizeof(RGBA32F));
+
+            for (int interp = kInterpDiagonal; interp <= kInterpTrilinear; interp++)
+            {
+                char variant[64];
+                snprintf(variant, sizeof(variant), "linear_%s", kInterpNames[interp]);
+
+                BenchKernel(&suite, "ApplyLUT", variant, simd, kImplAll, n, n * 2.0 * sizeof(Vec3f),
+                    [&] { ApplyLUT(lutF, n, colours, results, tLUTInterp(interp)); }, results, n * sizeof(Vec3f));
+            }
+
+            BenchKernel(&suite, "CreateYUVLUTBatch", "simulate_p", simd, kImplAll, lutItems, lutBytes,
+                [&] { CreateYUVLUTBatch([strength](int n, float r[], float g[], float b[]) { Simulate(n, r, g, b, kL, strength); }, yuvLUT, kYUV709); }, yuvLUT.data, lutItems * sizeof(RGBA32));
+
+            BenchKernel(&suite, "ApplyLUT", "i420", simd, kImplAll, framePixels, 2.0 * frameBytes,
+                [&] { ApplyLUT(yuvLUT, i420In, i420Out); }, yuvOut, frameBytes);
+            BenchKernel(&suite, "ApplyLUT", "nv12", simd, kImplAll, framePixels, 2.0 * frameBytes,
+                [&] { ApplyLUT(yuvLUT, nv12In, nv12Out); }, yuvOut, frameBytes);
+
+            BenchKernel(&suite, "ApplyMonoLUT", "luminance", simd, kImplScalar, n, imageBytes,
+                [&] { ApplyMonoLUT(monoLUT, n, dataIn, dataOut); }, dataOut, n * sizeof(RGBA32));
+            BenchKernel(&suite, "ApplyMonoLUT", "channel", simd, kImplScalar, n, imageBytes,
+                [&] { ApplyMonoLUT(monoLUT, n, dataIn, dataOut, 1); }, dataOut, n * sizeof(RGBA32));
+
+            BenchKernel(&suite, "TransformMatrix", "rgba32", simd, kImplAll, n, imageBytes,
+                [&] { TransformMatrix(SimulateMatrix(kL, strength), n, dataIn, dataOut); }, dataOut, n * sizeof(RGBA32));
+
+            for (int op = 0; op < 3; op++)
+            {
+                // Single-colour versions have no SIMD variants
+                if (simd == kSIMDNone)
+                    PrintResult(&suite.numResults, kOpNames[op], "single", "-", n, n * 2.0 * sizeof(Vec3f),
+                        TimeKernel(warmup, reps, [&]
+                        {
+                            for (int i = 0; i < n; i++)
+                                results[i] = ApplyOp(op, colours[i], kL, strength);
+                        }));
+
+                // The batch versions work in place, so restore their inputs before each run
+                auto setup = [&]
+                {
+                    for (int i = 0; i < n; i++)
+                    {
+                        r[i] = colours[i].x;
+                        g[i] = colours[i].y;
+                        b[i] = colours[i].z;
+                    }
+                };
+
+                BenchKernel(&suite, kOpNames[op], "batch", simd, kImplAll, n, n * 6.0 * sizeof(float),
+                    setup, [&] { ApplyOp(op, n, r, g, b, kL, strength); }, r, 3 * n * sizeof(float));
+            }
+        }
+
+        SetSIMDLevel(maxSIMD);
+
+        printf("\n  ],\n  \"simd_mismatches\": %d\n}\n", suite.check.numMismatches);
+
+        FreeLUT(&lutF);
+        FreeLUT(&lut64);
+        delete[] halfOut;
+        delete[] halfIn;
+        delete[] deepOut;
+        delete[] deepIn;
+        FreeLUT(&yuvLUT);
+        delete[] yuvOut;
+        delete[] nv12Data;
+        delete[] i420Data;
+        delete[] results;
+        delete[] colours;
+        delete[] r;
+        FreeLUT(&shapedLUT);
+        FreeLUT(&rgbaLUT);
+        delete[] dataOut;
+
+        return suite.check.numMismatches;
+    }
+
+    // Compare decode speed of the given image files with and without stb_image's SIMD kernels
+    int BenchDecode(int numFiles, const char* paths[], int reps)
+    {
+        printf("%-24s %-5s %9s %9s %6s\n", "file", "simd", "Mpixel/s", "MB/s", "same");
+
+        double totalTime[2] = { 0.0, 0.0 };
+        double totalPixels  = 0.0;
+
+        for (int i = 0; i < numFiles; i++)
+        {
+            FILE* file = fopen(paths[i], "rb");
+
+            if (!file)
+                return fprintf(stderr, "Couldn't open %s\n", paths[i]);
+
+            fseek(file, 0, SEEK_END);
+            int size = (int) ftell(file);
+            fseek(file, 0, SEEK_SET);
+
+            stbi_uc* fileData = new stbi_uc[size];
+            size = (int) fread(fileData, 1, size, file);
+            fclose(file);
+
+            const char* name = strrchr(paths[i], '/');
+            name = name ? name + 1 : paths[i];
+
+            stbi_uc* reference = 0;
+            int w = 0, h = 0;
+
+            for (int simd = 0; simd < 2; simd++)
+            {
+                stbi_set_jpeg_simd(simd);
+
+                double   bestTime = 1e30;
+                stbi_uc* data = 0;
+
+                for (int rep = 0; rep < reps; rep++)
+                {
+                    stbi_image_free(data);
+
+                    double t0 = Seconds();
+                    data = stbi_load_from_memory(fileData, size, &w, &h, 0, 4);
+                    double t = Seconds() - t0;
+
+                    if (bestTime > t)
+                        bestTime = t;
+                }
+
+                if (!data)
+                {
+                    delete[] fileData;
+                    return fprintf(stderr, "Couldn't decode %s\n", paths[i]);
+                }
+
+                bool same = !reference || memcmp(reference, data, w * h * 4) == 0;
+
+                if (!reference)
+                    reference = data;
+                else
+                    stbi_image_free(data);
+
+                totalTime[simd] += bestTime;
+
+                printf("%-24s %-5s %9.1f %9.1f %6s\n", name, simd ? "sse2" : "none", w * h / bestTime * 1e-6, size / bestTime * 1e-6, same ? "yes" : "NO");
+            }
+
+            totalPixels += double(w) * h;
+
+            stbi_image_free(reference);
+            delete[] fileData;
+        }
+
+        stbi_set_jpeg_simd(1);
+
+        if (numFiles > 1)
+        {
+            printf("%-24s %-5s %9.1f\n", "total", "none", totalPixels / totalTime[0] * 1e-6);
+            printf("%-24s %-5s %9.1f\n", "total", "sse2", totalPixels / totalTime[1] * 1e-6);
+        }
+
+        return 0;
+    }
+
+    int Help(const char* command)
+    {
+        printf
+        (
+            "%s <options> [<image> ...]\n"
+            "\n"
+            "Reports throughput of each LUT interpolation mode, and its error against the direct transform,\n"
+            "followed by the throughput of the single-colour and batch versions of each colour-blindness op,\n"
+            "and the cost of rebuilding a LUT for a new strength versus applying a strength LUT stack, or updating\n"
+            "an affine LUT, along with their error against the rebuilt LUT.\n"
+            "Each SIMD kernel's output is checked against the scalar kernel's, and any mismatch gives an exit code of 1.\n"
+            "With -d, instead reports the decode speed of the given images, e.g., tests/*.jpg, with and without SIMD.\n"
+            "\n"
+            "Options:\n"
+            "  -h        : this help\n"
+            "  -f <path> : benchmark using the given image rather than random noise\n"
+            "  -s <size> : width and height of noise image (default 1024)\n"
+            "  -z <size> : lut samples per axis (default 32)\n"
+            "  -H <pow>  : use shaped luts for the interpolation modes, with samples along the given power curve (1 = evenly).\n"
+            "              Allows any -z size from 2 to 257, though other sizes skip the remaining benchmarks\n"
+            "  -m <str>  : colour blindness strength (default 1, or 0.3 for lut stacks and affine luts)\n"
+            "  -k <n>    : slices per strength lut stack (default 9)\n"
+            "  -r <reps> : repetitions per timing, the fastest is reported (default 5)\n"
+            "  -j <n>    : number of threads to apply luts with, 0 = all available (default 1)\n"
+            "  -d        : benchmark decoding of the given images\n"
+            "  -J        : instead time every kernel on one thread, and print the results as JSON, for tracking regressions\n"
+            "  -c <dist> : colours of the synthetic image: noise (default), gradient, palette (64 colours), or dark\n"
+            "  -w <reps> : untimed warmup repetitions before timing (default 1)\n"
+            , command
+        );
+
+        return 0;
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* command = argv[0];
+    argv++; argc--;
+
+    int      size     = 1024;
+    int      reps     = 5;
+    int      threads  = 1;
+    int      lutSize  = kLUTSize;
+    float    shaper   = 0.0f;
+    float    strength = -1.0f;
+    int      slices   = kLUTStackSlices;
+    RGBA32*  dataIn   = 0;
+    int      n        = 0;
+    bool     decode   = false;
+    bool     json     = false;
+    int      warmup   = 1;
+
+    tDistribution dist   = kDistNoise;
+    const char*   source = 0;
+
+    while (argc > 0 && argv[0][0] == '-')
+    {
+        const char* option = argv[0] + 1;
+        argv++; argc--;
+
+        switch (option[0])
+        {
+        case 'h':
+        case '?':
+            return Help(command);
+
+        case 'f':
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting filename with -f\n");
+
+                int w, h;
+                dataIn = (RGBA32*) stbi_load(argv[0], &w, &h, 0, 4);
+
+                if (!dataIn)
+                {
+                    fprintf(stderr, "Couldn't read %s\n", argv[0]);
+                    return -1;
+                }
+
+                n = w * h;
+                source = argv[0];
+                argv++; argc--;
+            }
+            break;
+
+        case 's':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting size for -s <size>\n");
+            size = atoi(argv[0]);
+            argv++; argc--;
+            break;
+
+        case 'z':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting size for -z <size>\n");
+            lutSize = atoi(argv[0]);
+            argv++; argc--;
+            break;
+
+        case 'H':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting power for -H <power>\n");
+            shaper = (float) atof(argv[0]);
+            argv++; argc--;
+
+            if (shaper <= 0.0f)
+                return fprintf(stderr, "Shaper power must be positive\n");
+            break;
+
+        case 'm':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting strength for -m <float>\n");
+            strength = (float) atof(argv[0]);
+            argv++; argc--;
+            break;
+
+        case 'k':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting count for -k <slices>\n");
+            slices = atoi(argv[0]);
+            argv++; argc--;
+
+            if (slices < 2)
+                return fprintf(stderr, "Need at least 2 slices\n");
+            break;
+
+        case 'r':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting count for -r <reps>\n");
+            reps = atoi(argv[0]);
+            argv++; argc--;
+            break;
+
+        case 'j':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting count for -j <threads>\n");
+            threads = atoi(argv[0]);
+            argv++; argc--;
+            break;
+
+        case 'd':
+            decode = true;
+            break;
+
+        case 'J':
+            json = true;
+            break;
+
+        case 'c':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting distribution for -c <dist>\n");
+
+            for (dist = kDistNoise; dist < kNumDistributions; dist = tDistribution(dist + 1))
+                if (strcmp(argv[0], kDistNames[dist]) == 0)
+                    break;
+
+            if (dist == kNumDistributions)
+                return fprintf(stderr, "Unknown distribution %s\n", argv[0]);
+
+            argv++; argc--;
+            break;
+
+        case 'w':
+            if (argc <= 0)
+                return fprintf(stderr, "Expecting count for -w <reps>\n");
+            warmup = atoi(argv[0]);
+            argv++; argc--;
+            break;
+
+        default:
+            fprintf(stderr, "Unknown option -%s\n", option);
+            return -1;
+        }
+    }
+
+    if (decode)
+    {
+        if (argc <= 0)
+            return fprintf(stderr, "Expecting image files to decode with -d\n");
+
+        return BenchDecode(argc, argv, reps);
+    }
+
+    if (argc > 0)
+    {
+        fprintf(stderr, "Unrecognised arguments starting with %s\n", argv[0]);
+        return -1;
+    }
+
+    // Shaped luts can be any size, but the other benchmarks need a regular one
+    if (shaper > 0.0f && !json ? lutSize < 2 || lutSize > kMaxLUTSize : !IsValidLUTSize(lutSize))
+        return fprintf(stderr, "Invalid lut size %d\n", lutSize);
+
+    if (!dataIn)
+    {
+        n = size * size;
+        dataIn = CreateTestImage(size, size, dist);
+        source = kDistNames[dist];
+    }
+
+    int mismatches = 0;
+
+    if (json)
+        mismatches = BenchSuite(n, dataIn, source, lutSize, strength >= 0.0f ? strength : 1.0f, warmup, reps);
+    else
+    {
+        mismatches = BenchInterp(n, dataIn, lutSize, shaper, strength >= 0.0f ? strength : 1.0f, reps, threads);
+
+        if (IsValidLUTSize(lutSize))
+        {
+            printf("\n");
+            mismatches += BenchBatch(n, dataIn, strength >= 0.0f ? strength : 1.0f, reps);
+            printf("\n");
+            BenchStack(n, dataIn, lutSize, slices, strength >= 0.0f ? strength : 0.3f, reps, threads);
+            printf("\n");
+            BenchAffine(lutSize, strength >= 0.0f ? strength : 0.3f, reps, threads);
+        }
+    }
+
+    if (mismatches)
+    {
+        fprintf(stderr, "%d SIMD kernel results differ from the scalar ones\n", mismatches);
+        return 1;
+    }
+
+    return 0;
+}
@@ -9,6 +9,7 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "CBLuts.h"
+#include "CBThreads.h"
 
 #include "ColourMaps.h"
 
@@ -17,9 +18,33 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #ifdef _MSC_VER
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+    #include <direct.h>
+    #include <fcntl.h>
+    #include <io.h>
+    #include <process.h>
     #define strlcpy(d, s, ds) strcpy_s(d, ds, s)
+    #define strdup _strdup
+    #define getpid _getpid
+#else
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <glob.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
 #endif
 
 using namespace CBLut;
@@ -52,6 +77,18 @@ namespace
         c.z < 0.0f ? 0.0f : c.z > 1.0f ? 1.0f : c.z };
     }
 
+    void ClampUnit(int n, float r[], float g[], float b[])
+    {
+        for (int i = 0; i < n; i++)
+        {
+            Vec3f c = ClampUnit(Vec3f { r[i], g[i], b[i] });
+
+            r[i] = c.x;
+            g[i] = c.y;
+            b[i] = c.z;
+        }
+    }
+
     Vec3f LMSError(Vec3f rgb, const Mat3f& lmsTransform)
     {
         Vec3f lms = (kLMSFromRGB * rgb);
@@ -112,46 +149,6 @@ namespace
         
         return kRGBFromLMS * lmsS;
     }
-
-    template<class T> void CreateLUT(T xform, RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
-    {
-        constexpr int scale  = 256 / kLUTSize;
-        constexpr int offset = scale / 2;
-
-        for (int i = 0; i < kLUTSize; i++)
-        for (int j = 0; j < kLUTSize; j++)
-        for (int k = 0; k < kLUTSize; k++)
-        {
-            // Vec3f c{ (k + 0.5f) / kLUTSize, (j + 0.5f) / kLUTSize, (i + 0.5f) / kLUTSize };
-            RGBA32 identity = { uint8_t(k * scale + offset), uint8_t(j * scale + offset), uint8_t(i * scale + offset), 255 };
-
-            Vec3f c = FromRGBA32u(identity);
-
-            c = xform(c);
-
-            rgbLUT[i][j][k] = ToRGBA32u(c);
-        }
-    }
-
-    template<class T> void Transform(T xform, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
-    {
-        for (int i = 0; i < n; i++)
-        {
-            Vec3f c = FromRGBA32(dataIn[i]);
-
-            c = xform(c);
-
-            dataOut[i] = ToRGBA32(c);
-        }
-    }
-
-    template<class T> inline void PerformOp(T xform, RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
-    {
-        if (dataOut)
-            Transform(xform, n, dataIn, dataOut);
-        else
-            CreateLUT(xform, rgbLUT);
-    }
 }
 
 
@@ -180,120 +177,2140 @@ namespace
         kPassThrough,
     };
 
-    void CreateImage(tImageOp op, tCBType cbType, float strength, int w, int h, const RGBA32* dataIn, const char* dataInName, bool noLUT)
+    const char* const kImageOpSuffixes[] =
     {
-        if (cbType == kAll)
+        "_simulate",
+        "_error",
+        "_daltonise",
+        "_correct",
+        "_simulate_daltonised",
+        "_simulate_corrected",
+        "",
+    };
+
+    inline Vec3f ImageOp(tImageOp op, tLMS lmsType, float strength, Vec3f c)
+    {
+        switch (op)
+        {
+        case kSimulate:
+            return Simulate(c, lmsType, strength);
+        case kError:
+            return RGBError(c, lmsType, strength);
+        case kDaltonise:
+            return Daltonise(c, lmsType, strength);
+        case kCorrect:
+            return Correct(c, lmsType, strength);
+        case kDaltoniseSimulate:
+            return Simulate(ClampUnit(Daltonise(c, lmsType, strength)), lmsType, strength);
+        case kCorrectSimulate:
+            return Simulate(ClampUnit(Correct(c, lmsType, strength)), lmsType, strength);
+        default:
+            return c;
+        }
+    }
+
+    // Batch version of the above, for n <= kMaxLUTSize planar colours
+    void ImageOp(tImageOp op, tLMS lmsType, float strength, int n, float r[], float g[], float b[])
+    {
+        assert(n <= kMaxLUTSize);
+
+        switch (op)
+        {
+        case kSimulate:
+            Simulate(n, r, g, b, lmsType, strength);
+            break;
+        case kError:
+            {
+                float sr[kMaxLUTSize];
+                float sg[kMaxLUTSize];
+                float sb[kMaxLUTSize];
+
+                memcpy(sr, r, n * sizeof(float));
+                memcpy(sg, g, n * sizeof(float));
+                memcpy(sb, b, n * sizeof(float));
+
+                Simulate(n, sr, sg, sb, lmsType, strength);
+
+                for (int i = 0; i < n; i++)
+                {
+                    r[i] -= sr[i];
+                    g[i] -= sg[i];
+                    b[i] -= sb[i];
+                }
+            }
+            break;
+        case kDaltonise:
+            Daltonise(n, r, g, b, lmsType, strength);
+            break;
+        case kCorrect:
+            Correct(n, r, g, b, lmsType, strength);
+            break;
+        case kDaltoniseSimulate:
+            Daltonise(n, r, g, b, lmsType, strength);
+            ClampUnit(n, r, g, b);
+            Simulate(n, r, g, b, lmsType, strength);
+            break;
+        case kCorrectSimulate:
+            Correct(n, r, g, b, lmsType, strength);
+            ClampUnit(n, r, g, b);
+            Simulate(n, r, g, b, lmsType, strength);
+            break;
+        default:
+            break;
+        }
+    }
+
+    struct cFusedPass;
+
+    struct cSettings
+    {
+        float       strength = 1.0f;
+        bool        noLUT    = false;       // directly transform images rather than going via a LUT
+        bool        palette  = false;       // when transforming directly, do so once per distinct colour
+        bool        matrix   = false;       // when transforming directly, do so via the op's composed matrices
+        bool        printMatrix = false;    // print the op's composed matrices rather than emitting an image or lut
+        tLUTInterp  interp   = kInterpDiagonal;
+        int         lutSize  = kLUTSize;
+        float       shaper   = 0.0f;        // if > 0, generate shaped luts, with samples spaced along this power curve, see -H
+        int         threads  = 0;           // 0 = all hardware threads
+        cFusedPass* fused    = 0;           // if set, image ops are queued here rather than run immediately
+        const char* cacheDir = 0;           // if set, generated luts are kept here, and reused by later runs
+        bool        binaryLUT = false;      // emit luts as binary lut files rather than pngs
+        int         yuvSpace = -1;          // if >= 0, the tYUVSpace of YCbCr luts to generate, in place of RGB ones
+        float       compare  = 0.0f;        // if > 0, report the accuracy and speed of the lut path against the direct one, with this deltaE threshold, rather than emitting images
+        const RGBA64* deepIn = 0;           // if set, the 16-bit source that dataIn was narrowed from, which images are generated from instead, see -D
+    };
+
+    // Fused processing. Rather than running each requested op over the whole
+    // image in turn, we queue them up, and then make a single pass over the
+    // image, applying every op to each tile of the source while it's in cache.
+    constexpr int kMaxFusedOps   = 32;
+    constexpr int kFusedTileSize = 65536;   // pixels: 256KB of source, leaving room in L2 for the current LUT
+    constexpr int kMaxRemaps     = 16;
+
+    typedef Vec3f tRemap(Vec3f c);          // channel remapping applied to the source, see -g/-r
+
+    struct cFileList
+    {
+        char** paths    = 0;
+        int    count    = 0;
+        int    capacity = 0;
+    };
+
+    struct cMappedFile
+    {
+        void*  data = 0;
+        size_t size = 0;
+    };
+
+    struct cFusedOp
+    {
+        tImageOp    op;
+        tLMS        lmsType;
+        cSettings   settings;
+        RGBLUT      lut;
+        cMappedFile lutFile;                // if lut came from the cache, its mapping
+        RGBA32*     dataOut;
+        char        filename[256];
+    };
+
+    struct cFusedPass
+    {
+        bool          compare = false;      // also time running the ops one after the other, and report the difference
+        bool          stream  = false;      // stream subsequent -f sources rather than loading them
+        bool          video   = false;      // stream Y4M video from stdin to stdout instead
+        int           yuvMatrix = 0;        // BT.601 or BT.709 for the video, or 0 for 709 if it has 720 rows or more, otherwise 601
+        bool          videoFailed = false;  // set if a video stream was malformed or couldn't be written, so we exit with an error
+        int           w       = 0;
+        int           h       = 0;
+        const RGBA32* dataIn  = 0;
+        int           numOps  = 0;
+        cFusedOp      ops[kMaxFusedOps];
+
+        char          streamPath[256] = ""; // if set, the source is decoded a band of rows at a time, rather than via dataIn
+        cFileList     batch;                // if non-empty, the ops are applied to each of these files instead
+        int           numRemaps = 0;        // remaps to apply to each streamed or batch source, in order
+        tRemap*       remaps[kMaxRemaps];
+    };
+
+    void CreateOpLUT(tImageOp op, tLMS lmsType, const cSettings& settings, const RGBLUT& lut)
+    {
+        const float strength = settings.strength;
+
+        if (op == kPassThrough)
+            CreateIdentityLUT(lut);
+        else if (settings.yuvSpace >= 0)
+            CreateYUVLUTBatch([op, lmsType, strength](int n, float r[], float g[], float b[]) { ImageOp(op, lmsType, strength, n, r, g, b); }, lut, tYUVSpace(settings.yuvSpace), settings.threads);
+        else
+            CreateLUTBatch([op, lmsType, strength](int n, float r[], float g[], float b[]) { ImageOp(op, lmsType, strength, n, r, g, b); }, lut, settings.threads);
+    }
+
+    // Binary lut files, see LUTFileHeader
+    bool WriteLUTFile(const char* path, const RGBLUT& lut, uint64_t userData = 0)
+    {
+        LUTFileHeader header = MakeLUTFileHeader(lut, userData);
+        size_t numSamples = size_t(lut.size) * lut.size * lut.size;
+
+        FILE* file = fopen(path, "wb");
+
+        if (!file)
+            return false;
+
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+               && (!lut.shaper || fwrite(lut.shaper, sizeof(uint16_t), kLUTShaperEntries, file) == kLUTShaperEntries)
+               && fwrite(lut.data, sizeof(RGBA32), numSamples, file) == numSamples;
+
+        return fclose(file) == 0 && ok;
+    }
+
+    bool MapFile(const char* path, cMappedFile* file)   // map the given file read-only, returns false if it doesn't exist or is empty
+    {
+        *file = cMappedFile();
+
+    #ifdef _MSC_VER
+        HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+
+        if (handle == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        HANDLE mapping = 0;
+
+        if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+            mapping = CreateFileMappingA(handle, 0, PAGE_READONLY, 0, 0, 0);
+
+        CloseHandle(handle);
+
+        if (mapping)
+        {
+            file->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            file->size = size_t(size.QuadPart);
+            CloseHandle(mapping);   // the view keeps the mapping alive
+        }
+    #else
+        int fd = open(path, O_RDONLY);
+
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (data != MAP_FAILED)
+            {
+                file->data = data;
+                file->size = st.st_size;
+            }
+        }
+
+        close(fd);
+    #endif
+
+        return file->data != 0;
+    }
+
+    bool IsLUTFile(const cMappedFile& file)     // returns true if the file claims to be a binary lut, whether or not it's valid
+    {
+        return file.size >= sizeof(uint32_t) && *(const uint32_t*) file.data == kLUTFileMagic;
+    }
+
+    void UnmapFile(cMappedFile* file)
+    {
+        if (!file->data)
+            return;
+
+    #ifdef _MSC_VER
+        UnmapViewOfFile(file->data);
+    #else
+        munmap(file->data, file->size);
+    #endif
+
+        *file = cMappedFile();
+    }
+
+    // LUT cache. Generated luts are saved to the -k directory as binary lut
+    // files, named by a hash of everything that affects their contents,
+    // including the model itself via ModelHash(). Changing the model constants
+    // thus changes every name, and stale entries are simply never looked up
+    // again. Hits are mapped, so a warm start does no generation or decoding.
+    constexpr uint32_t kLUTCacheVersion = 3;
+
+    uint64_t LUTCacheKey(tImageOp op, tLMS lmsType, const cSettings& settings)
+    {
+        uint32_t strengthBits;
+        memcpy(&strengthBits, &settings.strength, sizeof(strengthBits));
+
+        uint32_t shaperBits;
+        memcpy(&shaperBits, &settings.shaper, sizeof(shaperBits));
+
+        // The SIMD level isn't needed, as the batch model functions give identical results at each, so hosts can share entries
+        const uint64_t fields[] = { kLUTCacheVersion, ModelHash(), uint64_t(op), uint64_t(lmsType), strengthBits, uint64_t(settings.lutSize), uint64_t(settings.yuvSpace + 1), shaperBits };
+        const uint8_t* p = (const uint8_t*) fields;
+
+        uint64_t h = 0xcbf29ce484222325ull;     // FNV-1a
+
+        for (size_t i = 0; i < sizeof(fields); i++)
+            h = (h ^ p[i]) * 0x100000001b3ull;
+
+        return h;
+    }
+
+    void WriteLUTCacheFile(const char* path, uint64_t key, const RGBLUT& lut)
+    {
+        // Write to a private name and rename into place, so other runs never see a partial file
+        char tempPath[1024];
+
+        if (snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", path, int(getpid())) >= int(sizeof(tempPath)))
         {
-            CreateImage(op, kProtanope,   strength, w, h, dataIn, dataInName, noLUT);
-            CreateImage(op, kDeuteranope, strength, w, h, dataIn, dataInName, noLUT);
-            CreateImage(op, kTritanope,   strength, w, h, dataIn, dataInName, noLUT);
+            fprintf(stderr, "Cached LUT path %s is too long, skipping\n", path);   // a truncated name could be shared with other runs
             return;
-        };
+        }
 
-        tLMS lmsType = kL;
-        char filename[256] = "";
+        bool ok = WriteLUTFile(tempPath, lut, key);
 
-        if (dataIn)
-            snprintf(filename, sizeof(filename), "%s_", dataInName);
+    #ifdef _MSC_VER
+        if (ok)
+            remove(path);   // rename won't replace an existing file here
+    #endif
 
-        switch (cbType)
+        if (!ok || rename(tempPath, path) != 0)
         {
-        case kIdentity:
-            strcat(filename, "identity");
+            remove(tempPath);
+            fprintf(stderr, "Couldn't write cached LUT %s\n", path);
+        }
+    }
+
+    RGBLUT AllocOpLUT(const cSettings& settings)
+    {
+        return settings.shaper > 0.0f ? AllocShapedLUT(settings.lutSize, settings.shaper) : AllocLUT(settings.lutSize);
+    }
+
+    RGBLUT OpLUT(tImageOp op, tLMS lmsType, const cSettings& settings, cMappedFile* file)  // returns the op's LUT, mapped from the cache if possible. Release with ReleaseOpLUT
+    {
+        *file = cMappedFile();
+
+        uint64_t key = LUTCacheKey(op, lmsType, settings);
+
+        char path[1024];
+        bool cached = settings.cacheDir != 0;
+
+        if (cached && snprintf(path, sizeof(path), "%s/%016llx.cblut", settings.cacheDir, (unsigned long long) key) >= int(sizeof(path)))
+        {
+            fprintf(stderr, "LUT cache directory %s is too long, not caching\n", settings.cacheDir);
+            cached = false;
+        }
+
+        if (!cached)
+        {
+            RGBLUT lut = AllocOpLUT(settings);
+            CreateOpLUT(op, lmsType, settings, lut);
+            return lut;
+        }
+
+        if (MapFile(path, file))
+        {
+            RGBLUT lut;
+
+            if (LUTFromFileData(file->data, file->size, &lut) && ((const LUTFileHeader*) file->data)->userData == key && lut.size == settings.lutSize)
+                return lut;
+
+            UnmapFile(file);    // damaged, so regenerate it
+        }
+
+        RGBLUT lut = AllocOpLUT(settings);
+        CreateOpLUT(op, lmsType, settings, lut);
+        WriteLUTCacheFile(path, key, lut);
+
+        return lut;
+    }
+
+    void ReleaseOpLUT(RGBLUT* lut, cMappedFile* file)
+    {
+        if (file->data)
+        {
+            UnmapFile(file);
+            lut->data   = 0;
+            lut->shaper = 0;
+        }
+        else
+            FreeLUT(lut);
+    }
+
+    // Matrix form of an image op: c' = second * clamp(first * c), where the clamp and second matrix
+    // are only needed by the ops that simulate the result of a correction.
+    struct cMatrixOp
+    {
+        Mat3f first;
+        bool  clamp;
+        Mat3f second;
+    };
+
+    cMatrixOp ImageOpMatrix(tImageOp op, tLMS lmsType, float strength)
+    {
+        const Mat3f kIdentity = { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } };
+        cMatrixOp result = { kIdentity, false, kIdentity };
+
+        switch (op)
+        {
+        case kSimulate:
+            result.first = SimulateMatrix(lmsType, strength);
             break;
-        case kProtanope:
-            strcat(filename, "protanope");
-            lmsType = kL;
+        case kError:
+            {
+                Mat3f sm = SimulateMatrix(lmsType, strength);
+                result.first = { kIdentity.x - sm.x, kIdentity.y - sm.y, kIdentity.z - sm.z };
+            }
             break;
-        case kDeuteranope:
-            strcat(filename, "deuteranope");
-            lmsType = kM;
+        case kDaltonise:
+            result.first = DaltoniseMatrix(lmsType, strength);
             break;
-        case kTritanope:
-            strcat(filename, "tritanope");
-            lmsType = kS;
+        case kCorrect:
+            result.first = CorrectMatrix(lmsType, strength);
+            break;
+        case kDaltoniseSimulate:
+            result.first  = DaltoniseMatrix(lmsType, strength);
+            result.clamp  = true;
+            result.second = SimulateMatrix(lmsType, strength);
+            break;
+        case kCorrectSimulate:
+            result.first  = CorrectMatrix(lmsType, strength);
+            result.clamp  = true;
+            result.second = SimulateMatrix(lmsType, strength);
             break;
         default:
+            break;
+        }
+
+        return result;
+    }
+
+    void TransformMatrixOp(const cMatrixOp& mop, int n, const RGBA32 dataIn[], RGBA32 dataOut[], int numThreads)
+    {
+        if (!mop.clamp)
+        {
+            ParallelFor(n, kParallelChunkSize, numThreads,
+                [&mop, dataIn, dataOut](int begin, int end) { TransformMatrix(mop.first, end - begin, dataIn + begin, dataOut + begin); });
+            return;
+        }
+
+        ParallelFor(n, kParallelChunkSize, numThreads,
+            [&mop, dataIn, dataOut](int begin, int end)
+            {
+                const int kBlockSize = 256;
+
+                float r[kBlockSize];
+                float g[kBlockSize];
+                float b[kBlockSize];
+
+                for (int i = begin; i < end; i += kBlockSize)
+                {
+                    int count = end - i < kBlockSize ? end - i : kBlockSize;
+
+                    for (int j = 0; j < count; j++)
+                    {
+                        Vec3f c = FromRGBA32Fast(dataIn[i + j]);
+
+                        r[j] = c.x;
+                        g[j] = c.y;
+                        b[j] = c.z;
+                    }
+
+                    TransformMatrix(mop.first, count, r, g, b);
+                    ClampUnit(count, r, g, b);
+                    TransformMatrix(mop.second, count, r, g, b);
+
+                    for (int j = 0; j < count; j++)
+                        dataOut[i + j] = ToRGBA32Fast({ r[j], g[j], b[j] });
+                }
+            }
+        );
+    }
+
+    void PrintMatrix(const char* name, const char* suffix, const Mat3f& m)
+    {
+        // Rows of m, which is applied to column vectors. (GLSL users should use 'c * m' or transpose.)
+        printf("const float %s%s[3][3] =\n{\n", name, suffix);
+        printf("    { %10.7ff, %10.7ff, %10.7ff },\n", m.x.x, m.x.y, m.x.z);
+        printf("    { %10.7ff, %10.7ff, %10.7ff },\n", m.y.x, m.y.y, m.y.z);
+        printf("    { %10.7ff, %10.7ff, %10.7ff },\n", m.z.x, m.z.y, m.z.z);
+        printf("};\n");
+    }
+
+    bool TransformOp(tImageOp op, tLMS lmsType, const cSettings& settings, int n, const RGBA32 dataIn[], RGBA32 dataOut[])  // returns false if palette mode had to fall back
+    {
+        const float strength = settings.strength;
+        auto xform = [op, lmsType, strength](Vec3f c) { return ImageOp(op, lmsType, strength, c); };
+
+        if (settings.matrix)
+        {
+            TransformMatrixOp(ImageOpMatrix(op, lmsType, strength), n, dataIn, dataOut, settings.threads);
+            return true;
+        }
+
+        if (settings.palette)
+            return TransformPalette(xform, n, dataIn, dataOut);
+
+        Transform(xform, n, dataIn, dataOut);
+        return true;
+    }
+
+    // Write the given image as a png, compressing bands of rows in parallel. The bands depend only on
+    // the image size, so the output is the same however many threads are used.
+    constexpr int kPNGBandPixels = 256 * 1024;
+
+    bool WritePNG(const char* filename, int w, int h, const RGBA32* data, int numThreads)
+    {
+        int bandRows = kPNGBandPixels / w;
+
+        if (bandRows < 1)
+            bandRows = 1;
+
+        int numBands = (h + bandRows - 1) / bandRows;
+        stbi_png_band* bands = new stbi_png_band[numBands];
+
+        ParallelFor(numBands, 1, numThreads,
+            [bands, bandRows, w, h, data](int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    int y0 = i * bandRows;
+                    int y1 = h - y0 > bandRows ? y0 + bandRows : h;
+
+                    stbi_write_png_band(bands + i, (stbi_uc*) data, 0, w, h, 4, y0, y1);
+                }
+            }
+        );
+
+        int pngSize;
+        stbi_uc* png = stbi_write_png_bands_to_mem(bands, numBands, w, h, 4, &pngSize);
+        delete[] bands;
+
+        if (!png)
+            return false;
+
+        FILE* file = fopen(filename, "wb");
+
+        if (file)
+        {
+            fwrite(png, 1, pngSize, file);
+            fclose(file);
+        }
+
+        free(png);
+        return file != 0;
+    }
+
+    // The shaper of a png lut goes alongside it, as a 256 x 1 16-bit png of the red, green, and
+    // blue curves, scaled so that 65535 is the last sample. E.g., x_lut.png has x_lut_shaper.png.
+    void ShaperPNGPath(const char* lutPath, char* path, size_t pathSize)
+    {
+        const char* ext = strrchr(lutPath, '.');
+        int stem = ext ? int(ext - lutPath) : int(strlen(lutPath));
+
+        snprintf(path, pathSize, "%.*s_shaper.png", stem, lutPath);
+    }
+
+    bool WriteShaperPNG(const char* path, const RGBLUT& lut)
+    {
+        const uint32_t scale = (lut.size - 1) << kLUTShaperBits;
+        uint16_t curves[256 * 3];
+
+        for (int v = 0; v < 256; v++)
+            for (int j = 0; j < 3; j++)
+                curves[3 * v + j] = uint16_t((lut.shaper[256 * j + v] * 65535u + scale / 2) / scale);
+
+        return stbi_write_png_16(path, 256, 1, 3, curves, 0) != 0;
+    }
+
+    bool ReadShaperPNG(const char* path, const RGBLUT& lut)     // fill lut's shaper from the given png, returns false if there isn't a valid one
+    {
+        int w, h;
+        uint16_t* curves = stbi_load_16(path, &w, &h, 0, 3);
+
+        if (!curves)
+            return false;
+
+        const uint32_t scale = (lut.size - 1) << kLUTShaperBits;
+        bool ok = w == 256 && h == 1;
+
+        for (int v = 0; ok && v < 256; v++)
+            for (int j = 0; j < 3; j++)
+                lut.shaper[256 * j + v] = uint16_t((curves[3 * v + j] * scale + 32767) / 65535);
+
+        stbi_image_free(curves);
+        return ok;
+    }
+
+    double Seconds()
+    {
+        using namespace std::chrono;
+        return duration<double>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    void ApplyFusedOp(const cFusedOp& fop, int begin, int end, const RGBA32* dataIn)
+    {
+        if (fop.lut.data)
+            ApplyLUT(fop.lut, end - begin, dataIn + begin, fop.dataOut + begin, fop.settings.interp);
+        else
+            TransformOp(fop.op, fop.lmsType, fop.settings, end - begin, dataIn + begin, fop.dataOut + begin);
+    }
+
+    void BeginFusedOps(cFusedPass* pass, int n)    // allocate each op's output of n pixels, if any, and create its LUT if it needs one
+    {
+        for (int i = 0; i < pass->numOps; i++)
+        {
+            cFusedOp& fop = pass->ops[i];
+
+            fop.dataOut = n ? new RGBA32[n] : 0;
+
+            if (pass->compare && n)
+                memset(fop.dataOut, 0, n * sizeof(RGBA32));     // so neither timing includes the cost of faulting in fresh pages
+
+            if (fop.settings.noLUT || fop.lut.data)
+                continue;
+
+            fop.lut = OpLUT(fop.op, fop.lmsType, fop.settings, &fop.lutFile);
+        }
+    }
+
+    void EndFusedOps(cFusedPass* pass)
+    {
+        for (int i = 0; i < pass->numOps; i++)
+        {
+            cFusedOp& fop = pass->ops[i];
+
+            delete[] fop.dataOut;
+            ReleaseOpLUT(&fop.lut, &fop.lutFile);
+        }
+
+        pass->numOps = 0;
+    }
+
+    // Streamed processing. Rather than loading the whole source, we decode it a
+    // band of rows at a time, run the band through every op, and hand each
+    // result to that op's incremental png writer, so memory use depends only on
+    // the image width.
+    struct cStreamState
+    {
+        cFusedPass*       pass;
+        int               w;                // as read from the source
+        int               h;
+        RGBA32*           band;             // source rows decoded so far, up to bandRows
+        int               bandRows;
+        int               numRows;
+        stbi_png_writer** writers;          // one per op, or 0 until the first row arrives
+    };
+
+    bool OpenStreamWriters(cStreamState* state)
+    {
+        cFusedPass* pass = state->pass;
+
+        if (state->w != pass->w || state->h != pass->h)     // changed since -f, leave it to the fallback
+            return false;
+
+        state->writers = new stbi_png_writer*[pass->numOps]();
+
+        for (int i = 0; i < pass->numOps; i++)
+        {
+            printf("Saving %s\n", pass->ops[i].filename);
+            state->writers[i] = stbi_write_png_begin(pass->ops[i].filename, pass->w, pass->h, 4, state->bandRows);
+
+            if (!state->writers[i])
+            {
+                fprintf(stderr, "Couldn't write %s\n", pass->ops[i].filename);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void ProcessStreamBand(cStreamState* state)
+    {
+        cFusedPass*       pass    = state->pass;
+        const RGBA32*     dataIn  = state->band;
+        int               numOps  = pass->numOps;
+        cFusedOp*         ops     = pass->ops;
+        int               threads = ops[0].settings.threads;
+        int               numRows = state->numRows;
+        stbi_png_writer** writers = state->writers;
+        int               n       = pass->w * numRows;
+
+        for (int i = 0; i < pass->numRemaps; i++)
+            Transform(pass->remaps[i], n, state->band, state->band);
+
+        ParallelFor(n, kFusedTileSize, threads,
+            [dataIn, numOps, ops](int begin, int end)
+            {
+                for (int i = 0; i < numOps; i++)
+                    ApplyFusedOp(ops[i], begin, end, dataIn);
+            }
+        );
+
+        // The writers are independent, so compress each op's band on its own thread
+        ParallelFor(numOps, 1, threads,
+            [writers, ops, numRows](int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                    stbi_write_png_rows(writers[i], ops[i].dataOut, numRows, 0);
+            }
+        );
+
+        state->numRows = 0;
+    }
+
+    int StreamRow(void* user, int y, stbi_uc* row)
+    {
+        cStreamState* state = (cStreamState*) user;
+        cFusedPass*   pass  = state->pass;
+
+        // Only create the outputs once we know the source can be streamed
+        if (!state->writers && !OpenStreamWriters(state))
+            return 0;
+
+        memcpy(state->band + state->numRows * pass->w, row, pass->w * sizeof(RGBA32));
+
+        if (++state->numRows == state->bandRows || y == pass->h - 1)
+            ProcessStreamBand(state);
+
+        return 1;
+    }
+
+    bool RunStreamedPass(cFusedPass* pass)  // returns false if the source isn't a png that can be streamed, in which case nothing is written
+    {
+        int bandRows = kPNGBandPixels / pass->w;
+
+        if (bandRows < 1)
+            bandRows = 1;
+        if (bandRows > pass->h)
+            bandRows = pass->h;
+
+        cStreamState state;
+        state.pass     = pass;
+        state.band     = new RGBA32[pass->w * bandRows];
+        state.bandRows = bandRows;
+        state.numRows  = 0;
+        state.writers  = 0;
+
+        BeginFusedOps(pass, pass->w * bandRows);
+
+        double t0 = Seconds();
+
+        bool ok = stbi_load_png_rows(pass->streamPath, &state.w, &state.h, StreamRow, &state) != 0;
+        bool started = state.writers != 0;
+
+        if (started)
+        {
+            if (!ok)
+                fprintf(stderr, "Error streaming %s: %s\n", pass->streamPath, stbi_failure_reason());
+
+            for (int i = 0; i < pass->numOps; i++)
+                if (state.writers[i] && !stbi_write_png_end(state.writers[i]) && ok)
+                    fprintf(stderr, "Error writing %s\n", pass->ops[i].filename);
+
+            if (ok)
+                printf("Streamed %d ops in a single pass: %.1f ms\n", pass->numOps, (Seconds() - t0) * 1e3);
+
+            delete[] state.writers;
+            EndFusedOps(pass);
+        }
+        else
+        {
+            // Keep the ops and their LUTs for the caller's fallback
+            for (int i = 0; i < pass->numOps; i++)
+            {
+                delete[] pass->ops[i].dataOut;
+                pass->ops[i].dataOut = 0;
+            }
+        }
+
+        delete[] state.band;
+
+        return started;
+    }
+
+    // Video processing. YUV4MPEG2 frames are read from stdin, run through a
+    // single op, and written back out to stdout in the same format, so that,
+    // e.g., ffmpeg can pipe video straight through. A reader and a writer thread
+    // pass frames to and from the main thread via a small ring of frame buffers,
+    // so that reading, transforming, and writing frames all overlap.
+    constexpr int kVideoSlots     = 4;      // allows two frames to be queued on each side of the transform
+    constexpr int kVideoBandRows  = 16;     // rows per parallel task, a multiple of the chroma subsampling
+    constexpr int kY4MLineSize    = 1024;
+
+    struct cY4MFormat
+    {
+        int         w         = 0;
+        int         h         = 0;
+        int         chromaShiftX = 1;       // log2 of the chroma subsampling ratio along x and y, 420 by default
+        int         chromaShiftY = 1;
+        bool        fullRange = false;      // see XCOLORRANGE
+        size_t      frameSize = 0;          // all three planes
+    };
+
+    struct cYUVCoeffs       // 16.16 fixed point
+    {
+        int yOffset;
+        int yScale;
+        int rFromV, gFromU, gFromV, bFromU;     // YUV -> RGB, for centred chroma
+
+        int yFromR, yFromG, yFromB;             // RGB -> YUV, including the range scale
+        int uFromR, uFromG, uFromB;
+        int vFromR, vFromG, vFromB;
+    };
+
+    cYUVCoeffs YUVCoeffs(tYUVSpace space)
+    {
+        bool hd        = space == kYUV709 || space == kYUV709Full;
+        bool fullRange = space == kYUV601Full || space == kYUV709Full;
+
+        // Kr/Kb as per BT.601 and BT.709
+        double kr = hd ? 0.2126 : 0.299;
+        double kb = hd ? 0.0722 : 0.114;
+        double kg = 1.0 - kr - kb;
+
+        double yRange = fullRange ? 255.0 : 219.0;
+        double cRange = fullRange ? 255.0 : 224.0;
+        double s = 65536.0;
+
+        auto fixed = [s](double v) { return int(floor(v * s + 0.5)); };
+
+        cYUVCoeffs k;
+
+        k.yOffset = fullRange ? 0 : 16;
+        k.yScale  = fixed(255.0 / yRange);
+        k.rFromV  = fixed(255.0 / cRange * 2.0 * (1.0 - kr));
+        k.gFromU  = fixed(255.0 / cRange * -2.0 * kb * (1.0 - kb) / kg);
+        k.gFromV  = fixed(255.0 / cRange * -2.0 * kr * (1.0 - kr) / kg);
+        k.bFromU  = fixed(255.0 / cRange * 2.0 * (1.0 - kb));
+
+        double cu = cRange / (255.0 * 2.0 * (1.0 - kb));
+        double cv = cRange / (255.0 * 2.0 * (1.0 - kr));
+
+        k.yFromR = fixed(yRange / 255.0 * kr);
+        k.yFromG = fixed(yRange / 255.0 * kg);
+        k.yFromB = fixed(yRange / 255.0 * kb);
+        k.uFromR = fixed(cu * -kr);
+        k.uFromG = fixed(cu * -kg);
+        k.uFromB = fixed(cu * (1.0 - kb));
+        k.vFromR = fixed(cv * (1.0 - kr));
+        k.vFromG = fixed(cv * -kg);
+        k.vFromB = fixed(cv * -kb);
+
+        return k;
+    }
+
+    inline uint32_t ClampByte(int v)
+    {
+        v = v < 0 ? 0 : v;
+        return v > 255 ? 255 : v;
+    }
+
+    inline uint32_t YUVPixel(const cYUVCoeffs& k, int y, int u, int v)
+    {
+        int luma = (y - k.yOffset) * k.yScale + (1 << 15);
+
+        return ClampByte((luma + k.rFromV * v) >> 16)
+            | (ClampByte((luma + k.gFromU * u + k.gFromV * v) >> 16) << 8)
+            | (ClampByte((luma + k.bFromU * u) >> 16) << 16)
+            | 0xFF000000;
+    }
+
+    inline uint8_t YUVLuma(const cYUVCoeffs& k, uint32_t c)
+    {
+        return uint8_t(ClampByte((k.yFromR * int(c & 0xFF) + k.yFromG * int((c >> 8) & 0xFF) + k.yFromB * int((c >> 16) & 0xFF) + (k.yOffset << 16) + (1 << 15)) >> 16));
+    }
+
+    YUVPlanes FramePlanes(const cY4MFormat& fmt, uint8_t* frame)
+    {
+        YUVPlanes planes = I420Planes(fmt.w, fmt.h, frame);
+
+        planes.chromaShiftX = fmt.chromaShiftX;
+        planes.chromaShiftY = fmt.chromaShiftY;
+        planes.cStride      = (fmt.w + (1 << fmt.chromaShiftX) - 1) >> fmt.chromaShiftX;
+        planes.cr           = planes.cb + planes.cStride * ((fmt.h + (1 << fmt.chromaShiftY) - 1) >> fmt.chromaShiftY);
+
+        return planes;
+    }
+
+    void YUVToRGBA32(const YUVPlanes& planes, const cYUVCoeffs& k, int y0, int y1, RGBA32* dataOut)    // convert rows [y0, y1) to dataOut
+    {
+        const int w = planes.w;
+
+        for (int y = y0; y < y1; y++)
+        {
+            const uint8_t* rowY = planes.y  + y * planes.yStride;
+            const uint8_t* rowU = planes.cb + (y >> planes.chromaShiftY) * planes.cStride;
+            const uint8_t* rowV = planes.cr + (y >> planes.chromaShiftY) * planes.cStride;
+            uint32_t*      out  = (uint32_t*) (dataOut + (y - y0) * w);
+
+            if (planes.chromaShiftX == 0)
+            {
+                for (int x = 0; x < w; x++)
+                    out[x] = YUVPixel(k, rowY[x], rowU[x] - 128, rowV[x] - 128);
+
+                continue;
+            }
+
+            for (int x = 0; x < w; x++)
+                out[x] = YUVPixel(k, rowY[x], rowU[x >> 1] - 128, rowV[x >> 1] - 128);
+        }
+    }
+
+    void RGBA32ToYUV(const YUVPlanes& planes, const cYUVCoeffs& k, const RGBA32* dataIn, int y0, int y1)    // convert dataIn to rows [y0, y1). y0 must be a multiple of the chroma block height
+    {
+        const int w  = planes.w;
+        const int cw = (planes.w + (1 << planes.chromaShiftX) - 1) >> planes.chromaShiftX;
+        const int sx = planes.chromaShiftX;
+        const int sy = planes.chromaShiftY;
+
+        for (int y = y0; y < y1; y++)
+        {
+            const uint32_t* in   = (const uint32_t*) (dataIn + (y - y0) * w);
+            uint8_t*        rowY = planes.y + y * planes.yStride;
+
+            for (int x = 0; x < w; x++)
+                rowY[x] = YUVLuma(k, in[x]);
+        }
+
+        // Chroma is taken from the average colour of the 2x2 block of pixels each sample
+        // covers. Where the block is narrower, due to subsampling or an odd width or height,
+        // its pixels are counted more than once.
+        const int offset = (128 << 18) + (1 << 17);
+
+        for (int cy = y0 >> sy; cy < (y1 + (1 << sy) - 1) >> sy; cy++)
+        {
+            int py0 = (cy << sy) - y0;
+            int py1 = (cy << sy) + sy < y1 ? py0 + sy : py0;
+
+            const uint32_t* row0 = (const uint32_t*) (dataIn + py0 * w);
+            const uint32_t* row1 = (const uint32_t*) (dataIn + py1 * w);
+            uint8_t*        rowU = planes.cb + cy * planes.cStride;
+            uint8_t*        rowV = planes.cr + cy * planes.cStride;
+
+            for (int cx = 0; cx < cw; cx++)
+            {
+                int px0 = cx << sx;
+                int px1 = px0 + sx < w ? px0 + sx : px0;
+
+                uint32_t c00 = row0[px0], c01 = row0[px1];
+                uint32_t c10 = row1[px0], c11 = row1[px1];
+
+                // Red and blue are summed in parallel, as 4 x 255 fits in 16 bits
+                uint32_t rb = (c00 & 0xFF00FF) + (c01 & 0xFF00FF) + (c10 & 0xFF00FF) + (c11 & 0xFF00FF);
+                uint32_t g  = ((c00 >> 8) & 0xFF) + ((c01 >> 8) & 0xFF) + ((c10 >> 8) & 0xFF) + ((c11 >> 8) & 0xFF);
+
+                int r = int(rb & 0xFFFF);
+                int b = int(rb >> 16);
+
+                rowU[cx * planes.cStep] = uint8_t(ClampByte((k.uFromR * r + k.uFromG * int(g) + k.uFromB * b + offset) >> 18));
+                rowV[cx * planes.cStep] = uint8_t(ClampByte((k.vFromR * r + k.vFromG * int(g) + k.vFromB * b + offset) >> 18));
+            }
+        }
+    }
+
+    bool ReadY4MLine(FILE* file, char* buffer, int bufferSize)     // reads up to the next newline, which is dropped. Returns false on end of file, leaving 'buffer' empty if nothing was read, or if the line is too long
+    {
+        int n = 0;
+        bool ok = true;
+
+        for (;;)
+        {
+            int c = getc(file);
+
+            if (c == EOF || (c != '\n' && n == bufferSize - 1))
+            {
+                ok = false;
+                break;
+            }
+            if (c == '\n')
+                break;
+
+            buffer[n++] = char(c);
+        }
+
+        buffer[n] = 0;
+        return ok;
+    }
+
+    bool Y4MTokenIs(const char* token, size_t length, const char* name)   // whether the header token of the given length is exactly 'name'
+    {
+        return length == strlen(name) && strncmp(token, name, length) == 0;
+    }
+
+    bool ParseY4MHeader(const char* header, cY4MFormat* fmt)
+    {
+        if (strncmp(header, "YUV4MPEG2", 9) != 0)
+        {
+            fprintf(stderr, "Video stream isn't YUV4MPEG2\n");
+            return false;
+        }
+
+        for (const char* p = header + 9; *p; p++)
+        {
+            if (p[-1] != ' ')
+                continue;
+
+            if (p[0] == 'W')
+                fmt->w = atoi(p + 1);
+            else if (p[0] == 'H')
+                fmt->h = atoi(p + 1);
+            else if (p[0] == 'C')
+            {
+                size_t length = strcspn(p + 1, " ");
+
+                if (Y4MTokenIs(p + 1, length, "420") || Y4MTokenIs(p + 1, length, "420jpeg") || Y4MTokenIs(p + 1, length, "420mpeg2") || Y4MTokenIs(p + 1, length, "420paldv"))
+                {
+                    fmt->chromaShiftX = 1;
+                    fmt->chromaShiftY = 1;
+                }
+                else if (Y4MTokenIs(p + 1, length, "422"))
+                {
+                    fmt->chromaShiftX = 1;
+                    fmt->chromaShiftY = 0;
+                }
+                else if (Y4MTokenIs(p + 1, length, "444"))
+                {
+                    fmt->chromaShiftX = 0;
+                    fmt->chromaShiftY = 0;
+                }
+                else
+                {
+                    fprintf(stderr, "Unsupported video colour space C%.*s, expecting 8-bit 420, 422, or 444\n", int(length), p + 1);
+                    return false;
+                }
+            }
+            else if (strncmp(p, "XCOLORRANGE=FULL", 16) == 0)
+                fmt->fullRange = true;
+        }
+
+        if (fmt->w <= 0 || fmt->h <= 0)
+        {
+            fprintf(stderr, "Bad video frame size %d x %d\n", fmt->w, fmt->h);
+            return false;
+        }
+
+        size_t cw = (fmt->w + (1 << fmt->chromaShiftX) - 1) >> fmt->chromaShiftX;
+        size_t ch = (fmt->h + (1 << fmt->chromaShiftY) - 1) >> fmt->chromaShiftY;
+
+        fmt->frameSize = size_t(fmt->w) * fmt->h + 2 * cw * ch;
+        return true;
+    }
+
+    class cFrameQueue       // blocking FIFO of frame slot indices
+    {
+    public:
+        void Push(int slot);
+        bool Pop(int* slot);    ///< Returns false once the queue is closed and empty
+        void Close();
+
+    protected:
+        std::mutex              mMutex;
+        std::condition_variable mCV;
+        int                     mSlots[kVideoSlots];
+        int                     mHead   = 0;
+        int                     mCount  = 0;
+        bool                    mClosed = false;
+    };
+
+    void cFrameQueue::Push(int slot)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            assert(mCount < kVideoSlots);
+            mSlots[(mHead + mCount++) % kVideoSlots] = slot;
+        }
+        mCV.notify_one();
+    }
+
+    bool cFrameQueue::Pop(int* slot)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCV.wait(lock, [this] { return mCount > 0 || mClosed; });
+
+        if (mCount == 0)
+            return false;
+
+        *slot = mSlots[mHead];
+        mHead = (mHead + 1) % kVideoSlots;
+        mCount--;
+        return true;
+    }
+
+    void cFrameQueue::Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mClosed = true;
+        }
+        mCV.notify_all();
+    }
+
+    struct cVideoFrame
+    {
+        uint8_t* data;
+        char     header[kY4MLineSize];      // the FRAME line, including any parameters
+    };
+
+    struct cVideoState
+    {
+        cY4MFormat        format;
+        cVideoFrame       frames[kVideoSlots];
+        cFrameQueue       free;             // slots ready to be read into
+        cFrameQueue       read;             // slots holding source frames
+        cFrameQueue       done;             // slots holding transformed frames
+        std::atomic<bool> failed { false }; // set on a read or write error, stops the reader
+    };
+
+    void ReadVideoFrames(cVideoState* state)
+    {
+        int slot;
+
+        while (!state->failed && state->free.Pop(&slot))
+        {
+            cVideoFrame& frame = state->frames[slot];
+
+            bool readHeader = ReadY4MLine(stdin, frame.header, sizeof(frame.header));
+
+            if (!readHeader && !frame.header[0] && feof(stdin))
+                break;  // end of stream
+
+            if (!readHeader || strncmp(frame.header, "FRAME", 5) != 0 || fread(frame.data, 1, state->format.frameSize, stdin) != state->format.frameSize)
+            {
+                fprintf(stderr, "Truncated or malformed video frame\n");
+                state->failed = true;
+                break;
+            }
+
+            state->read.Push(slot);
+        }
+
+        state->read.Close();
+    }
+
+    void WriteVideoFrames(cVideoState* state)
+    {
+        int slot;
+
+        while (state->done.Pop(&slot))
+        {
+            const cVideoFrame& frame = state->frames[slot];
+
+            if (!state->failed)
+            {
+                fputs(frame.header, stdout);
+                putc('\n', stdout);
+
+                if (fwrite(frame.data, 1, state->format.frameSize, stdout) != state->format.frameSize)
+                {
+                    fprintf(stderr, "Couldn't write video frame\n");
+                    state->failed = true;
+                }
+            }
+
+            state->free.Push(slot);
+        }
+
+        fflush(stdout);
+    }
+
+    void TransformVideoFrame(const cFusedPass* pass, const cYUVCoeffs& k, const YUVPlanes& planes, RGBA32* dataIn)
+    {
+        const cFusedOp& fop = pass->ops[0];
+
+        // With a YCbCr lut, the frame never leaves YCbCr
+        if (fop.settings.yuvSpace >= 0)
+        {
+            ApplyLUTParallel(fop.lut, planes, planes, fop.settings.interp, fop.settings.threads);
+            return;
+        }
+
+        // Otherwise each band is converted to RGB, transformed, and converted back while still in cache
+        int numBands = (planes.h + kVideoBandRows - 1) / kVideoBandRows;
+
+        ParallelFor(numBands, 1, fop.settings.threads,
+            [pass, &k, &planes, &fop, dataIn](int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    int y0 = i * kVideoBandRows;
+                    int y1 = planes.h - y0 > kVideoBandRows ? y0 + kVideoBandRows : planes.h;
+                    int p0 = y0 * planes.w;
+                    int p1 = y1 * planes.w;
+
+                    YUVToRGBA32(planes, k, y0, y1, dataIn + p0);
+
+                    for (int j = 0; j < pass->numRemaps; j++)
+                        Transform(pass->remaps[j], p1 - p0, dataIn + p0, dataIn + p0);
+
+                    ApplyFusedOp(fop, p0, p1, dataIn);
+                    RGBA32ToYUV(planes, k, fop.dataOut + p0, y0, y1);
+                }
+            }
+        );
+    }
+
+    bool RunVideoPass(cFusedPass* pass)     // returns false if the stream was malformed or couldn't be written
+    {
+        if (pass->numOps > 1)
+        {
+            fprintf(stderr, "Video streams can only have one operation applied, ignoring all but the first\n");
+
+            for (int i = 1; i < pass->numOps; i++)
+                ReleaseOpLUT(&pass->ops[i].lut, &pass->ops[i].lutFile);
+
+            pass->numOps = 1;
+        }
+
+    #ifdef _MSC_VER
+        _setmode(_fileno(stdin),  _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+    #endif
+
+        cVideoState* state = new cVideoState;
+        cY4MFormat&  fmt   = state->format;
+        char header[kY4MLineSize];
+
+        if (!ReadY4MLine(stdin, header, sizeof(header)) || !ParseY4MHeader(header, &fmt))
+        {
+            fprintf(stderr, "Couldn't read video stream header\n");
+            EndFusedOps(pass);
+            delete state;
+            return false;
+        }
+
+        int matrix = pass->yuvMatrix ? pass->yuvMatrix : fmt.h >= 720 ? 709 : 601;
+        tYUVSpace space;
+
+        if (matrix == 709)
+            space = fmt.fullRange ? kYUV709Full : kYUV709;
+        else
+            space = fmt.fullRange ? kYUV601Full : kYUV601;
+
+        cFusedOp& fop = pass->ops[0];
+
+        // Unless we need the RGB source, for a remap, a given RGB lut, direct transforms, or a shaped lut, build a YCbCr lut
+        bool yuvLUT = pass->numRemaps == 0 && !fop.lut.data && !fop.settings.noLUT && fop.settings.shaper <= 0.0f;
+
+        if (yuvLUT)
+            fop.settings.yuvSpace = space;
+
+        cYUVCoeffs k = YUVCoeffs(space);
+        int n = yuvLUT ? 0 : fmt.w * fmt.h;
+
+        fprintf(stderr, "Streaming %d x %d video, BT.%d %s range, via %s\n", fmt.w, fmt.h, matrix, fmt.fullRange ? "full" : "limited", yuvLUT ? "YCbCr lut" : "RGB");
+        fprintf(stdout, "%s\n", header);
+
+        BeginFusedOps(pass, n);
+
+        RGBA32* dataIn = n ? new RGBA32[n] : 0;
+
+        for (int i = 0; i < kVideoSlots; i++)
+        {
+            state->frames[i].data = new uint8_t[fmt.frameSize];
+            state->free.Push(i);
+        }
+
+        double t0 = Seconds();
+        int numFrames = 0;
+
+        std::thread reader(ReadVideoFrames,  state);
+        std::thread writer(WriteVideoFrames, state);
+
+        int slot;
+
+        while (state->read.Pop(&slot))
+        {
+            if (!state->failed)
+            {
+                TransformVideoFrame(pass, k, FramePlanes(fmt, state->frames[slot].data), dataIn);
+                numFrames++;
+            }
+
+            state->done.Push(slot);
+        }
+
+        state->done.Close();
+
+        reader.join();
+        writer.join();
+
+        double t = Seconds() - t0;
+
+        fprintf(stderr, "Processed %d frames in %.2f s: %.1f frames/s\n", numFrames, t, numFrames / t);
+
+        bool ok = !state->failed;
+
+        for (cVideoFrame& frame : state->frames)
+            delete[] frame.data;
+
+        delete[] dataIn;
+        delete state;
+
+        EndFusedOps(pass);
+        return ok;
+    }
+
+    // Batch processing. Each file is decoded, run through every op, and
+    // encoded by a single worker, with the workers spread over the thread pool,
+    // so that one file's decode overlaps with other files' transforms and
+    // encodes. The LUTs are built once, up front, and shared by all workers.
+    void GetFileName(char* buffer, size_t bufferSize, const char* path)
+    {
+        const char* lastSlash = strrchr(path, '/');
+        if (!lastSlash)
+            lastSlash = strrchr(path, '\\');
+
+        if (lastSlash)
+            strlcpy(buffer, lastSlash + 1, bufferSize);
+        else
+            strlcpy(buffer, path, bufferSize);
+
+        char* lastDot = strrchr(buffer, '.');
+
+        if (lastDot)
+            *lastDot = 0;
+    }
+
+    void AddFile(cFileList* list, const char* path)
+    {
+        if (list->count == list->capacity)
+        {
+            list->capacity = list->capacity ? 2 * list->capacity : 64;
+
+            char** paths = new char*[list->capacity];
+            if (list->count)
+                memcpy(paths, list->paths, list->count * sizeof(char*));
+
+            delete[] list->paths;
+            list->paths = paths;
+        }
+
+        list->paths[list->count++] = strdup(path);
+    }
+
+    void ClearFiles(cFileList* list)
+    {
+        for (int i = 0; i < list->count; i++)
+            free(list->paths[i]);
+
+        delete[] list->paths;
+        *list = cFileList();
+    }
+
+    bool IsImagePath(const char* path)
+    {
+        const char* ext = strrchr(path, '.');
+
+        if (!ext)
+            return false;
+
+        char lower[8] = "";
+        for (int i = 0; i < 7 && ext[i + 1]; i++)
+            lower[i] = tolower(ext[i + 1]);
+
+        return strcmp(lower, "png") == 0 || strcmp(lower, "jpg") == 0 || strcmp(lower, "jpeg") == 0;
+    }
+
+    bool AddFiles(cFileList* list, const char* spec)    // adds the images in the given directory, glob, or manifest, or the given image itself
+    {
+        struct stat st;
+        bool isDir = stat(spec, &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+        int  count = list->count;
+
+        if (isDir || strpbrk(spec, "*?["))
+        {
+            char path[1024];
+
+        #ifdef _MSC_VER
+            char pattern[1024];
+            snprintf(pattern, sizeof(pattern), isDir ? "%s/*" : "%s", spec);
+
+            // Matches are relative to the pattern's directory
+            char dir[1024] = "";
+            if (!isDir)
+            {
+                strlcpy(dir, spec, sizeof(dir));
+                char* lastSlash = strrchr(dir, '/') > strrchr(dir, '\\') ? strrchr(dir, '/') : strrchr(dir, '\\');
+                if (lastSlash)
+                    lastSlash[1] = 0;
+                else
+                    dir[0] = 0;
+            }
+
+            _finddata_t fd;
+            intptr_t handle = _findfirst(pattern, &fd);
+
+            if (handle != -1)
+            {
+                do
+                {
+                    if (fd.attrib & _A_SUBDIR)
+                        continue;
+                    if (isDir && !IsImagePath(fd.name))
+                        continue;
+
+                    snprintf(path, sizeof(path), isDir ? "%s/%s" : "%s%s", isDir ? spec : dir, fd.name);
+                    AddFile(list, path);
+                }
+                while (_findnext(handle, &fd) == 0);
+
+                _findclose(handle);
+            }
+        #else
+            if (isDir)
+            {
+                DIR* dir = opendir(spec);
+
+                if (!dir)
+                    return false;
+
+                while (dirent* entry = readdir(dir))
+                {
+                    snprintf(path, sizeof(path), "%s/%s", spec, entry->d_name);
+
+                    if (IsImagePath(entry->d_name) && stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG)
+                        AddFile(list, path);
+                }
+
+                closedir(dir);
+            }
+            else
+            {
+                glob_t matches;
+
+                if (glob(spec, 0, 0, &matches) == 0)
+                    for (size_t i = 0; i < matches.gl_pathc; i++)
+                        AddFile(list, matches.gl_pathv[i]);
+
+                globfree(&matches);
+            }
+        #endif
+
+            // Directory listings come in no particular order
+            qsort(list->paths + count, list->count - count, sizeof(char*),
+                [](const void* a, const void* b) { return strcmp(*(char* const*) a, *(char* const*) b); });
+
+            return true;
+        }
+
+        if (IsImagePath(spec))
+        {
+            AddFile(list, spec);
+            return true;
+        }
+
+        // A manifest, one path per line
+        FILE* file = fopen(spec, "r");
+
+        if (!file)
+            return false;
+
+        char line[1024];
+
+        while (fgets(line, sizeof(line), file))
+        {
+            char* end = line + strlen(line);
+
+            while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+                *--end = 0;
+
+            if (line[0] && line[0] != '#')
+                AddFile(list, line);
+        }
+
+        fclose(file);
+        return true;
+    }
+
+    int64_t FileSize(const char* path)
+    {
+        struct stat st;
+        return stat(path, &st) == 0 ? st.st_size : 0;
+    }
+
+    struct cBatchStats
+    {
+        std::atomic<int>     images  { 0 };
+        std::atomic<int>     failed  { 0 };
+        std::atomic<int64_t> bytesIn { 0 };
+        std::atomic<int64_t> bytesOut{ 0 };
+    };
+
+    void ProcessBatchFile(const cFusedPass* pass, const char* path, cBatchStats* stats)
+    {
+        int w, h;
+        RGBA32* dataIn = (RGBA32*) stbi_load(path, &w, &h, 0, 4);
+
+        if (!dataIn)
+        {
+            fprintf(stderr, "Couldn't read %s\n", path);
+            stats->failed++;
+            return;
+        }
+
+        int n = w * h;
+
+        for (int i = 0; i < pass->numRemaps; i++)
+            Transform(pass->remaps[i], n, dataIn, dataIn);
+
+        // Our own copies of the ops, sharing their LUTs, but with private outputs
+        int numOps = pass->numOps;
+        cFusedOp ops[kMaxFusedOps];
+
+        for (int i = 0; i < numOps; i++)
+        {
+            ops[i] = pass->ops[i];
+            ops[i].dataOut = new RGBA32[n];
+        }
+
+        for (int begin = 0; begin < n; begin += kFusedTileSize)
+        {
+            int end = n - begin > kFusedTileSize ? begin + kFusedTileSize : n;
+
+            for (int i = 0; i < numOps; i++)
+                ApplyFusedOp(ops[i], begin, end, dataIn);
+        }
+
+        stbi_image_free(dataIn);
+
+        char name[256];
+        GetFileName(name, sizeof(name), path);
+
+        for (int i = 0; i < numOps; i++)
+        {
+            char filename[512];
+            snprintf(filename, sizeof(filename), "%s_%s", name, ops[i].filename);
+
+            if (WritePNG(filename, w, h, ops[i].dataOut, ops[i].settings.threads))
+                stats->bytesOut += FileSize(filename);
+            else
+                fprintf(stderr, "Couldn't write %s\n", filename);
+
+            delete[] ops[i].dataOut;
+        }
+
+        stats->bytesIn += FileSize(path);
+        stats->images++;
+    }
+
+    void RunBatchPass(cFusedPass* pass)
+    {
+        BeginFusedOps(pass, 0);
+
+        const cFusedPass* constPass = pass;
+        cBatchStats stats;
+        double t0 = Seconds();
+
+        printf("Processing %d images with %d ops\n", pass->batch.count, pass->numOps);
+
+        ParallelFor(pass->batch.count, 1, pass->ops[0].settings.threads,
+            [constPass, &stats](int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                    ProcessBatchFile(constPass, constPass->batch.paths[i], &stats);
+            }
+        );
+
+        double t = Seconds() - t0;
+
+        printf("Processed %d images", stats.images.load());
+        if (stats.failed)
+            printf(" (%d failed)", stats.failed.load());
+        printf(" in %.2f s: %.1f images/s, %.1f MB/s read, %.1f MB/s written\n",
+            t, stats.images / t, stats.bytesIn / (t * 1e6), stats.bytesOut / (t * 1e6));
+
+        EndFusedOps(pass);
+    }
+
+    void RunFusedPass(cFusedPass* pass)
+    {
+        if (pass->numOps == 0)
+            return;
+
+        if (pass->video)
+        {
+            if (!RunVideoPass(pass))
+                pass->videoFailed = true;
+            return;
+        }
+
+        if (pass->batch.count)
+        {
+            RunBatchPass(pass);
+            return;
+        }
+
+        RGBA32* loaded = 0;
+
+        if (pass->streamPath[0])
+        {
+            if (RunStreamedPass(pass))
+                return;
+
+            // Not a png we can stream, e.g., a jpeg or 16-bit png, so fall back to loading it in full
+            loaded = (RGBA32*) stbi_load(pass->streamPath, &pass->w, &pass->h, 0, 4);
+
+            if (!loaded)
+            {
+                fprintf(stderr, "Couldn't read %s\n", pass->streamPath);
+                EndFusedOps(pass);
+                return;
+            }
+
+            for (int i = 0; i < pass->numRemaps; i++)
+                Transform(pass->remaps[i], pass->w * pass->h, loaded, loaded);
+
+            pass->dataIn = loaded;
+        }
+
+        int n = pass->w * pass->h;
+
+        BeginFusedOps(pass, n);
+
+        const RGBA32* dataIn  = pass->dataIn;
+        int           numOps  = pass->numOps;
+        cFusedOp*     ops     = pass->ops;
+        int           threads = ops[0].settings.threads;
+
+        double t0 = Seconds();
+
+        ParallelFor(n, kFusedTileSize, threads,
+            [dataIn, numOps, ops](int begin, int end)
+            {
+                for (int i = 0; i < numOps; i++)
+                    ApplyFusedOp(ops[i], begin, end, dataIn);
+            }
+        );
+
+        double fusedTime = Seconds() - t0;
+
+        printf("Applied %d ops in a single pass: %.1f ms\n", numOps, fusedTime * 1e3);
+
+        if (pass->compare)
+        {
+            t0 = Seconds();
+
+            for (int i = 0; i < numOps; i++)
+            {
+                const cFusedOp& fop = ops[i];
+
+                ParallelFor(n, kParallelChunkSize, threads,
+                    [&fop, dataIn](int begin, int end)
+                    {
+                        ApplyFusedOp(fop, begin, end, dataIn);
+                    }
+                );
+            }
+
+            double sequentialTime = Seconds() - t0;
+
+            printf("Applied %d ops one after the other: %.1f ms, fused pass saved %.1f ms (%.0f%%)\n",
+                numOps, sequentialTime * 1e3, (sequentialTime - fusedTime) * 1e3, 100.0 * (sequentialTime - fusedTime) / sequentialTime);
+        }
+
+        for (int i = 0; i < numOps; i++)
+        {
+            const cFusedOp& fop = ops[i];
+
+            printf("Saving %s\n", fop.filename);
+            WritePNG(fop.filename, pass->w, pass->h, fop.dataOut, fop.settings.threads);
+        }
+
+        EndFusedOps(pass);
+
+        if (loaded)
+        {
+            stbi_image_free(loaded);
+            pass->dataIn = 0;
+        }
+    }
+
+    void QueueFusedOp(cFusedPass* pass, tImageOp op, tLMS lmsType, const cSettings& settings, int w, int h, const RGBA32* dataIn, const char* filename)
+    {
+        if (pass->numOps == kMaxFusedOps || (pass->numOps > 0 && (pass->dataIn != dataIn || pass->w != w || pass->h != h)))
+            RunFusedPass(pass);
+
+        pass->dataIn = dataIn;
+        pass->w      = w;
+        pass->h      = h;
+
+        cFusedOp& fop = pass->ops[pass->numOps++];
+
+        fop.op       = op;
+        fop.lmsType  = lmsType;
+        fop.settings = settings;
+        fop.lut      = { 0, 0, 0, 0 };
+        fop.lutFile  = cMappedFile();
+        fop.dataOut  = 0;
+
+        strlcpy(fop.filename, filename, sizeof(fop.filename));
+    }
+
+    void RemapSource(cFusedPass* pass, tRemap* remap, int n, RGBA32* dataIn, RGBA64* deepIn)    // apply remap to the source now, or as it's streamed or batch processed
+    {
+        if (!pass->streamPath[0] && !pass->batch.count && !pass->video)
+        {
+            Transform(remap, n, dataIn, dataIn);
+
+            if (deepIn)
+                Transform(remap, n, deepIn, deepIn);
+        }
+        else if (pass->numRemaps < kMaxRemaps)
+            pass->remaps[pass->numRemaps++] = remap;
+        else
+            fprintf(stderr, "Too many remaps, ignoring\n");
+    }
+
+    bool Streaming(const cSettings& settings)
+    {
+        return settings.fused && settings.fused->streamPath[0];
+    }
+
+    bool Batching(const cSettings& settings)
+    {
+        return settings.fused && settings.fused->batch.count > 0;
+    }
+
+    bool StreamingVideo(const cSettings& settings)
+    {
+        return settings.fused && settings.fused->video;
+    }
+
+    // Accuracy comparison, see -C. Errors are measured in CIELAB, assuming sRGB images, via CIEDE2000.
+    struct cSRGBTable
+    {
+        float linear[256];
+
+        cSRGBTable();
+    };
+
+    cSRGBTable::cSRGBTable()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            float v = i / 255.0f;
+            linear[i] = v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+        }
+    }
+
+    inline const cSRGBTable& SRGBTable()
+    {
+        static cSRGBTable table;
+        return table;
+    }
+
+    Vec3f LabFromRGBA32(RGBA32 c)
+    {
+        const float* linear = SRGBTable().linear;
+
+        Vec3f rgb = { linear[c.c[0]], linear[c.c[1]], linear[c.c[2]] };
+
+        // D65 XYZ, relative to the white point
+        const Mat3f kXYZFromRGB =
+        {
+            { 0.4124564f / 0.95047f, 0.3575761f / 0.95047f, 0.1804375f / 0.95047f },
+            { 0.2126729f,            0.7151522f,            0.0721750f            },
+            { 0.0193339f / 1.08883f, 0.1191920f / 1.08883f, 0.9503041f / 1.08883f },
+        };
+
+        Vec3f xyz = kXYZFromRGB * rgb;
+        float f[3] = { xyz.x, xyz.y, xyz.z };
+
+        for (float& t : f)
+            t = t > 216.0f / 24389.0f ? cbrtf(t) : (24389.0f / 27.0f * t + 16.0f) / 116.0f;
+
+        return { 116.0f * f[1] - 16.0f, 500.0f * (f[0] - f[1]), 200.0f * (f[1] - f[2]) };
+    }
+
+    double DeltaE2000(Vec3f lab1, Vec3f lab2)   // see Sharma et al. 2005, "The CIEDE2000 color-difference formula"
+    {
+        const double kPi = 3.14159265358979323846;
+        const double kDegrees = 180.0 / kPi;
+
+        double c1 = sqrt(double(lab1.y) * lab1.y + double(lab1.z) * lab1.z);
+        double c2 = sqrt(double(lab2.y) * lab2.y + double(lab2.z) * lab2.z);
+        double cMean7 = pow(0.5 * (c1 + c2), 7.0);
+        double g = 0.5 * (1.0 - sqrt(cMean7 / (cMean7 + 6103515625.0)));   // 25^7
+
+        double a1 = (1.0 + g) * lab1.y;
+        double a2 = (1.0 + g) * lab2.y;
+        double cp1 = sqrt(a1 * a1 + double(lab1.z) * lab1.z);
+        double cp2 = sqrt(a2 * a2 + double(lab2.z) * lab2.z);
+
+        double h1 = (a1 == 0.0 && lab1.z == 0.0f) ? 0.0 : atan2(lab1.z, a1) * kDegrees;
+        double h2 = (a2 == 0.0 && lab2.z == 0.0f) ? 0.0 : atan2(lab2.z, a2) * kDegrees;
+        if (h1 < 0.0) h1 += 360.0;
+        if (h2 < 0.0) h2 += 360.0;
+
+        double dL = lab2.x - lab1.x;
+        double dC = cp2 - cp1;
+        double dh = 0.0;
+
+        if (cp1 * cp2 != 0.0)
+        {
+            dh = h2 - h1;
+            if (dh > 180.0)
+                dh -= 360.0;
+            else if (dh < -180.0)
+                dh += 360.0;
+        }
+
+        double dH = 2.0 * sqrt(cp1 * cp2) * sin(dh / (2.0 * kDegrees));
+
+        double lMean = 0.5 * (lab1.x + lab2.x);
+        double cMean = 0.5 * (cp1 + cp2);
+        double hMean = h1 + h2;
+
+        if (cp1 * cp2 != 0.0)
+        {
+            if (fabs(h1 - h2) <= 180.0)
+                hMean *= 0.5;
+            else
+                hMean = hMean < 360.0 ? 0.5 * (hMean + 360.0) : 0.5 * (hMean - 360.0);
+        }
+
+        double t = 1.0
+            - 0.17 * cos((hMean - 30.0) / kDegrees)
+            + 0.24 * cos((2.0 * hMean) / kDegrees)
+            + 0.32 * cos((3.0 * hMean + 6.0) / kDegrees)
+            - 0.20 * cos((4.0 * hMean - 63.0) / kDegrees);
+
+        double dTheta = 30.0 * exp(-((hMean - 275.0) / 25.0) * ((hMean - 275.0) / 25.0));
+        double cMeanP7 = pow(cMean, 7.0);
+        double rC = 2.0 * sqrt(cMeanP7 / (cMeanP7 + 6103515625.0));
+        double lm50 = (lMean - 50.0) * (lMean - 50.0);
+        double sL = 1.0 + 0.015 * lm50 / sqrt(20.0 + lm50);
+        double sC = 1.0 + 0.045 * cMean;
+        double sH = 1.0 + 0.015 * cMean * t;
+        double rT = -sin(2.0 * dTheta / kDegrees) * rC;
+
+        double l = dL / sL;
+        double c = dC / sC;
+        double h = dH / sH;
+
+        return sqrt(l * l + c * c + h * h + rT * c * h);
+    }
+
+    void CompareOp(tImageOp op, tLMS lmsType, const cSettings& settings, int n, const RGBA32* dataIn, const char* name)
+    {
+        const char* kInterpNames[] = { "diagonal", "tetrahedral", "trilinear" };
+
+        RGBA32* dataLUT    = new RGBA32[n];
+        RGBA32* dataDirect = new RGBA32[n];
+
+        // The direct path honours -N and -M, so they can be compared too. Both paths run on the same
+        // number of threads, so that their times are comparable. -M already splits its work up.
+        const int threads = settings.threads > 0 ? settings.threads : HardwareThreads();
+
+        double t0 = Seconds();
+        cMappedFile lutFile;
+        RGBLUT rgbaLUT = OpLUT(op, lmsType, settings, &lutFile);
+        double t1 = Seconds();
+        ApplyLUTParallel(rgbaLUT, n, dataIn, dataLUT, settings.interp, threads);
+        double t2 = Seconds();
+
+        if (settings.matrix)
+            TransformOp(op, lmsType, settings, n, dataIn, dataDirect);
+        else
+            ParallelFor(n, kParallelChunkSize, threads,
+                [op, lmsType, &settings, dataIn, dataDirect](int begin, int end) { TransformOp(op, lmsType, settings, end - begin, dataIn + begin, dataDirect + begin); });
+
+        double t3 = Seconds();
+
+        ReleaseOpLUT(&rgbaLUT, &lutFile);
+
+        const double kBinLimits[] = { 0.5, 1.0, 2.0, 3.0, 5.0, 10.0 };
+        const int    kNumBins     = sizeof(kBinLimits) / sizeof(kBinLimits[0]) + 1;
+
+        int     maxErr[3] = { 0, 0, 0 };
+        int64_t sumErr[3] = { 0, 0, 0 };
+        int     bins[kNumBins] = {};
+        int     numOver = 0;
+        double  maxDE   = 0.0;
+        double  sumDE   = 0.0;
+
+        for (int i = 0; i < n; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                int err = abs(dataLUT[i].c[j] - dataDirect[i].c[j]);
+
+                if (maxErr[j] < err)
+                    maxErr[j] = err;
+
+                sumErr[j] += err;
+            }
+
+            double dE = 0.0;
+
+            if ((dataLUT[i].u32 ^ dataDirect[i].u32) & 0xFFFFFF)
+                dE = DeltaE2000(LabFromRGBA32(dataDirect[i]), LabFromRGBA32(dataLUT[i]));
+
+            int bin = 0;
+            while (bin < kNumBins - 1 && dE >= kBinLimits[bin])
+                bin++;
+
+            bins[bin]++;
+            numOver += dE > settings.compare;
+            sumDE   += dE;
+
+            if (maxDE < dE)
+                maxDE = dE;
+        }
+
+        const char* directName = settings.matrix ? "matrix" : settings.palette ? "palette" : "direct";
+
+        printf("%s: %d^3 %s%s lut vs %s\n", name, settings.lutSize, settings.shaper > 0.0f ? "shaped " : "", kInterpNames[settings.interp], directName);
+        printf("  time:       lut %.1f ms (+ %.1f ms to build), %s %.1f ms, on %d thread%s\n", (t2 - t1) * 1e3, (t1 - t0) * 1e3, directName, (t3 - t2) * 1e3, threads, threads == 1 ? "" : "s");
+        printf("  abs error:  r max %d mean %.3f, g max %d mean %.3f, b max %d mean %.3f\n",
+            maxErr[0], sumErr[0] / double(n), maxErr[1], sumErr[1] / double(n), maxErr[2], sumErr[2] / double(n));
+        printf("  deltaE2000: max %.2f mean %.3f, %.2f%% of pixels over %g\n", maxDE, sumDE / n, 100.0 * numOver / n, settings.compare);
+        printf("  histogram: ");
+
+        for (int i = 0; i < kNumBins; i++)
+        {
+            if (i < kNumBins - 1)
+                printf(" <%g %.2f%%,", kBinLimits[i], 100.0 * bins[i] / n);
+            else
+                printf(" >=%g %.2f%%\n", kBinLimits[i - 1], 100.0 * bins[i] / n);
+        }
+
+        delete[] dataDirect;
+        delete[] dataLUT;
+    }
+
+    // Deep colour, see -D. Ops are applied to the 16-bit source via 16-bit luts, or directly with -n/-N/-M,
+    // so that smooth gradients don't band, and the results are written as 16-bit pngs.
+    RGBA32* NarrowImage(int n, const RGBA64* data)  // returns the 8-bit version of data, release with stbi_image_free
+    {
+        RGBA32* result = (RGBA32*) malloc(n * sizeof(RGBA32));
+
+        for (int i = 0; i < n; i++)
+            for (int j = 0; j < 4; j++)
+                result[i].c[j] = uint8_t(data[i].c[j] >> 8);
+
+        return result;
+    }
+
+    void CreateDeepImage(tImageOp op, tLMS lmsType, const cSettings& settings, int w, int h, const char* filename)
+    {
+        const float strength = settings.strength;
+        int n = w * h;
+        RGBA64* dataOut = new RGBA64[n];
+
+        if (settings.noLUT)
+            Transform([op, lmsType, strength](Vec3f c) { return ImageOp(op, lmsType, strength, c); }, n, settings.deepIn, dataOut);
+        else if (settings.shaper > 0.0f)
+        {
+            delete[] dataOut;
+            fprintf(stderr, "16-bit luts are never shaped, so -D needs -n, or no -H\n");
+            return;
+        }
+        else
+        {
+            RGBLUT64 lut = AllocLUT64(settings.lutSize);
+
+            if (op == kPassThrough)
+                CreateIdentityLUT(lut);
+            else
+                CreateLUTBatch([op, lmsType, strength](int n, float r[], float g[], float b[]) { ImageOp(op, lmsType, strength, n, r, g, b); }, lut, settings.threads);
+
+            ApplyLUTParallel(lut, n, settings.deepIn, dataOut, settings.interp, settings.threads);
+            FreeLUT(&lut);
+        }
+
+        printf("Saving %s\n", filename);
+
+        if (!stbi_write_png_16(filename, w, h, 4, dataOut, 0))
+            fprintf(stderr, "Couldn't write %s\n", filename);
+
+        delete[] dataOut;
+    }
+
+    void CreateImage(tImageOp op, tCBType cbType, const cSettings& settings, int w, int h, const RGBA32* dataIn, const char* dataInName)
+    {
+        if (cbType == kAll)
+        {
+            CreateImage(op, kProtanope,   settings, w, h, dataIn, dataInName);
+            CreateImage(op, kDeuteranope, settings, w, h, dataIn, dataInName);
+            CreateImage(op, kTritanope,   settings, w, h, dataIn, dataInName);
+            return;
+        };
+
+        tLMS lmsType = kL;
+        char filename[256] = "";
+
+        if (dataIn || Streaming(settings))
+            snprintf(filename, sizeof(filename), "%s_", dataInName);
+
+        switch (cbType)
+        {
+        case kIdentity:
+            strcat(filename, "identity");
+            break;
+        case kProtanope:
+            strcat(filename, "protanope");
+            lmsType = kL;
+            break;
+        case kDeuteranope:
+            strcat(filename, "deuteranope");
+            lmsType = kM;
+            break;
+        case kTritanope:
+            strcat(filename, "tritanope");
+            lmsType = kS;
+            break;
+        default:
+            return;
+        }
+
+        strcat(filename, kImageOpSuffixes[op]);
+
+        if (settings.printMatrix)
+        {
+            cMatrixOp mop = ImageOpMatrix(op, lmsType, settings.strength);
+
+            printf("// linear RGB: c' = %s\n", mop.clamp ? "m2 * clamp(m1 * c, 0, 1)" : "m1 * c");
+            PrintMatrix(filename, "_m1", mop.first);
+
+            if (mop.clamp)
+                PrintMatrix(filename, "_m2", mop.second);
+
+            printf("\n");
+            return;
+        }
+
+        if (settings.compare > 0.0f && dataIn)
+        {
+            CompareOp(op, lmsType, settings, w * h, dataIn, filename);
+            return;
+        }
+
+        if (settings.deepIn)
+        {
+            strcat(filename, ".png");
+            CreateDeepImage(op, lmsType, settings, w, h, filename);
+            return;
+        }
+
+        if (settings.fused && (dataIn || Streaming(settings) || Batching(settings) || StreamingVideo(settings)))
+        {
+            strcat(filename, ".png");
+            QueueFusedOp(settings.fused, op, lmsType, settings, w, h, dataIn, filename);
             return;
         }
 
-        RGBA32 rgbaLUT[kLUTSize][kLUTSize][kLUTSize];
+        RGBLUT rgbaLUT = { 0, 0, 0, 0 };
+        cMappedFile lutFile;
         RGBA32* dataOut = 0;
         int n = w * h;
         
-        if (noLUT && dataIn) 
+        if (settings.noLUT && dataIn) 
             dataOut = new RGBA32[n];
+        else
+            rgbaLUT = OpLUT(op, lmsType, settings, &lutFile);
         
-        switch (op)
-        {
-        case kSimulate:
-            PerformOp([lmsType, strength](Vec3f c){ return Simulate(c, lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_simulate");
-            break;
-        case kError:
-            PerformOp([lmsType, strength](Vec3f c){ return RGBError(c, lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_error");
-            break;
-        case kDaltonise:
-            PerformOp([lmsType, strength](Vec3f c) { return Daltonise(c, lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_daltonise");
-            break;
-        case kCorrect:
-            PerformOp([lmsType, strength](Vec3f c) { return Correct(c, lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_correct");
-            break;
-        case kDaltoniseSimulate:
-            PerformOp([lmsType, strength](Vec3f c) { return Simulate(ClampUnit(Daltonise(c, lmsType, strength)), lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_simulate_daltonised");
-            break;
-        case kCorrectSimulate:
-            PerformOp([lmsType, strength](Vec3f c) { return Simulate(ClampUnit(Correct(c, lmsType, strength)), lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_simulate_corrected");
-            break;
-        case kPassThrough:
-            if (dataOut)
-                PerformOp([](Vec3f c) { return c; }, rgbaLUT, n, dataIn, dataOut);
-            else
-                CreateIdentityLUT(rgbaLUT);
-            break;
-        };
+        if (dataOut && !TransformOp(op, lmsType, settings, n, dataIn, dataOut))
+            printf("More than %d colours, transforming every pixel\n", kMaxPaletteColours);
 
         if (dataIn && !dataOut)
         {
             dataOut = new RGBA32[n];
 
-            ApplyLUT(rgbaLUT, n, dataIn, dataOut);
+            ApplyLUTParallel(rgbaLUT, n, dataIn, dataOut, settings.interp, settings.threads);
         }
 
         if (dataOut)
         {
             strcat(filename, ".png");
             printf("Saving %s\n", filename);
-            stbi_write_png(filename, w, h, 4, dataOut, 0);
+            WritePNG(filename, w, h, dataOut, settings.threads);
 
             delete[] dataOut;
         }
+        else if (settings.binaryLUT)
+        {
+            strcat(filename, "_lut.cblut");
+            printf("Saving %s\n", filename);
+
+            if (!WriteLUTFile(filename, rgbaLUT))
+                fprintf(stderr, "Couldn't write %s\n", filename);
+        }
         else
         {
             strcat(filename, "_lut.png");
             printf("Saving %s\n", filename);
-            stbi_write_png(filename, kLUTSize * kLUTSize, kLUTSize, 4, rgbaLUT, 0);
+            WritePNG(filename, rgbaLUT.size * rgbaLUT.size, rgbaLUT.size, rgbaLUT.data, settings.threads);
+
+            if (rgbaLUT.shaper)
+            {
+                char shaperPath[256];
+                ShaperPNGPath(filename, shaperPath, sizeof(shaperPath));
+
+                printf("Saving %s\n", shaperPath);
+
+                if (!WriteShaperPNG(shaperPath, rgbaLUT))
+                    fprintf(stderr, "Couldn't write %s\n", shaperPath);
+            }
         }
+
+        ReleaseOpLUT(&rgbaLUT, &lutFile);
     }
 
-    void CreateImage(const RGBA32* rgbaLUT, int w, int h, const RGBA32* dataIn)
+    void CreateImage(const RGBLUT& rgbaLUT, int w, int h, const RGBA32* dataIn, const cSettings& settings)
     {
+        if (settings.deepIn && rgbaLUT.shaper)
+        {
+            fprintf(stderr, "Shaped luts can't be applied at 16 bits\n");
+            return;
+        }
+
+        if (settings.deepIn)
+        {
+            RGBLUT64 lut64 = AllocLUT64(rgbaLUT.size);
+            RGBA64* dataOut = new RGBA64[w * h];
+
+            WidenLUT(rgbaLUT, lut64);
+            ApplyLUTParallel(lut64, w * h, settings.deepIn, dataOut, settings.interp, settings.threads);
+
+            printf("Saving apply_lut.png\n");
+
+            if (!stbi_write_png_16("apply_lut.png", w, h, 4, dataOut, 0))
+                fprintf(stderr, "Couldn't write apply_lut.png\n");
+
+            FreeLUT(&lut64);
+            delete[] dataOut;
+            return;
+        }
+
+        if (settings.fused)
+        {
+            QueueFusedOp(settings.fused, kPassThrough, kL, settings, w, h, dataIn, "apply_lut.png");
+
+            cFusedOp& fop = settings.fused->ops[settings.fused->numOps - 1];
+            fop.lut = rgbaLUT.shaper ? AllocShapedLUT(rgbaLUT.size) : AllocLUT(rgbaLUT.size);
+            memcpy(fop.lut.data, rgbaLUT.data, rgbaLUT.size * rgbaLUT.size * rgbaLUT.size * sizeof(RGBA32));
+
+            if (rgbaLUT.shaper)
+                memcpy(fop.lut.shaper, rgbaLUT.shaper, kLUTShaperEntries * sizeof(uint16_t));
+            return;
+        }
+
         int n = w * h;
         RGBA32* dataOut = new RGBA32[n];
 
-        ApplyLUT(* (RGBA32 (*)[kLUTSize][kLUTSize][kLUTSize]) (RGBA32*) rgbaLUT, w * h, dataIn, dataOut);
+        ApplyLUTParallel(rgbaLUT, w * h, dataIn, dataOut, settings.interp, settings.threads);
         
         char filename[256] = "apply_lut";
         
         printf("Saving %s\n", filename);
         strcat(filename, ".png");
 
-        stbi_write_png(filename, w, h, 4, dataOut, 0);
+        WritePNG(filename, w, h, dataOut, settings.threads);
 
         delete[] dataOut;
     }
@@ -325,14 +2342,14 @@ namespace
         printf("};\n");
     }
 
-    void CreateImageWithMonoLUT(const RGBA32 monoLUT[256], const char* lutName, int w, int h, const RGBA32* dataIn, const char* dataName, int channel)
+    void CreateImageWithMonoLUT(const RGBA32 monoLUT[256], const char* lutName, int w, int h, const RGBA32* dataIn, const char* dataName, int channel, int threads)
     {
         RGBA32* dataOut = 0;
 
         if (dataIn)
         {
             dataOut = new RGBA32[w * h];
-            ApplyMonoLUT(monoLUT, w * h, dataIn, dataOut, channel);
+            ApplyMonoLUTParallel(monoLUT, w * h, dataIn, dataOut, channel, threads);
         }
         else
         {
@@ -351,7 +2368,7 @@ namespace
             snprintf(filename, sizeof(filename), "%s_lut.png", lutName);
         
         printf("Saving %s\n", filename);
-        stbi_write_png(filename, w, h, 4, dataOut, 0);
+        WritePNG(filename, w, h, dataOut, threads);
 
         delete[] dataOut;
     }
@@ -368,14 +2385,37 @@ namespace
             "Options:\n"
             "  -h        : this help\n"
             "  -f <path> : set image to process rather than emitting lut\n"
+            "  -b <path> : as -f, but for every image in the given directory, glob (quoted), or manifest of paths, one per line.\n"
+            "              All operations are applied in one pass, using a pool of worker threads\n"
             "  -p        : emit protanope image or lut\n"
             "  -d        : emit deuteranope image or lut\n"
             "  -t        : emit tritanope image or lut\n"
             "  -a        : emit image or lut for all the above types (default)\n"
             "  -m <str>  : specify strength of colour blindness to correct for. Default = 1 (affected channel is completely lost.)\n" 
             "  -n        : directly transform input image rather than using a LUT\n"
+            "  -N        : as -n, but transform each distinct colour only once. Fast for images with few colours\n"
+            "  -M        : as -n, but apply each operation as one or two precomposed 3x3 matrices. Faster, may differ by 1/255\n"
+            "  -o        : print each operation's precomposed matrices, e.g., for use as shader constants, rather than emitting an image or lut\n"
             "  -g[LMS]   : swap LM/MS/LS channels of input image before processing\n"
             "  -r[LM]    : remap L or M channels to S, converting a prot/deuter test image to tritanope.\n"
+            "  -q <mode> : lut interpolation: diagonal (default, fastest), tetrahedral, or trilinear\n"
+            "  -z <size> : samples per axis of generated luts: 2^n (default 32), or 2^n + 1 to include end points, e.g., 17/33/65\n"
+            "  -H <pow>  : generate shaped luts, whose per-channel shaper spaces samples along the given power curve (1 = evenly),\n"
+            "              and which can then have any -z size from 2 to 257. Pngs get a 16-bit _shaper.png alongside. Precede -z\n"
+            "  -u        : apply all image operations in a single pass over the source, rather than one after the other\n"
+            "  -U        : as -u, but also time running them one after the other, and report the time saved\n"
+            "  -S        : as -u, but stream subsequent -f pngs through the operations a band of rows at a time, rather than loading them\n"
+            "  -V [601|709] : stream Y4M video from stdin to stdout through the (single) following operation, e.g., piped from\n"
+            "              ffmpeg. The YUV matrix is BT.709 for 720 rows or more, BT.601 otherwise, unless given\n"
+            "  -B        : emit luts in the binary .cblut format, which can be mapped and used directly, rather than as pngs\n"
+            "  -C <dE>   : rather than emitting images, compare each operation's lut results to its direct (-n, -N, or -M) ones,\n"
+            "              reporting the time of each, their per-channel and deltaE 2000 error, and the pixels with a deltaE over dE\n"
+            "  -k <dir>  : cache generated luts in the given directory, and reuse them on later runs\n"
+            "  -j <n>    : number of threads used to apply luts and write images (default: all available)\n"
+            "  -Z <n>    : png compression: 0 = store only, 1 = run-length only, 2+ = more effort for smaller files (default 8)\n"
+            "  -P <n>    : png filter: 0-4 = none/sub/up/average/paeth for all rows, -1 = best per row (default)\n"
+            "  -D        : load subsequent -f images at 16 bits per channel, apply operations via 16-bit luts, and write 16-bit pngs.\n"
+            "              With -n/-N/-M, every pixel is transformed directly. Doesn't apply to -S/-b/-V/-C\n"
             "\n"
             "Operations:\n"
             "  -s        : simulate given type of colour-blindness\n"
@@ -385,7 +2425,7 @@ namespace
             "  -Y        : correct for and then simulate given type of colour-blindness\n"
             "  -e        : error between original colour and simulated version\n"
             "  -i        : emit identity image or lut (for testing)\n"
-            "  -l <path> : apply the given LUT to source (requires -f)\n"
+            "  -l <path> : apply the given LUT, either png or .cblut, to source (requires -f)\n"
             "\n"
             "  -c <name> [<channel>] : apply given greyscale lut: cividis, viridis (cb-savvy). magma, inferno, plasma (standard)\n"
             "                          'name' can also be the path of a 256-wide LUT in image form\n"
@@ -398,23 +2438,6 @@ namespace
 
         return 0;
     }
-
-    void GetFileName(char* buffer, size_t bufferSize, const char* path)
-    {
-        const char* lastSlash = strrchr(path, '/');
-        if (!lastSlash)
-            lastSlash = strrchr(path, '\\');
-
-        if (lastSlash)
-            strlcpy(buffer, lastSlash + 1, bufferSize);
-        else
-            strlcpy(buffer, path, bufferSize);
-
-        char* lastDot = strrchr(buffer, '.');
-
-        if (lastDot)
-            *lastDot = 0;
-    }
 }
 
 int main(int argc, const char* argv[])
@@ -429,9 +2452,11 @@ int main(int argc, const char* argv[])
     int w;
     int h;
     RGBA32* dataIn = 0;
+    RGBA64* deepIn = 0;
+    bool    deep   = false;
     char dataInName[256] = "unknown";
-    float strength = 1.0f;
-    bool noLUT = false;
+    cSettings settings;
+    cFusedPass fusedPass;
 
     // Options
     while (argc > 0 && argv[0][0] == '-')
@@ -491,13 +2516,19 @@ int main(int argc, const char* argv[])
 
                     argv++; argc--;
 
+                    if (Streaming(settings) || Batching(settings) || StreamingVideo(settings))
+                    {
+                        fprintf(stderr, "-c can't be used with a streamed or batch source\n");
+                        return -1;
+                    }
+
                     if (argc > 0 && argv[0][0] != '-')
                     {
                         channel = atoi(argv[0]);
                         argv++; argc--;
                     }
                     
-                    CreateImageWithMonoLUT(lutTable, lutName, w, h, dataIn, dataInName, channel);
+                    CreateImageWithMonoLUT(lutTable, lutName, w, h, dataIn, dataInName, channel, settings.threads);
                         // PrintMonoLUT(lutName, lutTable);
                 }
                 break;
@@ -506,21 +2537,71 @@ int main(int argc, const char* argv[])
                 if (argc <= 0)
                     return fprintf(stderr, "Expecting filename with -f\n");
 
-                dataIn = (RGBA32*) stbi_load(argv[0], &w, &h, 0, 4);
-                
-                if (!dataIn)
+                RunFusedPass(&fusedPass);
+
+                fusedPass.streamPath[0] = 0;
+                fusedPass.numRemaps = 0;
+                ClearFiles(&fusedPass.batch);
+                fusedPass.video = false;
+
+                if (deepIn)
+                    stbi_image_free(deepIn);
+
+                deepIn = 0;
+
+                if (fusedPass.stream)
                 {
-                    fprintf(stderr, "Couldn't read %s\n", argv[0]);
-                    return -1;
+                    // Just note the source for now, it's read when the queued ops are run
+                    if (!stbi_info(argv[0], &w, &h, 0))
+                    {
+                        fprintf(stderr, "Couldn't read %s\n", argv[0]);
+                        return -1;
+                    }
+
+                    strlcpy(fusedPass.streamPath, argv[0], sizeof(fusedPass.streamPath));
+                }
+                else if (deep)
+                {
+                    deepIn = (RGBA64*) stbi_load_16(argv[0], &w, &h, 0, 4);
+
+                    if (!deepIn)
+                    {
+                        fprintf(stderr, "Couldn't read %s\n", argv[0]);
+                        return -1;
+                    }
+
+                    dataIn = NarrowImage(w * h, deepIn);
+                }
+                else
+                {
+                    dataIn = (RGBA32*) stbi_load(argv[0], &w, &h, 0, 4);
+
+                    if (!dataIn)
+                    {
+                        fprintf(stderr, "Couldn't read %s\n", argv[0]);
+                        return -1;
+                    }
                 }
 
                 GetFileName(dataInName, sizeof(dataInName), argv[0]);
+                settings.deepIn = deepIn;
 
                 argv++; argc--;
                 break;
 
             case 'F':
                 {
+                    RunFusedPass(&fusedPass);
+                    fusedPass.streamPath[0] = 0;
+                    ClearFiles(&fusedPass.batch);
+                    fusedPass.video = false;
+
+                    if (deepIn)
+                        stbi_image_free(deepIn);
+
+                    deepIn = 0;
+                    settings.deepIn = 0;
+
                     // Create a swatch that varies horizontally only in L, for
                     // protanope correction testing.
                     w = 256;
@@ -566,50 +2647,54 @@ int main(int argc, const char* argv[])
             case 'm':
                 if (argc <= 0)
                     return fprintf(stderr, "Expecting strength for -m <float>\n");
-                strength = (float) atof(argv[0]);
+                settings.strength = (float) atof(argv[0]);
                 argv++; argc--;
                 break;
 
             case 's':
-                CreateImage(kSimulate,          cbType, strength, w, h, dataIn, dataInName, noLUT);
+                CreateImage(kSimulate,          cbType, settings, w, h, dataIn, dataInName);
                 break;
 
             case 'e':
-                CreateImage(kError,             cbType, strength, w, h, dataIn, dataInName, noLUT);
+                CreateImage(kError,             cbType, settings, w, h, dataIn, dataInName);
                 break;
 
             case 'x':
-                CreateImage(kDaltonise,         cbType, strength, w, h, dataIn, dataInName, noLUT);
+                CreateImage(kDaltonise,         cbType, settings, w, h, dataIn, dataInName);
                 break;
             case 'X':
-                CreateImage(kDaltoniseSimulate, cbType, strength, w, h, dataIn, dataInName, noLUT);
+                CreateImage(kDaltoniseSimulate, cbType, settings, w, h, dataIn, dataInName);
                 break;
 
             case 'y':
-                CreateImage(kCorrect,           cbType, strength, w, h, dataIn, dataInName, noLUT);
+                CreateImage(kCorrect,           cbType, settings, w, h, dataIn, dataInName);
                 break;
             case 'Y':
-                CreateImage(kCorrectSimulate,   cbType, strength, w, h, dataIn, dataInName, noLUT);
+                CreateImage(kCorrectSimulate,   cbType, settings, w, h, dataIn, dataInName);
                 break;
 
             case 'i':
-                CreateImage(kPassThrough, kIdentity, strength, w, h, dataIn, dataInName, noLUT);
+                CreateImage(kPassThrough, kIdentity, settings, w, h, dataIn, dataInName);
                 break;
 
             case 'g':
+                RunFusedPass(&fusedPass);
+
                 if (option[1] == 'l' or option[1] == 'L')
-                    Transform([](Vec3f c){ return LMSSwap(c, kL); }, w * h, dataIn, dataIn);
+                    RemapSource(&fusedPass, [](Vec3f c){ return LMSSwap(c, kL); }, w * h, dataIn, deepIn);
                 else if (option[1] == 'm' or option[1] == 'M')
-                    Transform([](Vec3f c){ return LMSSwap(c, kM); }, w * h, dataIn, dataIn);
+                    RemapSource(&fusedPass, [](Vec3f c){ return LMSSwap(c, kM); }, w * h, dataIn, deepIn);
                 else
-                    Transform([](Vec3f c){ return LMSSwap(c, kS); }, w * h, dataIn, dataIn);
+                    RemapSource(&fusedPass, [](Vec3f c){ return LMSSwap(c, kS); }, w * h, dataIn, deepIn);
                 option++;
 
             case 'r':
+                RunFusedPass(&fusedPass);
+
                 if (option[1] == 'm' or option[1] == 'M')
-                    Transform([](Vec3f c){ return RemapMToS(c); }, w * h, dataIn, dataIn);
+                    RemapSource(&fusedPass, [](Vec3f c){ return RemapMToS(c); }, w * h, dataIn, deepIn);
                 else
-                    Transform([](Vec3f c){ return RemapLToS(c); }, w * h, dataIn, dataIn);
+                    RemapSource(&fusedPass, [](Vec3f c){ return RemapLToS(c); }, w * h, dataIn, deepIn);
                 option++;
                 break;
 
@@ -630,38 +2715,294 @@ int main(int argc, const char* argv[])
                 break;
                 
             case 'n':
-                noLUT = true;
+                settings.noLUT = true;
                 break;
 
-            case 'l':
+            case 'N':
+                settings.noLUT   = true;
+                settings.palette = true;
+                break;
+
+            case 'M':
+                settings.noLUT  = true;
+                settings.matrix = true;
+                break;
+
+            case 'o':
+                settings.printMatrix = true;
+                break;
+
+            case 'q':
                 if (argc <= 0)
-                    return fprintf(stderr, "Expecting filename with -l\n");
+                    return fprintf(stderr, "Expecting mode for -q <mode>\n");
+
+                if (argv[0][0] == 'd')
+                    settings.interp = kInterpDiagonal;
+                else if (argv[0][0] == 't' && argv[0][1] == 'e')
+                    settings.interp = kInterpTetrahedral;
+                else if (argv[0][0] == 't' && argv[0][1] == 'r')
+                    settings.interp = kInterpTrilinear;
+                else
+                {
+                    fprintf(stderr, "Unknown interpolation mode %s\n", argv[0]);
+                    return -1;
+                }
 
-                if (!dataIn)
-                    return fprintf(stderr, "No input file to apply lut to\n");
+                argv++; argc--;
+                break;
 
-                int lw, lh;
-                RGBA32* lut = (RGBA32*) stbi_load(argv[0], &lw, &lh, 0, 4);
-                
-                if (!lut)
+            case 'z':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting size for -z <size>\n");
+
+                settings.lutSize = atoi(argv[0]);
+
+                if (settings.shaper > 0.0f && (settings.lutSize < 2 || settings.lutSize > kMaxLUTSize))
                 {
-                    fprintf(stderr, "Couldn't read RGB LUT %s\n", argv[0]);
+                    fprintf(stderr, "Shaped LUT size must be between 2 and %d\n", kMaxLUTSize);
                     return -1;
                 }
 
-                if (lw != kLUTSize * kLUTSize)
+                if (settings.shaper <= 0.0f && !IsValidLUTSize(settings.lutSize))
                 {
-                    fprintf(stderr, "Expecting RGB LUT width of %d\n", kLUTSize * kLUTSize);
+                    fprintf(stderr, "LUT size must be 2^n or 2^n + 1, between %d and %d, or use -H\n", 1 << kMinLUTBits, kMaxLUTSize);
                     return -1;
                 }
-                
-                if (lh != kLUTSize)
+
+                argv++; argc--;
+                break;
+
+            case 'H':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting power for -H <power>\n");
+
+                settings.shaper = (float) atof(argv[0]);
+
+                if (settings.shaper <= 0.0f)
+                {
+                    fprintf(stderr, "Shaper power must be positive\n");
+                    return -1;
+                }
+
+                argv++; argc--;
+                break;
+
+            case 'u':
+            case 'U':
+                settings.fused = &fusedPass;
+                fusedPass.compare = option[0] == 'U';
+                break;
+
+            case 'S':
+                settings.fused = &fusedPass;
+                fusedPass.stream = true;
+                break;
+
+            case 'b':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting directory, glob, or manifest with -b\n");
+
+                RunFusedPass(&fusedPass);
+
+                fusedPass.streamPath[0] = 0;
+                fusedPass.numRemaps = 0;
+                ClearFiles(&fusedPass.batch);
+                fusedPass.video = false;
+
+                if (!AddFiles(&fusedPass.batch, argv[0]) || fusedPass.batch.count == 0)
+                {
+                    fprintf(stderr, "No images found in %s\n", argv[0]);
+                    return -1;
+                }
+
+                if (dataIn)
+                    stbi_image_free(dataIn);
+
+                if (deepIn)
+                    stbi_image_free(deepIn);
+
+                dataIn = 0;
+                deepIn = 0;
+                settings.deepIn = 0;
+                w = 0;
+                h = 0;
+                settings.fused = &fusedPass;
+
+                argv++; argc--;
+                break;
+
+            case 'V':
+                RunFusedPass(&fusedPass);
+
+                fusedPass.streamPath[0] = 0;
+                fusedPass.numRemaps = 0;
+                ClearFiles(&fusedPass.batch);
+
+                fusedPass.video = true;
+                fusedPass.yuvMatrix = 0;
+
+                if (argc > 0 && (strcmp(argv[0], "601") == 0 || strcmp(argv[0], "709") == 0))
+                {
+                    fusedPass.yuvMatrix = atoi(argv[0]);
+                    argv++; argc--;
+                }
+
+                if (dataIn)
+                    stbi_image_free(dataIn);
+
+                if (deepIn)
+                    stbi_image_free(deepIn);
+
+                dataIn = 0;
+                deepIn = 0;
+                settings.deepIn = 0;
+                w = 0;
+                h = 0;
+                settings.fused = &fusedPass;
+                break;
+
+            case 'B':
+                settings.binaryLUT = true;
+                break;
+
+            case 'D':
+                deep = true;
+                break;
+
+            case 'C':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting threshold for -C <dE>\n");
+
+                settings.compare = (float) atof(argv[0]);
+
+                if (settings.compare <= 0.0f)
+                {
+                    fprintf(stderr, "Comparison threshold must be positive\n");
+                    return -1;
+                }
+
+                argv++; argc--;
+                break;
+
+            case 'k':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting directory for -k <dir>\n");
+
+            #ifdef _MSC_VER
+                _mkdir(argv[0]);
+            #else
+                mkdir(argv[0], 0777);
+            #endif
+
+                {
+                    struct stat st;
+
+                    if (stat(argv[0], &st) != 0 || (st.st_mode & S_IFMT) != S_IFDIR)
+                    {
+                        fprintf(stderr, "Couldn't create LUT cache directory %s\n", argv[0]);
+                        return -1;
+                    }
+                }
+
+                settings.cacheDir = argv[0];
+                argv++; argc--;
+                break;
+
+            case 'j':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting count for -j <threads>\n");
+
+                settings.threads = atoi(argv[0]);
+                argv++; argc--;
+                break;
+
+            case 'Z':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting level for -Z <level>\n");
+
+                stbi_write_png_compression_level = atoi(argv[0]);
+                argv++; argc--;
+                break;
+
+            case 'P':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting filter for -P <filter>\n");
+
+                stbi_write_force_png_filter = atoi(argv[0]);
+
+                if (stbi_write_force_png_filter < -1 || stbi_write_force_png_filter > 4)
                 {
-                    fprintf(stderr, "Expecting RGB LUT height of %d\n", kLUTSize);
+                    fprintf(stderr, "PNG filter must be between -1 and 4\n");
                     return -1;
                 }
 
-                CreateImage(lut, w, h, dataIn);
+                argv++; argc--;
+                break;
+
+            case 'l':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting filename with -l\n");
+
+                if (!dataIn && !Streaming(settings) && !Batching(settings) && !StreamingVideo(settings))
+                    return fprintf(stderr, "No input file to apply lut to\n");
+
+                cMappedFile lutFile;
+                RGBLUT rgbaLUT;
+
+                if (MapFile(argv[0], &lutFile) && IsLUTFile(lutFile))
+                {
+                    // Binary luts are applied straight from the mapping
+                    if (!LUTFromFileData(lutFile.data, lutFile.size, &rgbaLUT))
+                    {
+                        fprintf(stderr, "Binary LUT %s is damaged or an unsupported version\n", argv[0]);
+                        return -1;
+                    }
+                }
+                else
+                {
+                    UnmapFile(&lutFile);
+
+                    int lw, lh;
+                    RGBA32* lut = (RGBA32*) stbi_load(argv[0], &lw, &lh, 0, 4);
+
+                    if (!lut)
+                    {
+                        fprintf(stderr, "Couldn't read RGB LUT %s\n", argv[0]);
+                        return -1;
+                    }
+
+                    // A shaped lut has its shaper alongside, and can be any size
+                    char shaperPath[1024];
+                    ShaperPNGPath(argv[0], shaperPath, sizeof(shaperPath));
+
+                    bool shaped = stbi_is_16_bit(shaperPath) != 0;
+
+                    if (shaped ? lh < 2 || lh > kMaxLUTSize : !IsValidLUTSize(lh))
+                    {
+                        fprintf(stderr, "Unsupported RGB LUT height of %d\n", lh);
+                        return -1;
+                    }
+
+                    if (lw != lh * lh)
+                    {
+                        fprintf(stderr, "Expecting RGB LUT width of %d\n", lh * lh);
+                        return -1;
+                    }
+
+                    rgbaLUT = shaped ? AllocShapedLUT(lh) : AllocLUT(lh);
+                    memcpy(rgbaLUT.data, lut, lh * lh * lh * sizeof(RGBA32));
+                    stbi_image_free(lut);
+
+                    if (shaped && !ReadShaperPNG(shaperPath, rgbaLUT))
+                    {
+                        fprintf(stderr, "Expecting 256 x 1 shaper %s\n", shaperPath);
+                        return -1;
+                    }
+                }
+
+                CreateImage(rgbaLUT, w, h, dataIn, settings);
+
+                ReleaseOpLUT(&rgbaLUT, &lutFile);
                 
                 argv++; argc--;
                 break;
@@ -670,14 +3011,23 @@ int main(int argc, const char* argv[])
         }
     }
 
+    RunFusedPass(&fusedPass);
+    ClearFiles(&fusedPass.batch);
+
     if (dataIn)
         stbi_image_free(dataIn);
 
+    if (deepIn)
+        stbi_image_free(deepIn);
+
     if (argc > 0)
     {
         fprintf(stderr, "Unrecognised arguments starting with %s\n", argv[0]);
         return -1;
     }
+
+    if (fusedPass.videoFailed)
+        return -1;
         
     return 0;
 }
@@ -7,12 +7,90 @@
 //
 
 #include "CBLuts.h"
+#include "CBThreads.h"
 
 #include <math.h>
 #include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define CB_X86
+
+    #include <immintrin.h>
+
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define CB_TARGET_SSE2
+        #define CB_TARGET_AVX2
+    #else
+        #define CB_TARGET_SSE2 __attribute__((target("sse2")))
+        #define CB_TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
 
 using namespace CBLut;
 
+// --- SIMD support ------------------------------------------------------------
+
+namespace
+{
+    tSIMD DetectSIMD()
+    {
+    #if defined(CB_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+
+        if (info[0] >= 7)
+        {
+            __cpuid(info, 1);
+            bool osSaveYMM = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+
+            __cpuidex(info, 7, 0);
+            bool avx2 = (info[1] & (1 << 5)) != 0;
+
+            if (osSaveYMM && avx2)
+                return kSIMDAVX2;
+        }
+
+        __cpuid(info, 1);
+
+        if (info[3] & (1 << 26))
+            return kSIMDSSE2;
+    #elif defined(CB_X86)
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+            return kSIMDAVX2;
+        if (__builtin_cpu_supports("sse2"))
+            return kSIMDSSE2;
+    #endif
+
+        return kSIMDNone;
+    }
+
+    tSIMD& SIMDSupported()
+    {
+        static tSIMD s_supported = DetectSIMD();
+        return s_supported;
+    }
+
+    tSIMD& SIMDCurrent()
+    {
+        static tSIMD s_current = SIMDSupported();
+        return s_current;
+    }
+}
+
+tSIMD CBLut::SIMDLevel()
+{
+    return SIMDCurrent();
+}
+
+void CBLut::SetSIMDLevel(tSIMD level)
+{
+    SIMDCurrent() = level < SIMDSupported() ? level : SIMDSupported();
+}
+
 // --- Colour-blind support ---------------------------------------------------
 
 // LMS colour space, models human eye response: https://en.wikipedia.org/wiki/LMS_color_space
@@ -61,7 +139,6 @@ const Mat3f CBLut::kLMSTritanope =      /// Tritanope: blue sensitivity greatly
 namespace
 {
     inline float& elt(      Vec3f& v, int i) { return (&v.x)[i]; } 
-//  inline Vec3f& row(      Mat3f& m, int i) { return (&m.x)[i]; } 
     inline float  elt(const Vec3f& v, int i) { return (&v.x)[i]; } 
     inline Vec3f  row(const Mat3f& m, int i) { return (&m.x)[i]; } 
     inline Vec3f  col(const Mat3f& m, int i) { return { (&m.x.x)[i], (&m.y.x)[i], (&m.z.x)[i] }; } 
@@ -74,6 +151,35 @@ namespace
     inline Vec3f pow      (Vec3f v, float p) { return { powf(v.x, p), powf(v.y, p), powf(v.z, p) }; }
 
     inline Vec3f operator*(const Mat3f& m, const Vec3f& v) { return Vec3f { dot(m.x, v), dot(m.y, v), dot(m.z, v) }; }
+
+    inline Vec3f& row(Mat3f& m, int i) { return (&m.x)[i]; }
+
+    inline Mat3f operator+(const Mat3f& a, const Mat3f& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+    inline Mat3f operator-(const Mat3f& a, const Mat3f& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+    inline Mat3f operator*(float s, const Mat3f& m)        { return { s * m.x, s * m.y, s * m.z }; }
+
+    inline Mat3f operator*(const Mat3f& a, const Mat3f& b)
+    {
+        const Vec3f b0 = col(b, 0);
+        const Vec3f b1 = col(b, 1);
+        const Vec3f b2 = col(b, 2);
+
+        return Mat3f
+        {
+            { dot(a.x, b0), dot(a.x, b1), dot(a.x, b2) },
+            { dot(a.y, b0), dot(a.y, b1), dot(a.y, b2) },
+            { dot(a.z, b0), dot(a.z, b1), dot(a.z, b2) },
+        };
+    }
+
+    inline Mat3f OuterProduct(Vec3f a, Vec3f b) { return { a.x * b, a.y * b, a.z * b }; }
+
+    const Mat3f kIdentity3 =
+    {
+        { 1.0f, 0.0f, 0.0f },
+        { 0.0f, 1.0f, 0.0f },
+        { 0.0f, 0.0f, 1.0f },
+    };
 }
 
 // "Digital Video Colourmaps for Checking the Legibility of Displays by Dichromats", Viénot et al.
@@ -279,189 +385,3460 @@ Vec3f CBLut::Correct(Vec3f rgb, tLMS lmsType, float strength)
     return rgb;
 }
 
-
-// --- RGB LUT support ---------------------------------------------------------
-
+#ifdef CB_X86
 namespace
 {
-    constexpr float kGamma = 2.2f;
+    // SIMD batch kernels, which handle colours in groups of 4 (SSE2) or 8 (AVX2),
+    // and return the number they handled, leaving the rest to the scalar loops
+    // below. They perform the same operations in the same order as the scalar
+    // code, so the results are identical.
+    struct cVec3SSE { __m128 x; __m128 y; __m128 z; };
+    struct cMat3SSE { cVec3SSE x; cVec3SSE y; cVec3SSE z; };
 
-    inline uint8_t ToU8(float f)
+    CB_TARGET_SSE2 inline cVec3SSE Splat4(Vec3f v)        { return { _mm_set1_ps(v.x), _mm_set1_ps(v.y), _mm_set1_ps(v.z) }; }
+    CB_TARGET_SSE2 inline cMat3SSE Splat4(const Mat3f& m) { return { Splat4(m.x), Splat4(m.y), Splat4(m.z) }; }
+
+    inline __m128& elt(cVec3SSE& v, int i) { return (&v.x)[i]; }
+
+    CB_TARGET_SSE2 inline __m128 dot(const cVec3SSE& a, const cVec3SSE& b)
     {
-        if (f <= 0.0f)
-            return 0;
-        if (f >= 1.0f)
-            return 255;
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y)), _mm_mul_ps(a.z, b.z));
+    }
 
-        return uint8_t(f * 255.0f + 0.5f);
+    CB_TARGET_SSE2 inline cVec3SSE operator*(const cMat3SSE& m, const cVec3SSE& v) { return { dot(m.x, v), dot(m.y, v), dot(m.z, v) }; }
+    CB_TARGET_SSE2 inline cVec3SSE operator*(__m128 s, const cVec3SSE& a)          { return { _mm_mul_ps(s, a.x), _mm_mul_ps(s, a.y), _mm_mul_ps(s, a.z) }; }
+    CB_TARGET_SSE2 inline cVec3SSE operator+(const cVec3SSE& a, const cVec3SSE& b) { return { _mm_add_ps(a.x, b.x), _mm_add_ps(a.y, b.y), _mm_add_ps(a.z, b.z) }; }
+    CB_TARGET_SSE2 inline cVec3SSE operator-(const cVec3SSE& a, const cVec3SSE& b) { return { _mm_sub_ps(a.x, b.x), _mm_sub_ps(a.y, b.y), _mm_sub_ps(a.z, b.z) }; }
+
+    CB_TARGET_SSE2 inline cVec3SSE Load4(const float r[], const float g[], const float b[], int i)
+    {
+        return { _mm_loadu_ps(r + i), _mm_loadu_ps(g + i), _mm_loadu_ps(b + i) };
     }
 
-    inline uint8_t ToU8u(float f)   // 0-256 variant used for LUT construction
+    CB_TARGET_SSE2 inline void Store4(float r[], float g[], float b[], int i, const cVec3SSE& v)
     {
-        if (f <= 0.0f)
-            return 0;
-        if (f >= 1.0f)
-            return 255;
+        _mm_storeu_ps(r + i, v.x);
+        _mm_storeu_ps(g + i, v.y);
+        _mm_storeu_ps(b + i, v.z);
+    }
 
-        return uint8_t(f * 256.0f);
+    template<int kType> CB_TARGET_SSE2 int SimulateBatchSSE2(int n, float r[], float g[], float b[], float strength)
+    {
+        const cMat3SSE lmsFromRGB = Splat4(kLMSFromRGB);
+        const cMat3SSE rgbFromLMS = Splat4(kRGBFromLMS);
+        const cVec3SSE simRow     = Splat4(row(kLMSSimulate, kType));
+        const __m128   s          = _mm_set1_ps(strength);
+
+        int i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            cVec3SSE lms = lmsFromRGB * Load4(r, g, b, i);
+
+            __m128& eltx = elt(lms, kType);
+            eltx = _mm_add_ps(eltx, _mm_mul_ps(s, _mm_sub_ps(dot(simRow, lms), eltx)));
+
+            Store4(r, g, b, i, rgbFromLMS * lms);
+        }
+
+        return i;
     }
-}
 
-RGBA32 CBLut::ToRGBA32(Vec3f c)
-{
-    c = pow(c, 1.0f / kGamma);
-    RGBA32 result;
+    CB_TARGET_SSE2 int DaltoniseBatchSSE2(int n, float r[], float g[], float b[], const Mat3f& lmsTransformIn, const Mat3f& errorToDeltaIn, float strength)
+    {
+        const cMat3SSE lmsFromRGB   = Splat4(kLMSFromRGBV);
+        const cMat3SSE rgbFromLMS   = Splat4(kRGBFromLMSV);
+        const cMat3SSE lmsTransform = Splat4(lmsTransformIn);
+        const cMat3SSE errorToDelta = Splat4(errorToDeltaIn);
+        const __m128   s            = _mm_set1_ps(strength);
 
-    result.c[0] = ToU8(c.x);
-    result.c[1] = ToU8(c.y);
-    result.c[2] = ToU8(c.z);
-    result.c[3] = 255;
+        int i = 0;
 
-    return result;
-}
+        for (; i + 4 <= n; i += 4)
+        {
+            cVec3SSE rgb      = Load4(r, g, b, i);
+            cVec3SSE rgbSim   = rgbFromLMS * (lmsTransform * (lmsFromRGB * rgb));
+            cVec3SSE rgbDelta = errorToDelta * (s * (rgb - rgbSim));
 
-RGBA32 CBLut::ToRGBA32u(Vec3f c)
-{
-    c = pow(c, 1.0f / kGamma);
-    RGBA32 result;
+            Store4(r, g, b, i, rgb + rgbDelta);
+        }
 
-    result.c[0] = ToU8u(c.x);
-    result.c[1] = ToU8u(c.y);
-    result.c[2] = ToU8u(c.z);
-    result.c[3] = 255;
+        return i;
+    }
 
-    return result;
-}
+    template<int kType> CB_TARGET_SSE2 int CorrectBatchSSE2(int n, float r[], float g[], float b[], float strength, Vec3f correctIn)
+    {
+        const cMat3SSE lmsFromRGB = Splat4(kLMSFromRGB);
+        const cMat3SSE rgbFromLMS = Splat4(kRGBFromLMS);
+        const cVec3SSE simRow     = Splat4(row(kLMSSimulate, kType));
+        const cVec3SSE correct    = Splat4(correctIn);
+        const __m128   s          = _mm_set1_ps(strength);
 
-Vec3f CBLut::FromRGBA32(RGBA32 rgb)
-{
-    Vec3f c = { rgb.c[0] / 255.0f, rgb.c[1] / 255.0f, rgb.c[2] / 255.0f };
-    return pow(c, kGamma);
-}
+        int i = 0;
 
-Vec3f CBLut::FromRGBA32u(RGBA32 rgb)
-{
-    Vec3f c = { rgb.c[0] / 256.0f, rgb.c[1] / 256.0f, rgb.c[2] / 256.0f };
-    return pow(c, kGamma);
-}
-    
+        for (; i + 4 <= n; i += 4)
+        {
+            cVec3SSE lms = lmsFromRGB * Load4(r, g, b, i);
 
-void CBLut::CreateIdentityLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
-{
-    constexpr int scale  = 256 / kLUTSize;
-    constexpr int offset = scale / 2;
+            __m128 error = _mm_mul_ps(s, _mm_sub_ps(elt(lms, kType), dot(simRow, lms)));
+
+            Store4(r, g, b, i, rgbFromLMS * (lms + error * correct));
+        }
+
+        return i;
+    }
+
+    // AVX2 versions of the above
+    struct cVec3AVX { __m256 x; __m256 y; __m256 z; };
+    struct cMat3AVX { cVec3AVX x; cVec3AVX y; cVec3AVX z; };
+
+    CB_TARGET_AVX2 inline cVec3AVX Splat8(Vec3f v)        { return { _mm256_set1_ps(v.x), _mm256_set1_ps(v.y), _mm256_set1_ps(v.z) }; }
+    CB_TARGET_AVX2 inline cMat3AVX Splat8(const Mat3f& m) { return { Splat8(m.x), Splat8(m.y), Splat8(m.z) }; }
 
-    for (int i = 0; i < kLUTSize; i++)
-    for (int j = 0; j < kLUTSize; j++)
-    for (int k = 0; k < kLUTSize; k++)
+    inline __m256& elt(cVec3AVX& v, int i) { return (&v.x)[i]; }
+
+    CB_TARGET_AVX2 inline __m256 dot(const cVec3AVX& a, const cVec3AVX& b)
     {
-        RGBA32& p = rgbLUT[i][j][k];
+        return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a.x, b.x), _mm256_mul_ps(a.y, b.y)), _mm256_mul_ps(a.z, b.z));
+    }
 
-        p.c[0] = k * scale + offset;
-        p.c[1] = j * scale + offset;
-        p.c[2] = i * scale + offset;
-        p.c[3] = 255;
+    CB_TARGET_AVX2 inline cVec3AVX operator*(const cMat3AVX& m, const cVec3AVX& v) { return { dot(m.x, v), dot(m.y, v), dot(m.z, v) }; }
+    CB_TARGET_AVX2 inline cVec3AVX operator*(__m256 s, const cVec3AVX& a)          { return { _mm256_mul_ps(s, a.x), _mm256_mul_ps(s, a.y), _mm256_mul_ps(s, a.z) }; }
+    CB_TARGET_AVX2 inline cVec3AVX operator+(const cVec3AVX& a, const cVec3AVX& b) { return { _mm256_add_ps(a.x, b.x), _mm256_add_ps(a.y, b.y), _mm256_add_ps(a.z, b.z) }; }
+    CB_TARGET_AVX2 inline cVec3AVX operator-(const cVec3AVX& a, const cVec3AVX& b) { return { _mm256_sub_ps(a.x, b.x), _mm256_sub_ps(a.y, b.y), _mm256_sub_ps(a.z, b.z) }; }
+
+    CB_TARGET_AVX2 inline cVec3AVX Load8(const float r[], const float g[], const float b[], int i)
+    {
+        return { _mm256_loadu_ps(r + i), _mm256_loadu_ps(g + i), _mm256_loadu_ps(b + i) };
     }
-}
 
-#define EXTRAPOLATE_LUT 1
+    CB_TARGET_AVX2 inline void Store8(float r[], float g[], float b[], int i, const cVec3AVX& v)
+    {
+        _mm256_storeu_ps(r + i, v.x);
+        _mm256_storeu_ps(g + i, v.y);
+        _mm256_storeu_ps(b + i, v.z);
+    }
 
-void CBLut::ApplyLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    template<int kType> CB_TARGET_AVX2 int SimulateBatchAVX2(int n, float r[], float g[], float b[], float strength)
+    {
+        const cMat3AVX lmsFromRGB = Splat8(kLMSFromRGB);
+        const cMat3AVX rgbFromLMS = Splat8(kRGBFromLMS);
+        const cVec3AVX simRow     = Splat8(row(kLMSSimulate, kType));
+        const __m256   s          = _mm256_set1_ps(strength);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            cVec3AVX lms = lmsFromRGB * Load8(r, g, b, i);
+
+            __m256& eltx = elt(lms, kType);
+            eltx = _mm256_add_ps(eltx, _mm256_mul_ps(s, _mm256_sub_ps(dot(simRow, lms), eltx)));
+
+            Store8(r, g, b, i, rgbFromLMS * lms);
+        }
+
+        return i;
+    }
+
+    CB_TARGET_AVX2 int DaltoniseBatchAVX2(int n, float r[], float g[], float b[], const Mat3f& lmsTransformIn, const Mat3f& errorToDeltaIn, float strength)
+    {
+        const cMat3AVX lmsFromRGB   = Splat8(kLMSFromRGBV);
+        const cMat3AVX rgbFromLMS   = Splat8(kRGBFromLMSV);
+        const cMat3AVX lmsTransform = Splat8(lmsTransformIn);
+        const cMat3AVX errorToDelta = Splat8(errorToDeltaIn);
+        const __m256   s            = _mm256_set1_ps(strength);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            cVec3AVX rgb      = Load8(r, g, b, i);
+            cVec3AVX rgbSim   = rgbFromLMS * (lmsTransform * (lmsFromRGB * rgb));
+            cVec3AVX rgbDelta = errorToDelta * (s * (rgb - rgbSim));
+
+            Store8(r, g, b, i, rgb + rgbDelta);
+        }
+
+        return i;
+    }
+
+    template<int kType> CB_TARGET_AVX2 int CorrectBatchAVX2(int n, float r[], float g[], float b[], float strength, Vec3f correctIn)
+    {
+        const cMat3AVX lmsFromRGB = Splat8(kLMSFromRGB);
+        const cMat3AVX rgbFromLMS = Splat8(kRGBFromLMS);
+        const cVec3AVX simRow     = Splat8(row(kLMSSimulate, kType));
+        const cVec3AVX correct    = Splat8(correctIn);
+        const __m256   s          = _mm256_set1_ps(strength);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            cVec3AVX lms = lmsFromRGB * Load8(r, g, b, i);
+
+            __m256 error = _mm256_mul_ps(s, _mm256_sub_ps(elt(lms, kType), dot(simRow, lms)));
+
+            Store8(r, g, b, i, rgbFromLMS * (lms + error * correct));
+        }
+
+        return i;
+    }
+
+    CB_TARGET_SSE2 int MatrixBatchSSE2(int n, float r[], float g[], float b[], const Mat3f& mIn)
+    {
+        const cMat3SSE m = Splat4(mIn);
+        int i = 0;
+
+        for (; i + 4 <= n; i += 4)
+            Store4(r, g, b, i, m * Load4(r, g, b, i));
+
+        return i;
+    }
+
+    CB_TARGET_AVX2 int MatrixBatchAVX2(int n, float r[], float g[], float b[], const Mat3f& mIn)
+    {
+        const cMat3AVX m = Splat8(mIn);
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+            Store8(r, g, b, i, m * Load8(r, g, b, i));
+
+        return i;
+    }
+}
+#endif
+
+namespace
 {
-    constexpr int lutShift = kLUTBits;
-    constexpr int lutSize  = 1 << lutShift;
-    constexpr int fShift   = 8 - lutShift;
-    constexpr int fHalf    = 1 << (fShift - 1);
-    constexpr int fMask    = (1 << fShift) - 1;
+    // Correct() adds error * CorrectVector() to the LMS colour. See Correct() for the derivation.
+    Vec3f CorrectVector(int lmsType, float strength)
+    {
+        float mc = strength * strength;
+        float ms = 1.0f - strength;
 
-    for (int i = 0; i < n; i++)
+        Vec3f amount3Recip = { -0.25f, -0.3f, -0.07f };
+        float amount = elt(amount3Recip, lmsType);
+
+        Vec3f correct = mc * amount * col(kNCDeltaRecip, lmsType);
+        elt(correct, lmsType) = ms * 2.0f;
+
+        return correct;
+    }
+
+    // Batch versions. The matrices are copied locally so the compiler knows
+    // they can't alias the colour arrays, and the per-colour maths matches the
+    // single-colour versions above exactly.
+    template<int kType> void SimulateBatch(int n, float r[], float g[], float b[], float strength)
     {
-        const uint8_t* ci = dataIn[i].c;
+        const Mat3f lmsFromRGB = kLMSFromRGB;
+        const Mat3f rgbFromLMS = kRGBFromLMS;
+        const Vec3f simRow     = row(kLMSSimulate, kType);
 
-        int co[3] = { ci[0] + fHalf,   ci[1] + fHalf,   ci[2] + fHalf   };
-        int i1[3] = { co[0] >> fShift, co[1] >> fShift, co[2] >> fShift };
-        int i0[3] = { i1[0] - 1,       i1[1] - 1,       i1[2] - 1       };
-        int s [3] = { co[0] & fMask,   co[1] & fMask,   co[2] & fMask   };
+        int i = 0;
 
-        for (int j = 0; j < 3; j++)
+    #ifdef CB_X86
+        if (SIMDLevel() >= kSIMDAVX2)
+            i = SimulateBatchAVX2<kType>(n, r, g, b, strength);
+        else if (SIMDLevel() >= kSIMDSSE2)
+            i = SimulateBatchSSE2<kType>(n, r, g, b, strength);
+    #endif
+
+        for (; i < n; i++)
         {
-            if (i0[j] < 0)
-            {
-                i0[j]++;
-            #ifdef EXTRAPOLATE_LUT
-                i1[j]++;
-                s [j] -= 8;
-            #endif
-            }
-            else
-            if (i1[j] >= lutSize)
-            {
-                i1[j]--;
-            #ifdef EXTRAPOLATE_LUT
-                i0[j]--;
-                s [j] += 8;
-            #endif
-            }
+            Vec3f lms = lmsFromRGB * Vec3f { r[i], g[i], b[i] };
+
+            float& eltx = elt(lms, kType);
+            eltx += strength * (dot(simRow, lms) - eltx);
 
-            assert(0 <= i0[j] && i0[j] < kLUTSize);
-            assert(0 <= i1[j] && i1[j] < kLUTSize);
+            Vec3f rgb = rgbFromLMS * lms;
+
+            r[i] = rgb.x;
+            g[i] = rgb.y;
+            b[i] = rgb.z;
         }
-        
-        RGBA32 lutC0 = rgbLUT[i0[2]][i0[1]][i0[0]];
-        RGBA32 lutC1 = rgbLUT[i1[2]][i1[1]][i1[0]];
+    }
 
-        int ch0 = (((8 - s[0]) * lutC0.c[0] + s[0] * lutC1.c[0])) >> 3;
-        int ch1 = (((8 - s[1]) * lutC0.c[1] + s[1] * lutC1.c[1])) >> 3;
-        int ch2 = (((8 - s[2]) * lutC0.c[2] + s[2] * lutC1.c[2])) >> 3;
+    void DaltoniseBatch(int n, float r[], float g[], float b[], const Mat3f& lmsTransformIn, const Mat3f& errorToDeltaIn, float strength)
+    {
+        const Mat3f lmsFromRGB   = kLMSFromRGBV;
+        const Mat3f rgbFromLMS   = kRGBFromLMSV;
+        const Mat3f lmsTransform = lmsTransformIn;
+        const Mat3f errorToDelta = errorToDeltaIn;
+
+        int i = 0;
+
+    #ifdef CB_X86
+        if (SIMDLevel() >= kSIMDAVX2)
+            i = DaltoniseBatchAVX2(n, r, g, b, lmsTransformIn, errorToDeltaIn, strength);
+        else if (SIMDLevel() >= kSIMDSSE2)
+            i = DaltoniseBatchSSE2(n, r, g, b, lmsTransformIn, errorToDeltaIn, strength);
+    #endif
 
-    #ifdef EXTRAPOLATE_LUT
-        ch0 = ch0 < 0 ? 0 : ch0 > 255 ? 255 : ch0;
-        ch1 = ch1 < 0 ? 0 : ch1 > 255 ? 255 : ch1;
-        ch2 = ch2 < 0 ? 0 : ch2 > 255 ? 255 : ch2;
+        for (; i < n; i++)
+        {
+            Vec3f rgb      = { r[i], g[i], b[i] };
+            Vec3f rgbSim   = rgbFromLMS * (lmsTransform * (lmsFromRGB * rgb));
+            Vec3f rgbDelta = errorToDelta * (strength * (rgb - rgbSim));
+
+            rgb = rgb + rgbDelta;
+
+            r[i] = rgb.x;
+            g[i] = rgb.y;
+            b[i] = rgb.z;
+        }
+    }
+
+    template<int kType> void CorrectBatch(int n, float r[], float g[], float b[], float strength)
+    {
+        const Mat3f lmsFromRGB = kLMSFromRGB;
+        const Mat3f rgbFromLMS = kRGBFromLMS;
+        const Vec3f simRow     = row(kLMSSimulate, kType);
+
+        const Vec3f correct    = CorrectVector(kType, strength);
+
+        int i = 0;
+
+    #ifdef CB_X86
+        if (SIMDLevel() >= kSIMDAVX2)
+            i = CorrectBatchAVX2<kType>(n, r, g, b, strength, correct);
+        else if (SIMDLevel() >= kSIMDSSE2)
+            i = CorrectBatchSSE2<kType>(n, r, g, b, strength, correct);
     #endif
 
-        assert(0 <= ch0 && ch0 <= 255);
-        assert(0 <= ch1 && ch1 <= 255);
-        assert(0 <= ch2 && ch2 <= 255);
+        for (; i < n; i++)
+        {
+            const Vec3f lms = lmsFromRGB * Vec3f { r[i], g[i], b[i] };
+
+            const float orgElt = elt(lms, kType);
+            const float simElt = dot(simRow, lms);
+            const float error  = strength * (orgElt - simElt);
 
-        dataOut[i].c[0] = ch0;
-        dataOut[i].c[1] = ch1;
-        dataOut[i].c[2] = ch2;
-        dataOut[i].c[3] = 255;
+            Vec3f rgb = rgbFromLMS * (lms + error * correct);
+
+            r[i] = rgb.x;
+            g[i] = rgb.y;
+            b[i] = rgb.z;
+        }
     }
 }
 
-void CBLut::ApplyLUTNoLerp(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+void CBLut::Simulate(int n, float r[], float g[], float b[], tLMS lmsType, float strength)
 {
-    constexpr int fShift = 8 - kLUTBits;
+    switch (lmsType)
+    {
+    case kL:
+        return SimulateBatch<kL>(n, r, g, b, strength);
+    case kM:
+        return SimulateBatch<kM>(n, r, g, b, strength);
+    case kS:
+        return SimulateBatch<kS>(n, r, g, b, strength);
+    }
+}
 
-    for (int i = 0; i < n; i++)
+void CBLut::Daltonise(int n, float r[], float g[], float b[], tLMS lmsType, float strength)
+{
+    switch (lmsType)
     {
-        const uint8_t* ci = dataIn[i].c;
+    case kL:
+        return DaltoniseBatch(n, r, g, b, kLMSProtanopeV,   kDaltonErrorToDeltaP, strength);
+    case kM:
+        return DaltoniseBatch(n, r, g, b, kLMSDeuteranopeV, kDaltonErrorToDeltaD, strength);
+    case kS:
+        return DaltoniseBatch(n, r, g, b, kLMSTritanopeV,   kDaltonErrorToDeltaT, strength);
+    }
+}
 
-        dataOut[i] = rgbLUT[ci[2] >> fShift][ci[1] >> fShift][ci[0] >> fShift];
+void CBLut::Correct(int n, float r[], float g[], float b[], tLMS lmsType, float strength)
+{
+    switch (lmsType)
+    {
+    case kL:
+        return CorrectBatch<kL>(n, r, g, b, strength);
+    case kM:
+        return CorrectBatch<kM>(n, r, g, b, strength);
+    case kS:
+        return CorrectBatch<kS>(n, r, g, b, strength);
     }
 }
 
-// --- Mono LUT support --------------------------------------------------------
+// Simulate, Daltonise, and Correct are all linear in linear RGB, and so can be
+// composed into a single matrix.
 
-void CBLut::ApplyMonoLUT(const RGBA32 monoLUT[256], int n, const RGBA32 dataIn[], RGBA32 dataOut[], int channel)
+Mat3f CBLut::SimulateMatrix(tLMS lmsType, float strength)
 {
-    if (channel < 0)
+    // Affected LMS channel is blended towards its simulated value
+    Mat3f lmsSimulate = kIdentity3;
+    Vec3f& eltRow = row(lmsSimulate, lmsType);
+
+    eltRow = (1.0f - strength) * eltRow + strength * row(kLMSSimulate, lmsType);
+
+    return kRGBFromLMS * lmsSimulate * kLMSFromRGB;
+}
+
+Mat3f CBLut::DaltoniseMatrix(tLMS lmsType, float strength)
+{
+    const Mat3f* lmsTransform = &kLMSProtanopeV;
+    const Mat3f* errorToDelta = &kDaltonErrorToDeltaP;
+
+    switch (lmsType)
     {
-        for (int i = 0; i < n; i++)
-        {
-            Vec3f c = FromRGBA32(dataIn[i]);    // now linear
-            float lumD65 = dot(Vec3f{0.2126f, 0.7152f, 0.0722f}, c);
-            
-            uint8_t lumU8 = ToU8(pow(lumD65, 1.0f / kGamma));    // lookup tables are in gamma space
-        
-            dataOut[i] = monoLUT[lumU8];
-        }
-        return;
+    case kL:
+        break;
+    case kM:
+        lmsTransform = &kLMSDeuteranopeV;
+        errorToDelta = &kDaltonErrorToDeltaD;
+        break;
+    case kS:
+        lmsTransform = &kLMSTritanopeV;
+        errorToDelta = &kDaltonErrorToDeltaT;
+        break;
     }
-    
-    for (int i = 0; i < n; i++)
-        dataOut[i] = monoLUT[dataIn[i].c[channel]];
+
+    Mat3f simulate = kRGBFromLMSV * *lmsTransform * kLMSFromRGBV;
+
+    return kIdentity3 + strength * (*errorToDelta * (kIdentity3 - simulate));
+}
+
+Mat3f CBLut::CorrectMatrix(tLMS lmsType, float strength)
+{
+    // error = dot(errorRow, lms), which is then distributed via CorrectVector()
+    Vec3f errorRow = { 0.0f, 0.0f, 0.0f };
+    elt(errorRow, lmsType) = 1.0f;
+    errorRow = strength * (errorRow - row(kLMSSimulate, lmsType));
+
+    Mat3f lmsCorrect = kIdentity3 + OuterProduct(CorrectVector(lmsType, strength), errorRow);
+
+    return kRGBFromLMS * lmsCorrect * kLMSFromRGB;
+}
+
+void CBLut::TransformMatrix(const Mat3f& m, int n, float r[], float g[], float b[])
+{
+    int i = 0;
+
+#ifdef CB_X86
+    if (SIMDLevel() >= kSIMDAVX2)
+        i = MatrixBatchAVX2(n, r, g, b, m);
+    else if (SIMDLevel() >= kSIMDSSE2)
+        i = MatrixBatchSSE2(n, r, g, b, m);
+#endif
+
+    for (; i < n; i++)
+    {
+        Vec3f c = m * Vec3f { r[i], g[i], b[i] };
+
+        r[i] = c.x;
+        g[i] = c.y;
+        b[i] = c.z;
+    }
+}
+
+namespace
+{
+    uint64_t HashBytes(uint64_t h, const void* data, size_t size)  // FNV-1a
+    {
+        const uint8_t* p = (const uint8_t*) data;
+
+        for (size_t i = 0; i < size; i++)
+            h = (h ^ p[i]) * 0x100000001b3ull;
+
+        return h;
+    }
+
+    uint64_t ComputeModelHash()
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+
+        const Mat3f* matrices[] =
+        {
+            &kLMSFromRGB, &kRGBFromLMS, &kLMSProtanope, &kLMSDeuteranope, &kLMSTritanope,
+            &kLMSSimulate, &kNCDeltaRecip, &kDaltonErrorToDeltaP, &kDaltonErrorToDeltaD, &kDaltonErrorToDeltaT,
+        };
+
+        for (const Mat3f* m : matrices)
+            h = HashBytes(h, m, sizeof(Mat3f));
+
+        // Not every constant is a matrix, e.g., Correct()'s tuning values, so also
+        // fingerprint the results of the model on a fixed grid of colours,
+        // including their final encoding.
+        typedef void tModelFunc(int n, float r[], float g[], float b[], tLMS lmsType, float strength);
+        tModelFunc* funcs[] = { Simulate, Daltonise, Correct };
+        const float strengths[] = { 1.0f, 0.5f };
+
+        constexpr int kProbeSize = 4 * 4 * 4;
+        float r[kProbeSize], g[kProbeSize], b[kProbeSize];
+        RGBA32 encoded[kProbeSize];
+
+        for (tModelFunc* func : funcs)
+        for (float strength : strengths)
+        for (int lmsType = kL; lmsType <= kS; lmsType++)
+        {
+            for (int i = 0; i < kProbeSize; i++)
+            {
+                r[i] = (i      & 3) / 3.0f;
+                g[i] = (i >> 2 & 3) / 3.0f;
+                b[i] = (i >> 4 & 3) / 3.0f;
+            }
+
+            func(kProbeSize, r, g, b, tLMS(lmsType), strength);
+
+            for (int i = 0; i < kProbeSize; i++)
+                encoded[i] = ToRGBA32uFast(Vec3f { r[i], g[i], b[i] });
+
+            h = HashBytes(h, r, sizeof(r));
+            h = HashBytes(h, g, sizeof(g));
+            h = HashBytes(h, b, sizeof(b));
+            h = HashBytes(h, encoded, sizeof(encoded));
+        }
+
+        return h;
+    }
+}
+
+uint64_t CBLut::ModelHash()
+{
+    static uint64_t hash = ComputeModelHash();
+
+    return hash;
+}
+
+// --- RGB LUT support ---------------------------------------------------------
+
+namespace
+{
+    constexpr float kGamma = 2.2f;
+
+    inline uint8_t ToU8(float f)
+    {
+        if (f <= 0.0f)
+            return 0;
+        if (f >= 1.0f)
+            return 255;
+
+        return uint8_t(f * 255.0f + 0.5f);
+    }
+
+    inline uint8_t ToU8u(float f)   // 0-256 variant used for LUT construction
+    {
+        if (f <= 0.0f)
+            return 0;
+        if (f >= 1.0f)
+            return 255;
+
+        return uint8_t(f * 256.0f);
+    }
+}
+
+RGBA32 CBLut::ToRGBA32(Vec3f c)
+{
+    c = pow(c, 1.0f / kGamma);
+    RGBA32 result;
+
+    result.c[0] = ToU8(c.x);
+    result.c[1] = ToU8(c.y);
+    result.c[2] = ToU8(c.z);
+    result.c[3] = 255;
+
+    return result;
+}
+
+RGBA32 CBLut::ToRGBA32u(Vec3f c)
+{
+    c = pow(c, 1.0f / kGamma);
+    RGBA32 result;
+
+    result.c[0] = ToU8u(c.x);
+    result.c[1] = ToU8u(c.y);
+    result.c[2] = ToU8u(c.z);
+    result.c[3] = 255;
+
+    return result;
+}
+
+Vec3f CBLut::FromRGBA32(RGBA32 rgb)
+{
+    Vec3f c = { rgb.c[0] / 255.0f, rgb.c[1] / 255.0f, rgb.c[2] / 255.0f };
+    return pow(c, kGamma);
+}
+
+Vec3f CBLut::FromRGBA32u(RGBA32 rgb)
+{
+    Vec3f c = { rgb.c[0] / 256.0f, rgb.c[1] / 256.0f, rgb.c[2] / 256.0f };
+    return pow(c, kGamma);
+}
+
+namespace
+{
+    // Table-driven versions of the above. Decoding is a straight lookup. For
+    // encoding we find the smallest input giving each code, and bucket (0, 1)
+    // by float exponent and leading mantissa bits, finely enough that once
+    // we've looked up the code at the start of a bucket, a single comparison
+    // gives the final code. Both give identical results to powf.
+    constexpr int      kEncodeMinExp       = -24;     // inputs below 2^kEncodeMinExp always encode to 0
+    constexpr int      kEncodeMantissaBits = 7;
+    constexpr int      kEncodeShift        = 23 - kEncodeMantissaBits;
+    constexpr int      kEncodeBuckets      = -kEncodeMinExp << kEncodeMantissaBits;
+    constexpr uint32_t kEncodeBase         = uint32_t(127 + kEncodeMinExp) << 23;  // float bits of 2^kEncodeMinExp
+
+    inline uint32_t FloatBits(float f)    { uint32_t u; memcpy(&u, &f, sizeof(u)); return u; }
+    inline float    BitsFloat(uint32_t u) { float f; memcpy(&f, &u, sizeof(f)); return f; }
+
+    struct cGammaEncoder
+    {
+        float   thresholds[257];            // thresholds[i] = smallest input that encodes to i, thresholds[256] is a sentinel
+        uint8_t buckets[kEncodeBuckets + 3];// code for the start of each bucket, padded so 32-bit gathers stay in bounds
+
+        template<class T> void Init(T encode);
+        uint8_t Encode(float f) const;
+    };
+
+    template<class T> void cGammaEncoder::Init(T encode)
+    {
+        thresholds[0]   = 0.0f;
+        thresholds[256] = 2.0f;
+
+        for (int code = 1; code < 256; code++)
+        {
+            // Binary search over the (ordered) bit patterns of [0, 1]
+            uint32_t lo = 0;
+            uint32_t hi = FloatBits(1.0f);
+
+            while (lo < hi)
+            {
+                uint32_t mid = lo + (hi - lo) / 2;
+
+                if (encode(BitsFloat(mid)) >= code)
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+
+            thresholds[code] = BitsFloat(lo);
+        }
+
+        assert(thresholds[1] >= BitsFloat(kEncodeBase));
+
+        for (int i = 0; i < kEncodeBuckets; i++)
+        {
+            buckets[i] = encode(BitsFloat(kEncodeBase + (uint32_t(i) << kEncodeShift)));
+            assert(i == 0 || buckets[i] - buckets[i - 1] <= 1);     // Encode() relies on this
+        }
+
+        assert(buckets[kEncodeBuckets - 1] >= 254);
+    }
+
+    inline uint8_t cGammaEncoder::Encode(float f) const
+    {
+        if (!(f >= BitsFloat(kEncodeBase)))     // also catches NaNs
+            return 0;
+        if (f >= 1.0f)
+            return 255;
+
+        // Buckets are small enough to contain at most one code boundary
+        int code = buckets[(FloatBits(f) - kEncodeBase) >> kEncodeShift];
+
+        return uint8_t(code + (f >= thresholds[code + 1]));
+    }
+
+    struct cGammaTables
+    {
+        float         decode [256];   // FromRGBA32
+        float         decodeU[256];   // FromRGBA32u
+        cGammaEncoder encode;         // ToRGBA32
+        cGammaEncoder encodeU;        // ToRGBA32u
+
+        cGammaTables();
+    };
+
+    cGammaTables::cGammaTables()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            decode [i] = powf(i / 255.0f, kGamma);
+            decodeU[i] = powf(i / 256.0f, kGamma);
+        }
+
+        encode .Init([](float f) { return ToU8 (powf(f, 1.0f / kGamma)); });
+        encodeU.Init([](float f) { return ToU8u(powf(f, 1.0f / kGamma)); });
+    }
+
+    inline const cGammaTables& GammaTables()
+    {
+        static cGammaTables tables;
+        return tables;
+    }
+
+#ifdef CB_X86
+    CB_TARGET_AVX2 inline __m256i EncodeAVX2(const cGammaEncoder& e, __m256 f)
+    {
+        const __m256 base = _mm256_castsi256_ps(_mm256_set1_epi32(kEncodeBase));
+        const __m256 one  = _mm256_set1_ps(1.0f);
+        const __m256i mask = _mm256_set1_epi32(0xFF);
+
+        __m256  inRange = _mm256_and_ps(_mm256_cmp_ps(f, base, _CMP_GE_OQ), _mm256_cmp_ps(f, one, _CMP_LT_OQ));
+        __m256i bucket  = _mm256_srli_epi32(_mm256_sub_epi32(_mm256_castps_si256(f), _mm256_set1_epi32(kEncodeBase)), kEncodeShift);
+        bucket = _mm256_and_si256(bucket, _mm256_castps_si256(inRange));
+
+        __m256i code      = _mm256_and_si256(_mm256_i32gather_epi32((const int*) e.buckets, bucket, 1), mask);
+        __m256  threshold = _mm256_i32gather_ps(e.thresholds + 1, code, 4);
+        code = _mm256_sub_epi32(code, _mm256_castps_si256(_mm256_cmp_ps(f, threshold, _CMP_GE_OQ)));
+
+        // Out-of-range inputs encode to 0 or 255, NaNs to 0
+        __m256i clamped = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(f, one, _CMP_GE_OQ)), mask);
+
+        return _mm256_blendv_epi8(clamped, code, _mm256_castps_si256(inRange));
+    }
+
+    CB_TARGET_AVX2 inline __m256i EncodeAVX2(const cGammaEncoder& e, __m256 r, __m256 g, __m256 b)
+    {
+        const __m256i alpha = _mm256_set1_epi32(int(0xFF000000));
+
+        __m256i cr = EncodeAVX2(e, r);
+        __m256i cg = EncodeAVX2(e, g);
+        __m256i cb = EncodeAVX2(e, b);
+
+        return _mm256_or_si256(_mm256_or_si256(cr, _mm256_slli_epi32(cg, 8)), _mm256_or_si256(_mm256_slli_epi32(cb, 16), alpha));
+    }
+
+    CB_TARGET_AVX2 int EncodeBatchAVX2(const cGammaEncoder& e, int n, const float r[], const float g[], const float b[], RGBA32 dataOut[])
+    {
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_si256((__m256i*) (dataOut + i), EncodeAVX2(e, _mm256_loadu_ps(r + i), _mm256_loadu_ps(g + i), _mm256_loadu_ps(b + i)));
+
+        return i;
+    }
+
+    // Encodes base + strength * delta, for planar rows of n colours
+    CB_TARGET_AVX2 int EncodeAffineAVX2(const cGammaEncoder& e, int n, const float base[], const float delta[], float strength, RGBA32 dataOut[])
+    {
+        const __m256 s = _mm256_set1_ps(strength);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 r = _mm256_add_ps(_mm256_loadu_ps(base + i        ), _mm256_mul_ps(s, _mm256_loadu_ps(delta + i        )));
+            __m256 g = _mm256_add_ps(_mm256_loadu_ps(base + i + n    ), _mm256_mul_ps(s, _mm256_loadu_ps(delta + i + n    )));
+            __m256 b = _mm256_add_ps(_mm256_loadu_ps(base + i + n * 2), _mm256_mul_ps(s, _mm256_loadu_ps(delta + i + n * 2)));
+
+            _mm256_storeu_si256((__m256i*) (dataOut + i), EncodeAVX2(e, r, g, b));
+        }
+
+        return i;
+    }
+#endif
+
+    void EncodeBatch(const cGammaEncoder& e, int n, const float r[], const float g[], const float b[], RGBA32 dataOut[])
+    {
+        int i = 0;
+
+    #ifdef CB_X86
+        if (SIMDLevel() >= kSIMDAVX2)
+            i = EncodeBatchAVX2(e, n, r, g, b, dataOut);
+    #endif
+
+        for (; i < n; i++)
+        {
+            dataOut[i].c[0] = e.Encode(r[i]);
+            dataOut[i].c[1] = e.Encode(g[i]);
+            dataOut[i].c[2] = e.Encode(b[i]);
+            dataOut[i].c[3] = 255;
+        }
+    }
+}
+
+RGBA32 CBLut::ToRGBA32Fast(Vec3f c)
+{
+    const cGammaEncoder& encode = GammaTables().encode;
+    RGBA32 result;
+
+    result.c[0] = encode.Encode(c.x);
+    result.c[1] = encode.Encode(c.y);
+    result.c[2] = encode.Encode(c.z);
+    result.c[3] = 255;
+
+    return result;
+}
+
+RGBA32 CBLut::ToRGBA32uFast(Vec3f c)
+{
+    const cGammaEncoder& encode = GammaTables().encodeU;
+    RGBA32 result;
+
+    result.c[0] = encode.Encode(c.x);
+    result.c[1] = encode.Encode(c.y);
+    result.c[2] = encode.Encode(c.z);
+    result.c[3] = 255;
+
+    return result;
+}
+
+void CBLut::ToRGBA32uFast(int n, const float r[], const float g[], const float b[], RGBA32 dataOut[])
+{
+    EncodeBatch(GammaTables().encodeU, n, r, g, b, dataOut);
+}
+
+Vec3f CBLut::FromRGBA32Fast(RGBA32 rgb)
+{
+    const float* decode = GammaTables().decode;
+    return { decode[rgb.c[0]], decode[rgb.c[1]], decode[rgb.c[2]] };
+}
+
+Vec3f CBLut::FromRGBA32uFast(RGBA32 rgb)
+{
+    const float* decode = GammaTables().decodeU;
+    return { decode[rgb.c[0]], decode[rgb.c[1]], decode[rgb.c[2]] };
+}
+
+void CBLut::TransformMatrix(const Mat3f& m, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    const cGammaTables& tables = GammaTables();
+    const int kBlockSize = 256;
+
+    float r[kBlockSize];
+    float g[kBlockSize];
+    float b[kBlockSize];
+
+    for (int i = 0; i < n; i += kBlockSize)
+    {
+        int count = n - i < kBlockSize ? n - i : kBlockSize;
+
+        for (int j = 0; j < count; j++)
+        {
+            const uint8_t* c = dataIn[i + j].c;
+
+            r[j] = tables.decode[c[0]];
+            g[j] = tables.decode[c[1]];
+            b[j] = tables.decode[c[2]];
+        }
+
+        TransformMatrix(m, count, r, g, b);
+
+        for (int j = 0; j < count; j++)
+        {
+            RGBA32& c = dataOut[i + j];
+
+            c.c[0] = tables.encode.Encode(r[j]);
+            c.c[1] = tables.encode.Encode(g[j]);
+            c.c[2] = tables.encode.Encode(b[j]);
+            c.c[3] = 255;
+        }
+    }
+}
+    
+
+bool CBLut::IsValidLUTSize(int size)
+{
+    for (int bits = kMinLUTBits; bits <= kMaxLUTBits; bits++)
+        if (size == (1 << bits) || size == (1 << bits) + 1)
+            return true;
+
+    return false;
+}
+
+namespace
+{
+    // Shapers place sample i of n near 256 (i / (n - 1))^power, in the 0-256 space of FromRGBA32u.
+    // Positions are rounded to whole channel values, as they are for unshaped luts, so that samples
+    // are hit exactly, and the shaper is linear between them.
+    void ShaperSamplesU8(int size, float power, int u[])
+    {
+        for (int i = 0; i < size; i++)
+        {
+            u[i] = int(256.0f * powf(i / float(size - 1), power) + 0.5f);
+
+            if (i > 0 && u[i] <= u[i - 1])     // keep at least one value per cell...
+                u[i] = u[i - 1] + 1;
+        }
+
+        for (int i = size - 1; i >= 0; i--)     // ... while staying within range
+            if (u[i] > 256 - (size - 1 - i))
+                u[i] = 256 - (size - 1 - i);
+    }
+
+    void CreateShaper(int size, float power, uint16_t shaper[kLUTShaperEntries])
+    {
+        int u[kMaxLUTSize];
+        ShaperSamplesU8(size, power, u);
+
+        for (int i = 0, v = 0; v < 256; v++)
+        {
+            while (u[i + 1] <= v)
+                i++;
+
+            int w  = u[i + 1] - u[i];
+            int co = (i << kLUTShaperBits) + (((v - u[i]) << kLUTShaperBits) + w / 2) / w;
+
+            shaper[v] = shaper[256 + v] = shaper[512 + v] = uint16_t(co);
+        }
+    }
+}
+
+RGBLUT CBLut::AllocLUT(int size)
+{
+    assert(IsValidLUTSize(size));
+
+    return LUTView(size, new RGBA32[size * size * size]);
+}
+
+RGBLUT CBLut::AllocShapedLUT(int size, float power)
+{
+    assert(2 <= size && size <= kMaxLUTSize && power > 0.0f);
+
+    // One block, with the shaper directly before the samples, as in binary files
+    const int shaperWords = kLUTShaperEntries * sizeof(uint16_t) / sizeof(RGBA32);
+
+    RGBA32* block = new RGBA32[shaperWords + size * size * size];
+    RGBLUT  lut   = LUTView(size, block + shaperWords, (uint16_t*) block);
+
+    CreateShaper(size, power, lut.shaper);
+
+    return lut;
+}
+
+RGBLUT CBLut::LUTView(int size, RGBA32 data[], uint16_t shaper[])
+{
+    assert(shaper ? 2 <= size && size <= kMaxLUTSize : IsValidLUTSize(size));
+
+    RGBLUT lut;
+    lut.size   = size;
+    lut.bits   = 0;
+    lut.data   = data;
+    lut.shaper = shaper;
+
+    while ((2 << lut.bits) <= size)
+        lut.bits++;
+
+    return lut;
+}
+
+void CBLut::FreeLUT(RGBLUT* lut)
+{
+    if (lut->shaper)
+        delete[] (RGBA32*) lut->shaper;   // from AllocShapedLUT
+    else
+        delete[] lut->data;
+
+    lut->data   = 0;
+    lut->shaper = 0;
+}
+
+uint32_t CBLut::LUTChecksum(const RGBLUT& lut)
+{
+    const RGBA32* p = lut.data;
+    const int n = lut.size * lut.size * lut.size;
+
+    uint32_t h = 0x811c9dc5;    // FNV-1a, a word at a time
+
+    if (lut.shaper)
+        for (int i = 0; i < kLUTShaperEntries; i++)
+            h = (h ^ lut.shaper[i]) * 0x01000193;
+
+    for (int i = 0; i < n; i++)
+        h = (h ^ p[i].u32) * 0x01000193;
+
+    return h;
+}
+
+LUTFileHeader CBLut::MakeLUTFileHeader(const RGBLUT& lut, uint64_t userData)
+{
+    LUTFileHeader header = {};
+
+    header.magic      = kLUTFileMagic;
+    header.version    = lut.shaper ? kLUTFileVersionShaper : kLUTFileVersion;
+    header.headerSize = sizeof(LUTFileHeader) + (lut.shaper ? kLUTShaperEntries * sizeof(uint16_t) : 0);
+    header.size       = uint16_t(lut.size);
+    header.channels   = 4;
+    header.bitDepth   = 8;
+    header.layout     = kLUTFileLayoutRGBA;
+    header.checksum   = LUTChecksum(lut);
+    header.userData   = userData;
+
+    return header;
+}
+
+bool CBLut::LUTFromFileData(const void* data, size_t dataSize, RGBLUT* lut, bool verify)
+{
+    const LUTFileHeader* header = (const LUTFileHeader*) data;
+    const size_t shaperSize = kLUTShaperEntries * sizeof(uint16_t);
+
+    if (dataSize < sizeof(LUTFileHeader)
+     || header->magic      != kLUTFileMagic
+     || (header->version   != kLUTFileVersion && header->version != kLUTFileVersionShaper))
+        return false;
+
+    bool shaped = header->version == kLUTFileVersionShaper;
+
+    if (header->headerSize <  sizeof(LUTFileHeader) + (shaped ? shaperSize : 0)
+     || header->channels   != 4
+     || header->bitDepth   != 8
+     || header->layout     != kLUTFileLayoutRGBA
+     || !(shaped ? 2 <= header->size && header->size <= kMaxLUTSize : IsValidLUTSize(header->size)))
+        return false;
+
+    size_t numSamples = size_t(header->size) * header->size * header->size;
+    const uint8_t* samples = (const uint8_t*) data + header->headerSize;
+
+    if (dataSize != header->headerSize + numSamples * sizeof(RGBA32) || uintptr_t(samples) % alignof(RGBA32) != 0)
+        return false;
+
+    uint16_t* shaper = shaped ? (uint16_t*) (samples - shaperSize) : 0;
+
+    // The kernels rely on shaper entries being in range
+    if (shaper)
+        for (int i = 0; i < kLUTShaperEntries; i++)
+            if (shaper[i] > (header->size - 1) << kLUTShaperBits)
+                return false;
+
+    RGBLUT view = LUTView(header->size, (RGBA32*) samples, shaper);
+
+    if (verify && LUTChecksum(view) != header->checksum)
+        return false;
+
+    *lut = view;
+    return true;
+}
+
+namespace
+{
+    // LUT geometry. For the templated kernels below, kBits is non-zero, and
+    // all of this is known at compile time.
+    struct cLUTGrid
+    {
+        int bits;       // log2 of the number of cells per axis
+        int size;       // samples per axis
+        int fShift;     // fractional bits of LUT coordinates
+        int fOne;       // 1 << fShift
+        int fHalf;      // offset of cell-centred samples
+        int bias;       // 1 if samples are cell-centred, in which case channel value c lies after sample ((c + fHalf) >> fShift) - 1
+        const uint16_t* shaper;     // if set, gives the LUT coordinate of each channel value instead
+    };
+
+    template<int kBits, int kNodal> inline cLUTGrid LUTGrid(const RGBLUT& lut)
+    {
+        cLUTGrid g;
+
+        g.bits   = kBits ? kBits : lut.bits;
+        g.size   = kBits ? (1 << kBits) + kNodal : lut.size;
+        g.shaper = kBits ? 0 : lut.shaper;     // shaped luts always take the generic kernels
+        g.fShift = g.shaper ? kLUTShaperBits : 8 - g.bits;
+        g.fOne   = 1 << g.fShift;
+
+        // With 256 samples per axis there is no room for an offset, and each value maps directly to its own sample
+        bool centred = !g.shaper && g.size == (1 << g.bits) && g.fShift > 0;
+
+        g.fHalf = centred ? g.fOne / 2 : 0;
+        g.bias  = centred ? 1 : 0;
+
+        return g;
+    }
+
+    inline int LUTSampleU8(const cLUTGrid& g, int i)  // in the 0-256 space of FromRGBA32u
+    {
+        return (i << g.fShift) + g.fHalf;
+    }
+
+    void LUTSamplesU8(const RGBLUT& lut, int u[])
+    {
+        if (lut.shaper)
+        {
+            // Invert the red channel's shaper: each sample sits at the first value that reaches it
+            for (int i = 0, v = 0; i < lut.size; i++)
+            {
+                while (v < 256 && lut.shaper[v] < (i << kLUTShaperBits))
+                    v++;
+
+                u[i] = v;
+            }
+
+            return;
+        }
+
+        cLUTGrid g = LUTGrid<0, 0>(lut);
+
+        for (int i = 0; i < lut.size; i++)
+            u[i] = LUTSampleU8(g, i);
+    }
+}
+
+void CBLut::LUTSampleValues(const RGBLUT& lut, float values[])
+{
+    int u[kMaxLUTSize];
+    LUTSamplesU8(lut, u);
+
+    for (int i = 0; i < lut.size; i++)
+        values[i] = powf(u[i] / 256.0f, kGamma);
+}
+
+void CBLut::CreateIdentityLUT(const RGBLUT& lut)
+{
+    int u[kMaxLUTSize];
+    LUTSamplesU8(lut, u);
+
+    RGBA32* p = lut.data;
+
+    for (int i = 0; i < lut.size; i++)
+    for (int j = 0; j < lut.size; j++)
+    for (int k = 0; k < lut.size; k++)
+    {
+        int ci[3] = { u[k], u[j], u[i] };
+
+        p->c[0] = ci[0] < 255 ? ci[0] : 255;
+        p->c[1] = ci[1] < 255 ? ci[1] : 255;
+        p->c[2] = ci[2] < 255 ? ci[2] : 255;
+        p->c[3] = 255;
+        p++;
+    }
+}
+
+void CBLut::CreateIdentityLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
+{
+    CreateIdentityLUT(LUTView(rgbLUT));
+}
+
+#define EXTRAPOLATE_LUT 1
+
+namespace
+{
+    // Find the two LUT samples bracketing each channel of 'ci', and the weight of the upper one, in 0..g.fOne.
+    inline void LUTCoords(const cLUTGrid& g, const uint8_t ci[], int i0[3], int i1[3], int s[3])
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            int co = g.shaper ? g.shaper[256 * j + ci[j]] : ci[j] + g.fHalf;
+
+            i0[j] = (co >> g.fShift) - g.bias;
+            s [j] = co & (g.fOne - 1);
+
+        #ifdef EXTRAPOLATE_LUT
+            // Clamp to the edge cells, and extrapolate from them
+            int i0c = i0[j] < 0 ? 0 : i0[j] > g.size - 2 ? g.size - 2 : i0[j];
+
+            s [j] += (i0[j] - i0c) * g.fOne;
+            i0[j]  = i0c;
+            i1[j]  = i0c + 1;
+        #else
+            i1[j] = i0[j] + 1 < g.size - 1 ? i0[j] + 1 : g.size - 1;
+            i0[j] = i0[j] > 0 ? i0[j] : 0;
+        #endif
+
+            assert(0 <= i0[j] && i0[j] < g.size);
+            assert(0 <= i1[j] && i1[j] < g.size);
+        }
+    }
+
+    inline int LUTIndex(const cLUTGrid& g, int x, int y, int z)
+    {
+        return (z * g.size + y) * g.size + x;
+    }
+
+    inline uint8_t LUTChannel(int ch, int fBits)
+    {
+        ch >>= fBits;
+
+    #ifdef EXTRAPOLATE_LUT
+        ch = ch < 0 ? 0 : ch > 255 ? 255 : ch;
+    #endif
+
+        assert(0 <= ch && ch <= 255);
+        return uint8_t(ch);
+    }
+
+    template<int kBits, int kNodal> void ApplyLUTDiagonal(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const cLUTGrid g = LUTGrid<kBits, kNodal>(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            int i0[3], i1[3], s[3];
+            LUTCoords(g, dataIn[i].c, i0, i1, s);
+
+            RGBA32 lutC0 = lut.data[LUTIndex(g, i0[0], i0[1], i0[2])];
+            RGBA32 lutC1 = lut.data[LUTIndex(g, i1[0], i1[1], i1[2])];
+
+            for (int j = 0; j < 3; j++)
+                dataOut[i].c[j] = LUTChannel((g.fOne - s[j]) * lutC0.c[j] + s[j] * lutC1.c[j], g.fShift);
+
+            dataOut[i].c[3] = 255;
+        }
+    }
+
+    // Pick the tetrahedron containing the point with fractions s, which runs from c000 to c111 via cA and cB, given
+    // the offsets to the next sample along each axis. Returns the offsets of cA and cB, and the weights of all four.
+    template<class T> inline void LUTTetrahedron(const T s[3], T fOne, int dx, int dy, int dz, int* dA, int* dB, T w[4])
+    {
+        const T fx = s[0];
+        const T fy = s[1];
+        const T fz = s[2];
+
+        if (fx >= fy)
+        {
+            if (fy >= fz)
+                { *dA = dx; *dB = dx + dy; w[1] = fx - fy; w[2] = fy - fz; w[3] = fz; w[0] = fOne - fx; }
+            else if (fx >= fz)
+                { *dA = dx; *dB = dx + dz; w[1] = fx - fz; w[2] = fz - fy; w[3] = fy; w[0] = fOne - fx; }
+            else
+                { *dA = dz; *dB = dx + dz; w[1] = fz - fx; w[2] = fx - fy; w[3] = fy; w[0] = fOne - fz; }
+        }
+        else
+        {
+            if (fz >= fy)
+                { *dA = dz; *dB = dy + dz; w[1] = fz - fy; w[2] = fy - fx; w[3] = fx; w[0] = fOne - fz; }
+            else if (fz >= fx)
+                { *dA = dy; *dB = dy + dz; w[1] = fy - fz; w[2] = fz - fx; w[3] = fx; w[0] = fOne - fy; }
+            else
+                { *dA = dy; *dB = dx + dy; w[1] = fy - fx; w[2] = fx - fz; w[3] = fz; w[0] = fOne - fy; }
+        }
+    }
+
+    template<int kBits, int kNodal> void ApplyLUTTetrahedral(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const cLUTGrid g = LUTGrid<kBits, kNodal>(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            int i0[3], i1[3], s[3];
+            LUTCoords(g, dataIn[i].c, i0, i1, s);
+
+            // Offsets to the next sample along each axis
+            int dx = i1[0] - i0[0];
+            int dy = (i1[1] - i0[1]) * g.size;
+            int dz = (i1[2] - i0[2]) * g.size * g.size;
+
+            int dA, dB, w[4];
+            LUTTetrahedron(s, g.fOne, dx, dy, dz, &dA, &dB, w);
+
+            const RGBA32* c000 = lut.data + LUTIndex(g, i0[0], i0[1], i0[2]);
+
+            RGBA32 lutC[4] = { c000[0], c000[dA], c000[dB], c000[dx + dy + dz] };
+
+            for (int j = 0; j < 3; j++)
+                dataOut[i].c[j] = LUTChannel(w[0] * lutC[0].c[j] + w[1] * lutC[1].c[j] + w[2] * lutC[2].c[j] + w[3] * lutC[3].c[j], g.fShift);
+
+            dataOut[i].c[3] = 255;
+        }
+    }
+
+    template<int kBits, int kNodal> void ApplyLUTTrilinear(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const cLUTGrid g = LUTGrid<kBits, kNodal>(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            int i0[3], i1[3], s[3];
+            LUTCoords(g, dataIn[i].c, i0, i1, s);
+
+            RGBA32 lutC[8];
+
+            for (int k = 0; k < 8; k++)
+                lutC[k] = lut.data[LUTIndex(g, (k & 1 ? i1 : i0)[0], (k & 2 ? i1 : i0)[1], (k & 4 ? i1 : i0)[2])];
+
+            for (int j = 0; j < 3; j++)
+            {
+                int cx[4], cy[2];
+
+                for (int k = 0; k < 4; k++)
+                    cx[k] = g.fOne * lutC[2 * k].c[j] + s[0] * (lutC[2 * k + 1].c[j] - lutC[2 * k].c[j]);
+                for (int k = 0; k < 2; k++)
+                    cy[k] = g.fOne * cx[2 * k] + s[1] * (cx[2 * k + 1] - cx[2 * k]);
+
+                int cz = g.fOne * cy[0] + s[2] * (cy[1] - cy[0]);
+
+                dataOut[i].c[j] = LUTChannel(cz, 3 * g.fShift);
+            }
+
+            dataOut[i].c[3] = 255;
+        }
+    }
+
+    template<int kBits, int kNodal> void ApplyLUTNearest(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const cLUTGrid g = LUTGrid<kBits, kNodal>(lut);
+        const int round = g.bias ? 0 : g.fOne / 2;    // cell-centred samples already round down to the nearest
+
+        for (int i = 0; i < n; i++)
+        {
+            const uint8_t* ci = dataIn[i].c;
+            int co[3];
+
+            for (int j = 0; j < 3; j++)
+                co[j] = ((g.shaper ? g.shaper[256 * j + ci[j]] : ci[j]) + round) >> g.fShift;
+
+            dataOut[i] = lut.data[LUTIndex(g, co[0], co[1], co[2])];
+        }
+    }
+
+#ifdef CB_X86
+    // AVX2 versions of the above, processing 8 pixels at a time. The edge
+    // branches become clamps of i0 to [0, size - 2], with the clamped-off
+    // amount moved into s, and LUT samples are fetched via gathers. Output is
+    // bit-identical to the scalar versions.
+
+    CB_TARGET_AVX2 inline void LUTCoordsAVX2(const cLUTGrid& g, __m256i ci, __m256i i0[3], __m256i i1[3], __m256i s[3])
+    {
+        const __m256i one   = _mm256_set1_epi32(1);
+        const __m256i half  = _mm256_set1_epi32(g.fHalf);
+        const __m256i bias  = _mm256_set1_epi32(g.bias);
+        const __m256i mask  = _mm256_set1_epi32(g.fOne - 1);
+        const __m256i u8Max = _mm256_set1_epi32(255);
+
+        for (int j = 0; j < 3; j++)
+        {
+            __m256i cj = _mm256_and_si256(_mm256_srli_epi32(ci, 8 * j), u8Max);
+            __m256i co;
+
+            if (g.shaper)   // gather the aligned pair of 16-bit entries holding each, so as not to read past the shaper, and pick the right half
+            {
+                __m256i pair = _mm256_i32gather_epi32((const int*) (g.shaper + 256 * j), _mm256_srli_epi32(cj, 1), 4);
+                co = _mm256_and_si256(_mm256_srlv_epi32(pair, _mm256_slli_epi32(_mm256_and_si256(cj, one), 4)), _mm256_set1_epi32(0xFFFF));
+            }
+            else
+                co = _mm256_add_epi32(cj, half);
+            __m256i i0j = _mm256_sub_epi32(_mm256_srli_epi32(co, g.fShift), bias);
+
+            s[j] = _mm256_and_si256(co, mask);
+
+        #ifdef EXTRAPOLATE_LUT
+            i0[j] = _mm256_min_epi32(_mm256_max_epi32(i0j, _mm256_setzero_si256()), _mm256_set1_epi32(g.size - 2));
+            i1[j] = _mm256_add_epi32(i0[j], one);
+            s [j] = _mm256_add_epi32(s[j], _mm256_slli_epi32(_mm256_sub_epi32(i0j, i0[j]), g.fShift));
+        #else
+            i1[j] = _mm256_min_epi32(_mm256_add_epi32(i0j, one), _mm256_set1_epi32(g.size - 1));
+            i0[j] = _mm256_max_epi32(i0j, _mm256_setzero_si256());
+        #endif
+        }
+    }
+
+    CB_TARGET_AVX2 inline __m256i LUTIndexAVX2(const cLUTGrid& g, const __m256i i[3])
+    {
+        if (g.size == (1 << g.bits))
+            return _mm256_or_si256(_mm256_or_si256(i[0], _mm256_slli_epi32(i[1], g.bits)), _mm256_slli_epi32(i[2], 2 * g.bits));
+
+        const __m256i size = _mm256_set1_epi32(g.size);
+        return _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(i[2], size), i[1]), size), i[0]);
+    }
+
+    // Returns the offset from i0 to i1, given the stride for that axis. As i1 - i0 is always 0 or 1, this is a mask.
+    CB_TARGET_AVX2 inline __m256i LUTStepAVX2(__m256i i0, __m256i i1, int stride)
+    {
+        return _mm256_and_si256(_mm256_sub_epi32(i0, i1), _mm256_set1_epi32(stride));
+    }
+
+    CB_TARGET_AVX2 inline __m256i LUTChannelAVX2(__m256i c, int j)
+    {
+        return _mm256_and_si256(_mm256_srli_epi32(c, 8 * j), _mm256_set1_epi32(255));
+    }
+
+    CB_TARGET_AVX2 inline __m256i LUTResultAVX2(__m256i result, __m256i ch, int fBits, int j)
+    {
+        ch = _mm256_srai_epi32(ch, fBits);
+
+    #ifdef EXTRAPOLATE_LUT
+        ch = _mm256_min_epi32(_mm256_max_epi32(ch, _mm256_setzero_si256()), _mm256_set1_epi32(255));
+    #endif
+
+        return _mm256_or_si256(result, _mm256_slli_epi32(ch, 8 * j));
+    }
+
+    // Returns a * fOne + s * (b - a), i.e., (fOne - s) * a + s * b
+    CB_TARGET_AVX2 inline __m256i LerpAVX2(const cLUTGrid& g, __m256i a, __m256i b, __m256i s)
+    {
+        return _mm256_add_epi32(_mm256_slli_epi32(a, g.fShift), _mm256_mullo_epi32(s, _mm256_sub_epi32(b, a)));
+    }
+
+    // Finds the enclosing tetrahedron, as for LUTTetrahedron. Returns in d the offsets of cA, cB, and c111 from c000,
+    // and in w the weights of c000, cA, cB, and c111.
+    CB_TARGET_AVX2 inline void LUTTetrahedronAVX2(int size, const __m256i i0[3], const __m256i i1[3], const __m256i s[3], __m256i fOne, __m256i d[3], __m256i w[4])
+    {
+        __m256i dx = LUTStepAVX2(i0[0], i1[0], 1);
+        __m256i dy = LUTStepAVX2(i0[1], i1[1], size);
+        __m256i dz = LUTStepAVX2(i0[2], i1[2], size * size);
+        __m256i dxyz = _mm256_add_epi32(_mm256_add_epi32(dx, dy), dz);
+
+        // Sort the fractions: cA is one step along the axis of the largest,
+        // cB is c111 minus one step along the axis of the smallest. Ties
+        // are broken consistently so the two axes always differ.
+        __m256i xGEy = _mm256_or_si256(_mm256_cmpgt_epi32(s[0], s[1]), _mm256_cmpeq_epi32(s[0], s[1]));
+        __m256i xGEz = _mm256_or_si256(_mm256_cmpgt_epi32(s[0], s[2]), _mm256_cmpeq_epi32(s[0], s[2]));
+        __m256i yGEz = _mm256_or_si256(_mm256_cmpgt_epi32(s[1], s[2]), _mm256_cmpeq_epi32(s[1], s[2]));
+
+        __m256i xMax = _mm256_and_si256(xGEy, xGEz);
+        __m256i yMax = _mm256_andnot_si256(xMax, yGEz);
+        __m256i zMin = _mm256_and_si256(xGEz, yGEz);
+        __m256i yMin = _mm256_andnot_si256(zMin, xGEy);
+
+        d[0] = _mm256_blendv_epi8(_mm256_blendv_epi8(dz, dy, yMax), dx, xMax);
+        d[1] = _mm256_sub_epi32(dxyz, _mm256_blendv_epi8(_mm256_blendv_epi8(dx, dy, yMin), dz, zMin));
+        d[2] = dxyz;
+
+        __m256i sMax = _mm256_max_epi32(_mm256_max_epi32(s[0], s[1]), s[2]);
+        __m256i sMin = _mm256_min_epi32(_mm256_min_epi32(s[0], s[1]), s[2]);
+        __m256i sMid = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(s[0], s[1]), s[2]), _mm256_add_epi32(sMax, sMin));
+
+        w[0] = _mm256_sub_epi32(fOne, sMax);
+        w[1] = _mm256_sub_epi32(sMax, sMid);
+        w[2] = _mm256_sub_epi32(sMid, sMin);
+        w[3] = sMin;
+    }
+
+    template<int kBits, int kNodal> CB_TARGET_AVX2 void ApplyLUTDiagonalAVX2(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const cLUTGrid g = LUTGrid<kBits, kNodal>(lut);
+        const int* lutI = (const int*) lut.data;
+        const __m256i alpha = _mm256_set1_epi32(int(0xFF000000));
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i i0[3], i1[3], s[3];
+            LUTCoordsAVX2(g, _mm256_loadu_si256((const __m256i*) (dataIn + i)), i0, i1, s);
+
+            __m256i lutC0 = _mm256_i32gather_epi32(lutI, LUTIndexAVX2(g, i0), 4);
+            __m256i lutC1 = _mm256_i32gather_epi32(lutI, LUTIndexAVX2(g, i1), 4);
+            __m256i result = alpha;
+
+            for (int j = 0; j < 3; j++)
+            {
+                __m256i ch = LerpAVX2(g, LUTChannelAVX2(lutC0, j), LUTChannelAVX2(lutC1, j), s[j]);
+                result = LUTResultAVX2(result, ch, g.fShift, j);
+            }
+
+            _mm256_storeu_si256((__m256i*) (dataOut + i), result);
+        }
+
+        ApplyLUTDiagonal<kBits, kNodal>(lut, n - i, dataIn + i, dataOut + i);
+    }
+
+    template<int kBits, int kNodal> CB_TARGET_AVX2 void ApplyLUTTetrahedralAVX2(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const cLUTGrid g = LUTGrid<kBits, kNodal>(lut);
+        const int* lutI = (const int*) lut.data;
+        const __m256i alpha = _mm256_set1_epi32(int(0xFF000000));
+        const __m256i fOne  = _mm256_set1_epi32(g.fOne);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i i0[3], i1[3], s[3];
+            LUTCoordsAVX2(g, _mm256_loadu_si256((const __m256i*) (dataIn + i)), i0, i1, s);
+
+            __m256i d[3], w[4];
+            LUTTetrahedronAVX2(g.size, i0, i1, s, fOne, d, w);
+
+            __m256i base = LUTIndexAVX2(g, i0);
+
+            __m256i lutC0 = _mm256_i32gather_epi32(lutI, base, 4);
+            __m256i lutCA = _mm256_i32gather_epi32(lutI, _mm256_add_epi32(base, d[0]), 4);
+            __m256i lutCB = _mm256_i32gather_epi32(lutI, _mm256_add_epi32(base, d[1]), 4);
+            __m256i lutC1 = _mm256_i32gather_epi32(lutI, _mm256_add_epi32(base, d[2]), 4);
+
+            __m256i result = alpha;
+
+            for (int j = 0; j < 3; j++)
+            {
+                __m256i ch = _mm256_mullo_epi32(w[0], LUTChannelAVX2(lutC0, j));
+                ch = _mm256_add_epi32(ch, _mm256_mullo_epi32(w[1], LUTChannelAVX2(lutCA, j)));
+                ch = _mm256_add_epi32(ch, _mm256_mullo_epi32(w[2], LUTChannelAVX2(lutCB, j)));
+                ch = _mm256_add_epi32(ch, _mm256_mullo_epi32(w[3], LUTChannelAVX2(lutC1, j)));
+
+                result = LUTResultAVX2(result, ch, g.fShift, j);
+            }
+
+            _mm256_storeu_si256((__m256i*) (dataOut + i), result);
+        }
+
+        ApplyLUTTetrahedral<kBits, kNodal>(lut, n - i, dataIn + i, dataOut + i);
+    }
+
+    template<int kBits, int kNodal> CB_TARGET_AVX2 void ApplyLUTTrilinearAVX2(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const cLUTGrid g = LUTGrid<kBits, kNodal>(lut);
+        const int* lutI = (const int*) lut.data;
+        const __m256i alpha = _mm256_set1_epi32(int(0xFF000000));
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i i0[3], i1[3], s[3];
+            LUTCoordsAVX2(g, _mm256_loadu_si256((const __m256i*) (dataIn + i)), i0, i1, s);
+
+            __m256i dx = LUTStepAVX2(i0[0], i1[0], 1);
+            __m256i dy = LUTStepAVX2(i0[1], i1[1], g.size);
+            __m256i dz = LUTStepAVX2(i0[2], i1[2], g.size * g.size);
+
+            __m256i base = LUTIndexAVX2(g, i0);
+            __m256i lutC[8];
+
+            for (int k = 0; k < 8; k++)
+            {
+                __m256i index = base;
+
+                if (k & 1)
+                    index = _mm256_add_epi32(index, dx);
+                if (k & 2)
+                    index = _mm256_add_epi32(index, dy);
+                if (k & 4)
+                    index = _mm256_add_epi32(index, dz);
+
+                lutC[k] = _mm256_i32gather_epi32(lutI, index, 4);
+            }
+
+            __m256i result = alpha;
+
+            for (int j = 0; j < 3; j++)
+            {
+                __m256i cx[4], cy[2];
+
+                for (int k = 0; k < 4; k++)
+                    cx[k] = LerpAVX2(g, LUTChannelAVX2(lutC[2 * k], j), LUTChannelAVX2(lutC[2 * k + 1], j), s[0]);
+                for (int k = 0; k < 2; k++)
+                    cy[k] = LerpAVX2(g, cx[2 * k], cx[2 * k + 1], s[1]);
+
+                __m256i cz = LerpAVX2(g, cy[0], cy[1], s[2]);
+
+                result = LUTResultAVX2(result, cz, 3 * g.fShift, j);
+            }
+
+            _mm256_storeu_si256((__m256i*) (dataOut + i), result);
+        }
+
+        ApplyLUTTrilinear<kBits, kNodal>(lut, n - i, dataIn + i, dataOut + i);
+    }
+#endif
+
+    // Kernel selection. The common LUT sizes get kernels specialised at
+    // compile time, everything else goes through the <0, 0> versions, which
+    // read the geometry from the LUT.
+    enum tLUTKernel
+    {
+        kKernelDiagonal    = kInterpDiagonal,
+        kKernelTetrahedral = kInterpTetrahedral,
+        kKernelTrilinear   = kInterpTrilinear,
+        kKernelNearest,
+    };
+
+    typedef void tApplyLUTFunc(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[]);
+
+    template<int kBits, int kNodal> tApplyLUTFunc* LUTKernel(tLUTKernel kernel)
+    {
+    #ifdef CB_X86
+        if (SIMDLevel() >= kSIMDAVX2)
+        {
+            switch (kernel)
+            {
+            case kKernelDiagonal:
+                return ApplyLUTDiagonalAVX2   <kBits, kNodal>;
+            case kKernelTetrahedral:
+                return ApplyLUTTetrahedralAVX2<kBits, kNodal>;
+            case kKernelTrilinear:
+                return ApplyLUTTrilinearAVX2  <kBits, kNodal>;
+            default:
+                break;
+            }
+        }
+    #endif
+
+        switch (kernel)
+        {
+        case kKernelDiagonal:
+            return ApplyLUTDiagonal   <kBits, kNodal>;
+        case kKernelTetrahedral:
+            return ApplyLUTTetrahedral<kBits, kNodal>;
+        case kKernelTrilinear:
+            return ApplyLUTTrilinear  <kBits, kNodal>;
+        default:
+            return ApplyLUTNearest    <kBits, kNodal>;
+        }
+    }
+
+    tApplyLUTFunc* LUTKernel(const RGBLUT& lut, tLUTKernel kernel)
+    {
+        if (lut.shaper)
+            return LUTKernel<0, 0>(kernel);
+
+        assert(IsValidLUTSize(lut.size) && lut.size >> lut.bits == 1);
+
+        switch (lut.size)
+        {
+        case 16:
+            return LUTKernel<4, 0>(kernel);
+        case 17:
+            return LUTKernel<4, 1>(kernel);
+        case 32:
+            return LUTKernel<5, 0>(kernel);
+        case 33:
+            return LUTKernel<5, 1>(kernel);
+        case 64:
+            return LUTKernel<6, 0>(kernel);
+        case 65:
+            return LUTKernel<6, 1>(kernel);
+        }
+
+        return LUTKernel<0, 0>(kernel);
+    }
+}
+
+void CBLut::ApplyLUT(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp)
+{
+    LUTKernel(lut, tLUTKernel(interp))(lut, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyLUTNoLerp(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    LUTKernel(lut, kKernelNearest)(lut, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyLUTParallel(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp, int numThreads)
+{
+    tApplyLUTFunc* kernel = LUTKernel(lut, tLUTKernel(interp));
+
+    ParallelFor(n, kParallelChunkSize, numThreads,
+        [kernel, &lut, dataIn, dataOut](int begin, int end)
+        {
+            kernel(lut, end - begin, dataIn + begin, dataOut + begin);
+        }
+    );
+}
+
+void CBLut::ApplyLUTNoLerpParallel(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[], int numThreads)
+{
+    tApplyLUTFunc* kernel = LUTKernel(lut, kKernelNearest);
+
+    ParallelFor(n, kParallelChunkSize, numThreads,
+        [kernel, &lut, dataIn, dataOut](int begin, int end)
+        {
+            kernel(lut, end - begin, dataIn + begin, dataOut + begin);
+        }
+    );
+}
+
+void CBLut::ApplyLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp)
+{
+    ApplyLUT(LUTView(rgbLUT), n, dataIn, dataOut, interp);
+}
+
+void CBLut::ApplyLUTNoLerp(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    ApplyLUTNoLerp(LUTView(rgbLUT), n, dataIn, dataOut);
+}
+
+// --- LUT stack support -------------------------------------------------------
+
+RGBLUTStack CBLut::AllocLUTStack(int size, int numSlices)
+{
+    assert(IsValidLUTSize(size) && numSlices >= 2);
+
+    RGBLUTStack stack;
+    stack.lut       = LUTView(size, new RGBA32[numSlices * size * size * size]);
+    stack.numSlices = numSlices;
+
+    return stack;
+}
+
+void CBLut::FreeLUTStack(RGBLUTStack* stack)
+{
+    FreeLUT(&stack->lut);
+}
+
+namespace
+{
+    constexpr int kStackBlockSize = 1024;   // pixels per block: both slices' results fit comfortably in L1
+
+#ifdef CB_X86
+    CB_TARGET_SSE2 int BlendRGBA32SSE2(int n, RGBA32 a[], const RGBA32 b[], int w)
+    {
+        const __m128i zero  = _mm_setzero_si128();
+        const __m128i wa    = _mm_set1_epi16(short(256 - w));
+        const __m128i wb    = _mm_set1_epi16(short(w));
+        const __m128i round = _mm_set1_epi16(128);
+
+        int i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i ca = _mm_loadu_si128((const __m128i*) (a + i));
+            __m128i cb = _mm_loadu_si128((const __m128i*) (b + i));
+
+            // At most 255 * 256 + 128, so this fits in unsigned 16 bits
+            __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(ca, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(cb, zero), wb)), round);
+            __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(ca, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(cb, zero), wb)), round);
+
+            _mm_storeu_si128((__m128i*) (a + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+        }
+
+        return i;
+    }
+#endif
+
+    // Blend 'b' into 'a' with weight w/256
+    void BlendRGBA32(int n, RGBA32 a[], const RGBA32 b[], int w)
+    {
+        int i = 0;
+
+    #ifdef CB_X86
+        if (SIMDLevel() >= kSIMDSSE2)
+            i = BlendRGBA32SSE2(n, a, b, w);
+    #endif
+
+        for (; i < n; i++)
+        for (int j = 0; j < 4; j++)
+            a[i].c[j] = uint8_t((a[i].c[j] * (256 - w) + b[i].c[j] * w + 128) >> 8);
+    }
+
+    void ApplyLUTStackKernel(tApplyLUTFunc* kernel, const RGBLUT& slice0, const RGBLUT& slice1, int w, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        if (w == 0)
+            return kernel(slice0, n, dataIn, dataOut);
+        if (w == 256)
+            return kernel(slice1, n, dataIn, dataOut);
+
+        RGBA32 data1[kStackBlockSize];
+
+        for (int begin = 0; begin < n; begin += kStackBlockSize)
+        {
+            int count = n - begin < kStackBlockSize ? n - begin : kStackBlockSize;
+
+            kernel(slice0, count, dataIn + begin, dataOut + begin);
+            kernel(slice1, count, dataIn + begin, data1);
+
+            BlendRGBA32(count, dataOut + begin, data1, w);
+        }
+    }
+
+    // Find the slices bracketing 'strength', and the weight of the upper one, in 0..256
+    void LUTStackCoords(const RGBLUTStack& stack, float strength, RGBLUT* slice0, RGBLUT* slice1, int* w)
+    {
+        float s  = strength > 0.0f ? (strength < 1.0f ? strength : 1.0f) : 0.0f;  // NaNs go to 0 too
+        int   i  = int(s * (stack.numSlices - 1) * 256.0f + 0.5f);
+        int   i0 = (i >> 8) < stack.numSlices - 1 ? (i >> 8) : stack.numSlices - 2;
+
+        *slice0 = LUTStackSlice(stack, i0);
+        *slice1 = LUTStackSlice(stack, i0 + 1);
+        *w      = i - (i0 << 8);
+    }
+}
+
+RGBLUT CBLut::LUTStackSlice(const RGBLUTStack& stack, int i)
+{
+    assert(0 <= i && i < stack.numSlices);
+
+    RGBLUT slice = stack.lut;
+    slice.data += i * stack.lut.size * stack.lut.size * stack.lut.size;
+
+    return slice;
+}
+
+void CBLut::ApplyLUTStack(const RGBLUTStack& stack, float strength, int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp)
+{
+    RGBLUT slice0, slice1;
+    int w;
+    LUTStackCoords(stack, strength, &slice0, &slice1, &w);
+
+    ApplyLUTStackKernel(LUTKernel(stack.lut, tLUTKernel(interp)), slice0, slice1, w, n, dataIn, dataOut);
+}
+
+void CBLut::BlendLUTStack(const RGBLUTStack& stack, float strength, const RGBLUT& lut)
+{
+    assert(lut.size == stack.lut.size);
+
+    RGBLUT slice0, slice1;
+    int w;
+    LUTStackCoords(stack, strength, &slice0, &slice1, &w);
+
+    int n = lut.size * lut.size * lut.size;
+    memcpy(lut.data, slice0.data, n * sizeof(RGBA32));
+
+    if (w > 0)
+        BlendRGBA32(n, lut.data, slice1.data, w);
+}
+
+void CBLut::ApplyLUTStackParallel(const RGBLUTStack& stack, float strength, int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp, int numThreads)
+{
+    RGBLUT slice0, slice1;
+    int w;
+    LUTStackCoords(stack, strength, &slice0, &slice1, &w);
+
+    tApplyLUTFunc* kernel = LUTKernel(stack.lut, tLUTKernel(interp));
+
+    ParallelFor(n, kParallelChunkSize, numThreads,
+        [kernel, &slice0, &slice1, w, dataIn, dataOut](int begin, int end)
+        {
+            ApplyLUTStackKernel(kernel, slice0, slice1, w, end - begin, dataIn + begin, dataOut + begin);
+        }
+    );
+}
+
+// --- Affine LUT support ------------------------------------------------------
+
+RGBLUTAffine CBLut::AllocLUTAffine(int size)
+{
+    assert(IsValidLUTSize(size));
+
+    int n = size * size * size * 3;
+
+    RGBLUTAffine alut;
+    alut.size  = size;
+    alut.base  = new float[2 * n];
+    alut.delta = alut.base + n;
+
+    return alut;
+}
+
+void CBLut::FreeLUTAffine(RGBLUTAffine* alut)
+{
+    delete[] alut->base;
+    alut->base  = 0;
+    alut->delta = 0;
+}
+
+void CBLut::UpdateLUTAffine(const RGBLUTAffine& alut, float strength, const RGBLUT& lut, int numThreads)
+{
+    assert(lut.size == alut.size);
+
+    const cGammaEncoder& encode = GammaTables().encodeU;
+    const int size = alut.size;
+
+    ParallelFor(size, 1, numThreads,
+        [&alut, &lut, &encode, strength, size](int begin, int end)
+        {
+            for (int row = begin * size; row < end * size; row++)
+            {
+                const float* base  = alut.base  + row * size * 3;
+                const float* delta = alut.delta + row * size * 3;
+                RGBA32*      p     = lut.data   + row * size;
+
+                int k = 0;
+
+            #ifdef CB_X86
+                if (SIMDLevel() >= kSIMDAVX2)
+                    k = EncodeAffineAVX2(encode, size, base, delta, strength, p);
+            #endif
+
+                for (; k < size; k++)
+                {
+                    p[k].c[0] = encode.Encode(base[k           ] + strength * delta[k           ]);
+                    p[k].c[1] = encode.Encode(base[k + size    ] + strength * delta[k + size    ]);
+                    p[k].c[2] = encode.Encode(base[k + size * 2] + strength * delta[k + size * 2]);
+                    p[k].c[3] = 255;
+                }
+            }
+        }
+    );
+}
+
+// --- YCbCr LUT support -------------------------------------------------------
+
+namespace
+{
+    // Conversion between gamma-space RGB and YCbCr, with both in 0-255 units
+    struct cYUVSpace
+    {
+        float kr;       // luma weights
+        float kg;
+        float kb;
+        float yOffset;
+        float yScale;   // Y units per RGB unit
+        float cScale;   // Cb/Cr units per RGB unit
+    };
+
+    cYUVSpace YUVSpace(tYUVSpace space)
+    {
+        bool hd   = space == kYUV709 || space == kYUV709Full;
+        bool full = space == kYUV601Full || space == kYUV709Full;
+
+        cYUVSpace ys;
+
+        ys.kr = hd ? 0.2126f : 0.299f;
+        ys.kb = hd ? 0.0722f : 0.114f;
+        ys.kg = 1.0f - ys.kr - ys.kb;
+
+        ys.yOffset = full ? 0.0f : 16.0f;
+        ys.yScale  = full ? 1.0f : 219.0f / 255.0f;
+        ys.cScale  = full ? 1.0f : 224.0f / 255.0f;
+
+        return ys;
+    }
+
+    inline float ClampU8f(float f)
+    {
+        return f < 0.0f ? 0.0f : f > 255.0f ? 255.0f : f;
+    }
+}
+
+YUVPlanes CBLut::I420Planes(int w, int h, uint8_t* data)
+{
+    int cw = (w + 1) >> 1;
+    int ch = (h + 1) >> 1;
+
+    YUVPlanes planes;
+    planes.w            = w;
+    planes.h            = h;
+    planes.chromaShiftX = 1;
+    planes.chromaShiftY = 1;
+    planes.y            = data;
+    planes.cb           = data + w * h;
+    planes.cr           = planes.cb + cw * ch;
+    planes.yStride      = w;
+    planes.cStride      = cw;
+    planes.cStep        = 1;
+
+    return planes;
+}
+
+YUVPlanes CBLut::NV12Planes(int w, int h, uint8_t* data)
+{
+    int cw = (w + 1) >> 1;
+
+    YUVPlanes planes;
+    planes.w            = w;
+    planes.h            = h;
+    planes.chromaShiftX = 1;
+    planes.chromaShiftY = 1;
+    planes.y            = data;
+    planes.cb           = data + w * h;
+    planes.cr           = planes.cb + 1;
+    planes.yStride      = w;
+    planes.cStride      = 2 * cw;
+    planes.cStep        = 2;
+
+    return planes;
+}
+
+void CBLut::YUVSampleColours(const RGBLUT& lut, int j, int i, tYUVSpace space, float r[], float g[], float b[])
+{
+    // As with RGB luts, sample coordinates are in the 0-256 space of FromRGBA32u, so the identity maps each code to itself
+    const cYUVSpace ys = YUVSpace(space);
+    const cLUTGrid  grid = LUTGrid<0, 0>(lut);
+
+    assert(!lut.shaper);    // YCbCr luts have no shaper
+
+    float cb = (LUTSampleU8(grid, j) - 128.0f) / ys.cScale;
+    float cr = (LUTSampleU8(grid, i) - 128.0f) / ys.cScale;
+
+    float rFromCr = 2.0f * (1.0f - ys.kr) * cr;
+    float gFromC  = -2.0f * (ys.kb * (1.0f - ys.kb) * cb + ys.kr * (1.0f - ys.kr) * cr) / ys.kg;
+    float bFromCb = 2.0f * (1.0f - ys.kb) * cb;
+
+    for (int k = 0; k < lut.size; k++)
+    {
+        float y = (LUTSampleU8(grid, k) - ys.yOffset) / ys.yScale;
+
+        r[k] = powf(ClampU8f(y + rFromCr) / 256.0f, kGamma);
+        g[k] = powf(ClampU8f(y + gFromC ) / 256.0f, kGamma);
+        b[k] = powf(ClampU8f(y + bFromCb) / 256.0f, kGamma);
+    }
+}
+
+void CBLut::ToYUV(int n, const float r[], const float g[], const float b[], tYUVSpace space, RGBA32 dataOut[])
+{
+    const cYUVSpace ys = YUVSpace(space);
+
+    const float cbScale = ys.cScale / (2.0f * (1.0f - ys.kb));
+    const float crScale = ys.cScale / (2.0f * (1.0f - ys.kr));
+
+    for (int k = 0; k < n; k++)
+    {
+        // Encode as ToRGBA32u does, but without rounding to 8 bits before the conversion
+        float re = ClampU8f(256.0f * powf(r[k] > 0.0f ? r[k] : 0.0f, 1.0f / kGamma));
+        float ge = ClampU8f(256.0f * powf(g[k] > 0.0f ? g[k] : 0.0f, 1.0f / kGamma));
+        float be = ClampU8f(256.0f * powf(b[k] > 0.0f ? b[k] : 0.0f, 1.0f / kGamma));
+
+        float y = ys.kr * re + ys.kg * ge + ys.kb * be;
+
+        dataOut[k].c[0] = uint8_t(ClampU8f(ys.yOffset + ys.yScale * y + 0.5f));
+        dataOut[k].c[1] = uint8_t(ClampU8f(128.0f + cbScale * (be - y) + 0.5f));
+        dataOut[k].c[2] = uint8_t(ClampU8f(128.0f + crScale * (re - y) + 0.5f));
+        dataOut[k].c[3] = 255;
+    }
+}
+
+namespace
+{
+    constexpr int kYUVBlockSamples = 256;   // chroma samples per block of a chroma row
+
+#ifdef CB_X86
+    // SSE2 versions of the packing and unpacking below, for the common case of a
+    // pair of 4:2:0 rows. These return the number of chroma samples handled, a
+    // multiple of 8, leaving the remainder to the scalar code.
+    CB_TARGET_SSE2 int PackYUV420SSE2(int numSamples, const uint8_t* inY0, const uint8_t* inY1, const uint8_t* inCb, const uint8_t* inCr, int cStep, RGBA32 p0[], RGBA32 p1[])
+    {
+        const __m128i alpha  = _mm_set1_epi8(-1);
+        const __m128i lowU8s = _mm_set1_epi16(0xFF);
+
+        int i = 0;
+
+        for (; i + 8 <= numSamples; i += 8)
+        {
+            __m128i cb, cr;
+
+            if (cStep == 1)
+            {
+                cb = _mm_loadl_epi64((const __m128i*) (inCb + i));
+                cr = _mm_loadl_epi64((const __m128i*) (inCr + i));
+            }
+            else
+            {
+                __m128i cbcr = _mm_loadu_si128((const __m128i*) (inCb + 2 * i));
+
+                cb = _mm_packus_epi16(_mm_and_si128(cbcr, lowU8s), cbcr);
+                cr = _mm_packus_epi16(_mm_srli_epi16(cbcr, 8), cbcr);
+            }
+
+            // Each chroma sample covers two pixels per row, and pixels are (y, cb) | (cr, alpha) << 16
+            __m128i cbs    = _mm_unpacklo_epi8(cb, cb);
+            __m128i crs    = _mm_unpacklo_epi8(cr, cr);
+            __m128i crAlo  = _mm_unpacklo_epi8(crs, alpha);
+            __m128i crAhi  = _mm_unpackhi_epi8(crs, alpha);
+
+            const uint8_t* rowY[2] = { inY0 + 2 * i, inY1 + 2 * i };
+            RGBA32*        rowP[2] = { p0   + 2 * i, p1   + 2 * i };
+
+            for (int row = 0; row < 2; row++)
+            {
+                __m128i y    = _mm_loadu_si128((const __m128i*) rowY[row]);
+                __m128i ycLo = _mm_unpacklo_epi8(y, cbs);
+                __m128i ycHi = _mm_unpackhi_epi8(y, cbs);
+
+                _mm_storeu_si128((__m128i*) (rowP[row]     ), _mm_unpacklo_epi16(ycLo, crAlo));
+                _mm_storeu_si128((__m128i*) (rowP[row] +  4), _mm_unpackhi_epi16(ycLo, crAlo));
+                _mm_storeu_si128((__m128i*) (rowP[row] +  8), _mm_unpacklo_epi16(ycHi, crAhi));
+                _mm_storeu_si128((__m128i*) (rowP[row] + 12), _mm_unpackhi_epi16(ycHi, crAhi));
+            }
+        }
+
+        return i;
+    }
+
+    CB_TARGET_SSE2 inline __m128i ChannelSSE2(__m128i p, int j)
+    {
+        return _mm_and_si128(_mm_srli_epi32(p, 8 * j), _mm_set1_epi32(0xFF));
+    }
+
+    CB_TARGET_SSE2 int UnpackYUV420SSE2(int numSamples, const RGBA32 p0[], const RGBA32 p1[], uint8_t* outY0, uint8_t* outY1, uint8_t* outCb, uint8_t* outCr, int cStep)
+    {
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i two  = _mm_set1_epi32(2);
+
+        int i = 0;
+
+        for (; i + 8 <= numSamples; i += 8)
+        {
+            const RGBA32* rowP[2] = { p0    + 2 * i, p1    + 2 * i };
+            uint8_t*      rowY[2] = { outY0 + 2 * i, outY1 + 2 * i };
+            __m128i       p[2][4];
+
+            for (int row = 0; row < 2; row++)
+            {
+                for (int k = 0; k < 4; k++)
+                    p[row][k] = _mm_loadu_si128((const __m128i*) (rowP[row] + 4 * k));
+
+                __m128i y01 = _mm_packs_epi32(ChannelSSE2(p[row][0], 0), ChannelSSE2(p[row][1], 0));
+                __m128i y23 = _mm_packs_epi32(ChannelSSE2(p[row][2], 0), ChannelSSE2(p[row][3], 0));
+
+                _mm_storeu_si128((__m128i*) rowY[row], _mm_packus_epi16(y01, y23));
+            }
+
+            // Sum each 2x2 block: the two rows as 32-bit lanes, then horizontal pairs via madd
+            __m128i sums[2][2];
+
+            for (int j = 1; j <= 2; j++)
+                for (int h = 0; h < 2; h++)
+                {
+                    __m128i a = _mm_add_epi32(ChannelSSE2(p[0][2 * h    ], j), ChannelSSE2(p[1][2 * h    ], j));
+                    __m128i b = _mm_add_epi32(ChannelSSE2(p[0][2 * h + 1], j), ChannelSSE2(p[1][2 * h + 1], j));
+
+                    sums[j - 1][h] = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_packs_epi32(a, b), ones), two), 2);
+                }
+
+            __m128i cb = _mm_packus_epi16(_mm_packs_epi32(sums[0][0], sums[0][1]), _mm_setzero_si128());
+            __m128i cr = _mm_packus_epi16(_mm_packs_epi32(sums[1][0], sums[1][1]), _mm_setzero_si128());
+
+            if (cStep == 1)
+            {
+                _mm_storel_epi64((__m128i*) (outCb + i), cb);
+                _mm_storel_epi64((__m128i*) (outCr + i), cr);
+            }
+            else
+                _mm_storeu_si128((__m128i*) (outCb + 2 * i), _mm_unpacklo_epi8(cb, cr));
+        }
+
+        return i;
+    }
+#endif
+
+    // Apply lut to chroma rows [cy0, cy1) of 'in'. Each block of a chroma row's pixels is packed
+    // into YCbCr pixels, run through the usual RGBA32 kernel, and then unpacked into 'out'.
+    void ApplyYUVLUTRows(tApplyLUTFunc* kernel, const RGBLUT& lut, const YUVPlanes& in, const YUVPlanes& out, int cy0, int cy1)
+    {
+        const int sx = in.chromaShiftX;
+        const int sy = in.chromaShiftY;
+        const int cw = (in.w + (1 << sx) - 1) >> sx;
+
+        RGBA32 packed [kYUVBlockSamples * 4];
+        RGBA32 results[kYUVBlockSamples * 4];
+
+        for (int cy = cy0; cy < cy1; cy++)
+        {
+            int y0   = cy << sy;
+            int rows = in.h - y0 < (1 << sy) ? in.h - y0 : (1 << sy);
+
+            const uint8_t* inCb  = in.cb  + cy * in.cStride;
+            const uint8_t* inCr  = in.cr  + cy * in.cStride;
+            uint8_t*       outCb = out.cb + cy * out.cStride;
+            uint8_t*       outCr = out.cr + cy * out.cStride;
+
+            for (int cx0 = 0; cx0 < cw; cx0 += kYUVBlockSamples)
+            {
+                int cx1 = cw - cx0 > kYUVBlockSamples ? cx0 + kYUVBlockSamples : cw;
+                int x0  = cx0 << sx;
+                int x1  = in.w - (cx1 << sx) > 0 ? cx1 << sx : in.w;
+                int n   = x1 - x0;
+
+                int simdSamples = 0;   // leading chroma samples handled by the SIMD path
+                bool simd420 = false;
+
+            #ifdef CB_X86
+                simd420 = sx == 1 && sy == 1 && rows == 2 && SIMDLevel() >= kSIMDSSE2;
+
+                if (simd420)
+                    simdSamples = PackYUV420SSE2(n >> 1, in.y + y0 * in.yStride + x0, in.y + (y0 + 1) * in.yStride + x0,
+                        inCb + cx0 * in.cStep, inCr + cx0 * in.cStep, in.cStep, packed, packed + n);
+            #endif
+
+                for (int row = 0; row < rows; row++)
+                {
+                    const uint8_t* inY = in.y + (y0 + row) * in.yStride;
+                    RGBA32*        p   = packed + row * n - x0;
+
+                    for (int x = x0 + (simdSamples << sx); x < x1; x++)
+                    {
+                        int c = (x >> sx) * in.cStep;
+                        p[x].u32 = inY[x] | (inCb[c] << 8) | (inCr[c] << 16) | 0xFF000000;
+                    }
+                }
+
+                kernel(lut, rows * n, packed, results);
+
+                simdSamples = 0;
+
+            #ifdef CB_X86
+                if (simd420)
+                    simdSamples = UnpackYUV420SSE2(n >> 1, results, results + n, out.y + y0 * out.yStride + x0, out.y + (y0 + 1) * out.yStride + x0,
+                        outCb + cx0 * out.cStep, outCr + cx0 * out.cStep, out.cStep);
+            #endif
+
+                for (int row = 0; row < rows; row++)
+                {
+                    uint8_t*      outY = out.y + (y0 + row) * out.yStride;
+                    const RGBA32* p    = results + row * n - x0;
+
+                    for (int x = x0 + (simdSamples << sx); x < x1; x++)
+                        outY[x] = p[x].c[0];
+                }
+
+                // Each output chroma sample is the average of its pixels' results, of which there are 1, 2, or 4
+                for (int cx = cx0 + simdSamples; cx < cx1; cx++)
+                {
+                    int px0 = (cx << sx) - x0;
+                    int px1 = px0 + (1 << sx) < n ? px0 + (1 << sx) : n;
+                    int count = (px1 - px0) * rows;
+                    int shift = (count > 1) + (count > 2);
+                    int sumCb = 0;
+                    int sumCr = 0;
+
+                    for (int row = 0; row < rows; row++)
+                        for (int px = px0; px < px1; px++)
+                        {
+                            sumCb += results[row * n + px].c[1];
+                            sumCr += results[row * n + px].c[2];
+                        }
+
+                    outCb[cx * out.cStep] = uint8_t((sumCb + (count >> 1)) >> shift);
+                    outCr[cx * out.cStep] = uint8_t((sumCr + (count >> 1)) >> shift);
+                }
+            }
+        }
+    }
+}
+
+void CBLut::ApplyLUT(const RGBLUT& lut, const YUVPlanes& in, const YUVPlanes& out, tLUTInterp interp)
+{
+    assert(in.w == out.w && in.h == out.h && in.chromaShiftX == out.chromaShiftX && in.chromaShiftY == out.chromaShiftY);
+    assert(in.chromaShiftX <= 1 && in.chromaShiftY <= 1);
+
+    int ch = (in.h + (1 << in.chromaShiftY) - 1) >> in.chromaShiftY;
+
+    ApplyYUVLUTRows(LUTKernel(lut, tLUTKernel(interp)), lut, in, out, 0, ch);
+}
+
+void CBLut::ApplyLUTParallel(const RGBLUT& lut, const YUVPlanes& in, const YUVPlanes& out, tLUTInterp interp, int numThreads)
+{
+    assert(in.w == out.w && in.h == out.h && in.chromaShiftX == out.chromaShiftX && in.chromaShiftY == out.chromaShiftY);
+    assert(in.chromaShiftX <= 1 && in.chromaShiftY <= 1);
+
+    tApplyLUTFunc* kernel = LUTKernel(lut, tLUTKernel(interp));
+
+    int ch = (in.h + (1 << in.chromaShiftY) - 1) >> in.chromaShiftY;
+    int chunkRows = kParallelChunkSize / (in.w << in.chromaShiftY);
+
+    ParallelFor(ch, chunkRows > 0 ? chunkRows : 1, numThreads,
+        [kernel, &lut, &in, &out](int begin, int end)
+        {
+            ApplyYUVLUTRows(kernel, lut, in, out, begin, end);
+        }
+    );
+}
+
+// --- Deep colour support -----------------------------------------------------
+
+uint16_t CBLut::ToHalf(float f)
+{
+    // Round to nearest even, via the FPU for denormals, and a rounding bias otherwise
+    const uint32_t kHalfOverflow = uint32_t(127 + 16) << 23;        // 65536, the first float that can't be a finite half
+    const uint32_t kHalfNormal   = uint32_t(127 - 14) << 23;        // 2^-14, the smallest normal half
+    const uint32_t kDenormMagic  = uint32_t(127 - 15 + 23 - 10 + 1) << 23;
+
+    uint32_t u    = FloatBits(f);
+    uint32_t sign = (u >> 16) & 0x8000;
+    uint16_t h;
+
+    u &= 0x7FFFFFFF;
+
+    if (u >= kHalfOverflow)
+        h = u > 0x7F800000 ? 0x7E00 : 0x7C00;   // NaN or infinity
+    else if (u < kHalfNormal)
+        h = uint16_t(FloatBits(BitsFloat(u) + BitsFloat(kDenormMagic)) - kDenormMagic);
+    else
+        h = uint16_t((u + ((15u - 127u) << 23) + 0xFFF + ((u >> 13) & 1)) >> 13);
+
+    return uint16_t(h | sign);
+}
+
+float CBLut::FromHalf(uint16_t h)
+{
+    const uint32_t kShiftedExp = 0x7C00 << 13;
+
+    uint32_t u   = (h & 0x7FFF) << 13;
+    uint32_t exp = u & kShiftedExp;
+
+    u += (127 - 15) << 23;
+
+    if (exp == kShiftedExp)     // infinity or NaN
+        u += (128 - 16) << 23;
+    else if (exp == 0)          // zero or denormal
+        u = FloatBits(BitsFloat(u + (1 << 23)) - BitsFloat(113 << 23));
+
+    return BitsFloat(u | (uint32_t(h & 0x8000) << 16));
+}
+
+namespace
+{
+    inline uint16_t ToU16(float f)
+    {
+        if (!(f > 0.0f))
+            return 0;
+        if (f >= 1.0f)
+            return 65535;
+
+        return uint16_t(f * 65535.0f + 0.5f);
+    }
+
+    inline uint16_t ToU16u(float f)  // 0-65536 variant used for LUT construction
+    {
+        if (!(f > 0.0f))
+            return 0;
+        if (f >= 1.0f)
+            return 65535;
+
+        return uint16_t(f * 65536.0f);
+    }
+
+    inline RGBA64 MakeRGBA64(uint16_t r, uint16_t g, uint16_t b)
+    {
+        RGBA64 result;
+
+        result.c[0] = r;
+        result.c[1] = g;
+        result.c[2] = b;
+        result.c[3] = 65535;
+
+        return result;
+    }
+}
+
+RGBA64 CBLut::ToRGBA64(Vec3f c)
+{
+    c = pow(c, 1.0f / kGamma);
+    return MakeRGBA64(ToU16(c.x), ToU16(c.y), ToU16(c.z));
+}
+
+RGBA64 CBLut::ToRGBA64u(Vec3f c)
+{
+    c = pow(c, 1.0f / kGamma);
+    return MakeRGBA64(ToU16u(c.x), ToU16u(c.y), ToU16u(c.z));
+}
+
+Vec3f CBLut::FromRGBA64(RGBA64 rgb)
+{
+    Vec3f c = { rgb.c[0] / 65535.0f, rgb.c[1] / 65535.0f, rgb.c[2] / 65535.0f };
+    return pow(c, kGamma);
+}
+
+Vec3f CBLut::FromRGBA64u(RGBA64 rgb)
+{
+    Vec3f c = { rgb.c[0] / 65536.0f, rgb.c[1] / 65536.0f, rgb.c[2] / 65536.0f };
+    return pow(c, kGamma);
+}
+
+void CBLut::ToRGBA64u(int n, const float r[], const float g[], const float b[], RGBA64 dataOut[])
+{
+    for (int i = 0; i < n; i++)
+        dataOut[i] = MakeRGBA64(ToU16u(powf(r[i], 1.0f / kGamma)), ToU16u(powf(g[i], 1.0f / kGamma)), ToU16u(powf(b[i], 1.0f / kGamma)));
+}
+
+RGBLUT64 CBLut::AllocLUT64(int size)
+{
+    RGBLUT view = LUTView(size, 0);
+
+    return RGBLUT64 { view.size, view.bits, new RGBA64[size * size * size] };
+}
+
+void CBLut::FreeLUT(RGBLUT64* lut)
+{
+    delete[] lut->data;
+    lut->data = 0;
+}
+
+void CBLut::WidenLUT(const RGBLUT& lut, const RGBLUT64& lut64)
+{
+    assert(lut.size == lut64.size && !lut.shaper);
+
+    // Each 8-bit sample u maps to 256 u, which keeps the identity exact
+    const int n = lut.size * lut.size * lut.size;
+
+    for (int i = 0; i < n; i++)
+        lut64.data[i] = MakeRGBA64(lut.data[i].c[0] << 8, lut.data[i].c[1] << 8, lut.data[i].c[2] << 8);
+}
+
+void CBLut::CreateIdentityLUT(const RGBLUT64& lut)
+{
+    cLUTGrid g = LUTGrid<0, 0>(RGBLUT { lut.size, lut.bits, 0, 0 });
+    RGBA64* p = lut.data;
+
+    for (int i = 0; i < lut.size; i++)
+    for (int j = 0; j < lut.size; j++)
+    for (int k = 0; k < lut.size; k++)
+    {
+        int ci[3] = { LUTSampleU8(g, k) << 8, LUTSampleU8(g, j) << 8, LUTSampleU8(g, i) << 8 };
+
+        *p++ = MakeRGBA64(ci[0] < 65535 ? ci[0] : 65535, ci[1] < 65535 ? ci[1] : 65535, ci[2] < 65535 ? ci[2] : 65535);
+    }
+}
+
+namespace
+{
+    // 16-bit LUT geometry. Samples are where they are for 8-bit channels, and
+    // coordinates gain 8 more fractional bits, but weights are limited to
+    // kLUT64WeightBits, so that weighted sums of 16-bit samples fit in 32 bits
+    // even when extrapolating.
+    constexpr int kLUT64WeightBits = 12;
+
+    struct cLUTGrid64
+    {
+        int size;       // samples per axis
+        int fShift;     // fractional bits of LUT coordinates
+        int fHalf;      // offset of cell-centred samples
+        int bias;       // as for cLUTGrid
+        int wShift;     // fractional bits dropped to give the weights
+        int wBits;      // fractional bits of the weights
+        int wOne;       // 1 << wBits
+    };
+
+    inline cLUTGrid64 LUTGrid64(const RGBLUT64& lut)
+    {
+        cLUTGrid g8 = LUTGrid<0, 0>(RGBLUT { lut.size, lut.bits, 0, 0 });
+        cLUTGrid64 g;
+
+        g.size   = g8.size;
+        g.fShift = g8.fShift + 8;
+        g.fHalf  = g8.fHalf << 8;
+        g.bias   = g8.bias;
+        g.wShift = g.fShift > kLUT64WeightBits ? g.fShift - kLUT64WeightBits : 0;
+        g.wBits  = g.fShift - g.wShift;
+        g.wOne   = 1 << g.wBits;
+
+        return g;
+    }
+
+    // As LUTCoords, but with weights in 0..g.wOne
+    inline void LUTCoords64(const cLUTGrid64& g, const uint16_t ci[], int i0[3], int i1[3], int s[3])
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            int co = ci[j] + g.fHalf;
+
+            i0[j] = (co >> g.fShift) - g.bias;
+            s [j] = (co & ((1 << g.fShift) - 1)) >> g.wShift;
+
+        #ifdef EXTRAPOLATE_LUT
+            int i0c = i0[j] < 0 ? 0 : i0[j] > g.size - 2 ? g.size - 2 : i0[j];
+
+            s [j] += (i0[j] - i0c) * g.wOne;
+            i0[j]  = i0c;
+            i1[j]  = i0c + 1;
+        #else
+            i1[j] = i0[j] + 1 < g.size - 1 ? i0[j] + 1 : g.size - 1;
+            i0[j] = i0[j] > 0 ? i0[j] : 0;
+        #endif
+        }
+    }
+
+    inline int LUTIndex64(const cLUTGrid64& g, int x, int y, int z)
+    {
+        return (z * g.size + y) * g.size + x;
+    }
+
+    inline uint16_t LUTChannel64(int ch)
+    {
+    #ifdef EXTRAPOLATE_LUT
+        ch = ch < 0 ? 0 : ch > 65535 ? 65535 : ch;
+    #endif
+
+        assert(0 <= ch && ch <= 65535);
+        return uint16_t(ch);
+    }
+
+    // Returns a + s * (b - a), with s in 0..g.wOne. Unlike the 8-bit kernels,
+    // each lerp is renormalised, so trilinear sums stay within 32 bits.
+    inline int Lerp64(const cLUTGrid64& g, int a, int b, int s)
+    {
+        return a + ((s * (b - a)) >> g.wBits);
+    }
+
+    void ApplyLUT64Diagonal(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[])
+    {
+        const cLUTGrid64 g = LUTGrid64(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            int i0[3], i1[3], s[3];
+            LUTCoords64(g, dataIn[i].c, i0, i1, s);
+
+            RGBA64 lutC0 = lut.data[LUTIndex64(g, i0[0], i0[1], i0[2])];
+            RGBA64 lutC1 = lut.data[LUTIndex64(g, i1[0], i1[1], i1[2])];
+
+            for (int j = 0; j < 3; j++)
+                dataOut[i].c[j] = LUTChannel64(Lerp64(g, lutC0.c[j], lutC1.c[j], s[j]));
+
+            dataOut[i].c[3] = 65535;
+        }
+    }
+
+    void ApplyLUT64Tetrahedral(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[])
+    {
+        const cLUTGrid64 g = LUTGrid64(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            int i0[3], i1[3], s[3];
+            LUTCoords64(g, dataIn[i].c, i0, i1, s);
+
+            int dx = i1[0] - i0[0];
+            int dy = (i1[1] - i0[1]) * g.size;
+            int dz = (i1[2] - i0[2]) * g.size * g.size;
+
+            int dA, dB, w[4];
+            LUTTetrahedron(s, g.wOne, dx, dy, dz, &dA, &dB, w);
+
+            const RGBA64* c000 = lut.data + LUTIndex64(g, i0[0], i0[1], i0[2]);
+
+            RGBA64 lutC[4] = { c000[0], c000[dA], c000[dB], c000[dx + dy + dz] };
+
+            for (int j = 0; j < 3; j++)
+                dataOut[i].c[j] = LUTChannel64((w[0] * lutC[0].c[j] + w[1] * lutC[1].c[j] + w[2] * lutC[2].c[j] + w[3] * lutC[3].c[j]) >> g.wBits);
+
+            dataOut[i].c[3] = 65535;
+        }
+    }
+
+    void ApplyLUT64Trilinear(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[])
+    {
+        const cLUTGrid64 g = LUTGrid64(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            int i0[3], i1[3], s[3];
+            LUTCoords64(g, dataIn[i].c, i0, i1, s);
+
+            RGBA64 lutC[8];
+
+            for (int k = 0; k < 8; k++)
+                lutC[k] = lut.data[LUTIndex64(g, (k & 1 ? i1 : i0)[0], (k & 2 ? i1 : i0)[1], (k & 4 ? i1 : i0)[2])];
+
+            for (int j = 0; j < 3; j++)
+            {
+                int cx[4], cy[2];
+
+                for (int k = 0; k < 4; k++)
+                    cx[k] = Lerp64(g, lutC[2 * k].c[j], lutC[2 * k + 1].c[j], s[0]);
+                for (int k = 0; k < 2; k++)
+                    cy[k] = Lerp64(g, cx[2 * k], cx[2 * k + 1], s[1]);
+
+                dataOut[i].c[j] = LUTChannel64(Lerp64(g, cy[0], cy[1], s[2]));
+            }
+
+            dataOut[i].c[3] = 65535;
+        }
+    }
+
+#ifdef CB_X86
+    // AVX2 versions of the above, again bit-identical. Eight 64-bit pixels are
+    // split into 32-bit lanes of red/green and blue/alpha, so the coordinate
+    // and blending code works on 16-bit channels in 32-bit lanes much as the
+    // 8-bit kernels do, and samples are fetched four at a time via 64-bit gathers.
+
+    // Splits the pixels in a (0-3) and b (4-7) into their rg and ba halves, in pixel order
+    CB_TARGET_AVX2 inline void SplitRGBA64AVX2(__m256i a, __m256i b, __m256i* rg, __m256i* ba)
+    {
+        __m256 fa = _mm256_castsi256_ps(a);
+        __m256 fb = _mm256_castsi256_ps(b);
+
+        *rg = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0));
+        *ba = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0));
+    }
+
+    CB_TARGET_AVX2 inline void StoreRGBA64AVX2(RGBA64* p, __m256i rg, __m256i ba)
+    {
+        rg = _mm256_permute4x64_epi64(rg, _MM_SHUFFLE(3, 1, 2, 0));
+        ba = _mm256_permute4x64_epi64(ba, _MM_SHUFFLE(3, 1, 2, 0));
+
+        _mm256_storeu_si256((__m256i*) p,       _mm256_unpacklo_epi32(rg, ba));
+        _mm256_storeu_si256((__m256i*) (p + 4), _mm256_unpackhi_epi32(rg, ba));
+    }
+
+    CB_TARGET_AVX2 inline void GatherRGBA64AVX2(const RGBA64* lut, __m256i index, __m256i* rg, __m256i* ba)
+    {
+        const long long* lutL = (const long long*) lut;
+
+        __m256i a = _mm256_i32gather_epi64(lutL, _mm256_castsi256_si128(index), 8);
+        __m256i b = _mm256_i32gather_epi64(lutL, _mm256_extracti128_si256(index, 1), 8);
+
+        SplitRGBA64AVX2(a, b, rg, ba);
+    }
+
+    CB_TARGET_AVX2 inline __m256i Channel64AVX2(__m256i rg, __m256i ba, int j)
+    {
+        const __m256i mask = _mm256_set1_epi32(0xFFFF);
+
+        return j == 0 ? _mm256_and_si256(rg, mask) : j == 1 ? _mm256_srli_epi32(rg, 16) : _mm256_and_si256(ba, mask);
+    }
+
+    CB_TARGET_AVX2 inline __m256i ClampChannel64AVX2(__m256i ch)
+    {
+    #ifdef EXTRAPOLATE_LUT
+        ch = _mm256_min_epi32(_mm256_max_epi32(ch, _mm256_setzero_si256()), _mm256_set1_epi32(65535));
+    #endif
+
+        return ch;
+    }
+
+    // Packs the three result channels into rg and ba halves, with opaque alpha
+    CB_TARGET_AVX2 inline void StoreResult64AVX2(RGBA64* p, const __m256i ch[3])
+    {
+        __m256i rg = _mm256_or_si256(ClampChannel64AVX2(ch[0]), _mm256_slli_epi32(ClampChannel64AVX2(ch[1]), 16));
+        __m256i ba = _mm256_or_si256(ClampChannel64AVX2(ch[2]), _mm256_set1_epi32(int(0xFFFF0000)));
+
+        StoreRGBA64AVX2(p, rg, ba);
+    }
+
+    // As LUTCoordsAVX2, for the 16-bit channels of 8 pixels
+    CB_TARGET_AVX2 inline void LUTCoords64AVX2(const cLUTGrid64& g, const RGBA64* p, __m256i i0[3], __m256i i1[3], __m256i s[3])
+    {
+        const __m256i one  = _mm256_set1_epi32(1);
+        const __m256i half = _mm256_set1_epi32(g.fHalf);
+        const __m256i bias = _mm256_set1_epi32(g.bias);
+        const __m256i mask = _mm256_set1_epi32((1 << g.fShift) - 1);
+
+        __m256i rg, ba;
+        SplitRGBA64AVX2(_mm256_loadu_si256((const __m256i*) p), _mm256_loadu_si256((const __m256i*) (p + 4)), &rg, &ba);
+
+        for (int j = 0; j < 3; j++)
+        {
+            __m256i co  = _mm256_add_epi32(Channel64AVX2(rg, ba, j), half);
+            __m256i i0j = _mm256_sub_epi32(_mm256_srli_epi32(co, g.fShift), bias);
+
+            s[j] = _mm256_srli_epi32(_mm256_and_si256(co, mask), g.wShift);
+
+        #ifdef EXTRAPOLATE_LUT
+            i0[j] = _mm256_min_epi32(_mm256_max_epi32(i0j, _mm256_setzero_si256()), _mm256_set1_epi32(g.size - 2));
+            i1[j] = _mm256_add_epi32(i0[j], one);
+            s [j] = _mm256_add_epi32(s[j], _mm256_slli_epi32(_mm256_sub_epi32(i0j, i0[j]), g.wBits));
+        #else
+            i1[j] = _mm256_min_epi32(_mm256_add_epi32(i0j, one), _mm256_set1_epi32(g.size - 1));
+            i0[j] = _mm256_max_epi32(i0j, _mm256_setzero_si256());
+        #endif
+        }
+    }
+
+    CB_TARGET_AVX2 inline __m256i LUTIndex64AVX2(const cLUTGrid64& g, const __m256i i[3])
+    {
+        const __m256i size = _mm256_set1_epi32(g.size);
+        return _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(i[2], size), i[1]), size), i[0]);
+    }
+
+    CB_TARGET_AVX2 inline __m256i Lerp64AVX2(const cLUTGrid64& g, __m256i a, __m256i b, __m256i s)
+    {
+        return _mm256_add_epi32(a, _mm256_srai_epi32(_mm256_mullo_epi32(s, _mm256_sub_epi32(b, a)), g.wBits));
+    }
+
+    CB_TARGET_AVX2 void ApplyLUT64DiagonalAVX2(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[])
+    {
+        const cLUTGrid64 g = LUTGrid64(lut);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i i0[3], i1[3], s[3];
+            LUTCoords64AVX2(g, dataIn + i, i0, i1, s);
+
+            __m256i rg0, ba0, rg1, ba1;
+            GatherRGBA64AVX2(lut.data, LUTIndex64AVX2(g, i0), &rg0, &ba0);
+            GatherRGBA64AVX2(lut.data, LUTIndex64AVX2(g, i1), &rg1, &ba1);
+
+            __m256i ch[3];
+
+            for (int j = 0; j < 3; j++)
+                ch[j] = Lerp64AVX2(g, Channel64AVX2(rg0, ba0, j), Channel64AVX2(rg1, ba1, j), s[j]);
+
+            StoreResult64AVX2(dataOut + i, ch);
+        }
+
+        ApplyLUT64Diagonal(lut, n - i, dataIn + i, dataOut + i);
+    }
+
+    CB_TARGET_AVX2 void ApplyLUT64TetrahedralAVX2(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[])
+    {
+        const cLUTGrid64 g = LUTGrid64(lut);
+        const __m256i wOne = _mm256_set1_epi32(g.wOne);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i i0[3], i1[3], s[3];
+            LUTCoords64AVX2(g, dataIn + i, i0, i1, s);
+
+            __m256i d[3], w[4];
+            LUTTetrahedronAVX2(g.size, i0, i1, s, wOne, d, w);
+
+            __m256i base = LUTIndex64AVX2(g, i0);
+            __m256i rg[4], ba[4];
+
+            GatherRGBA64AVX2(lut.data, base, &rg[0], &ba[0]);
+
+            for (int k = 0; k < 3; k++)
+                GatherRGBA64AVX2(lut.data, _mm256_add_epi32(base, d[k]), &rg[k + 1], &ba[k + 1]);
+
+            __m256i ch[3];
+
+            for (int j = 0; j < 3; j++)
+            {
+                __m256i sum = _mm256_mullo_epi32(w[0], Channel64AVX2(rg[0], ba[0], j));
+
+                for (int k = 1; k < 4; k++)
+                    sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(w[k], Channel64AVX2(rg[k], ba[k], j)));
+
+                ch[j] = _mm256_srai_epi32(sum, g.wBits);
+            }
+
+            StoreResult64AVX2(dataOut + i, ch);
+        }
+
+        ApplyLUT64Tetrahedral(lut, n - i, dataIn + i, dataOut + i);
+    }
+
+    CB_TARGET_AVX2 void ApplyLUT64TrilinearAVX2(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[])
+    {
+        const cLUTGrid64 g = LUTGrid64(lut);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i i0[3], i1[3], s[3];
+            LUTCoords64AVX2(g, dataIn + i, i0, i1, s);
+
+            __m256i dx = LUTStepAVX2(i0[0], i1[0], 1);
+            __m256i dy = LUTStepAVX2(i0[1], i1[1], g.size);
+            __m256i dz = LUTStepAVX2(i0[2], i1[2], g.size * g.size);
+
+            __m256i base = LUTIndex64AVX2(g, i0);
+            __m256i rg[8], ba[8];
+
+            for (int k = 0; k < 8; k++)
+            {
+                __m256i index = base;
+
+                if (k & 1)
+                    index = _mm256_add_epi32(index, dx);
+                if (k & 2)
+                    index = _mm256_add_epi32(index, dy);
+                if (k & 4)
+                    index = _mm256_add_epi32(index, dz);
+
+                GatherRGBA64AVX2(lut.data, index, &rg[k], &ba[k]);
+            }
+
+            __m256i ch[3];
+
+            for (int j = 0; j < 3; j++)
+            {
+                __m256i cx[4], cy[2];
+
+                for (int k = 0; k < 4; k++)
+                    cx[k] = Lerp64AVX2(g, Channel64AVX2(rg[2 * k], ba[2 * k], j), Channel64AVX2(rg[2 * k + 1], ba[2 * k + 1], j), s[0]);
+                for (int k = 0; k < 2; k++)
+                    cy[k] = Lerp64AVX2(g, cx[2 * k], cx[2 * k + 1], s[1]);
+
+                ch[j] = Lerp64AVX2(g, cy[0], cy[1], s[2]);
+            }
+
+            StoreResult64AVX2(dataOut + i, ch);
+        }
+
+        ApplyLUT64Trilinear(lut, n - i, dataIn + i, dataOut + i);
+    }
+#endif
+
+    typedef void tApplyLUT64Func(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[]);
+
+    tApplyLUT64Func* LUTKernel64(const RGBLUT64& lut, tLUTInterp interp)
+    {
+        assert(IsValidLUTSize(lut.size) && lut.size >> lut.bits == 1);
+
+    #ifdef CB_X86
+        if (SIMDLevel() >= kSIMDAVX2)
+            return interp == kInterpTetrahedral ? ApplyLUT64TetrahedralAVX2 : interp == kInterpTrilinear ? ApplyLUT64TrilinearAVX2 : ApplyLUT64DiagonalAVX2;
+    #endif
+
+        return interp == kInterpTetrahedral ? ApplyLUT64Tetrahedral : interp == kInterpTrilinear ? ApplyLUT64Trilinear : ApplyLUT64Diagonal;
+    }
+
+    // Half floats are converted to and from the 16-bit LUT space via tables indexed by their bits
+    struct cHalfTables
+    {
+        uint16_t encode[65536];     // half -> gamma-encoded 0-65536 channel, as ToRGBA64u
+        uint16_t decode[65536];     // gamma-encoded channel -> half, as FromRGBA64u
+
+        cHalfTables();
+    };
+
+    cHalfTables::cHalfTables()
+    {
+        for (int i = 0; i < 65536; i++)
+        {
+            encode[i] = ToU16u(powf(FromHalf(uint16_t(i)), 1.0f / kGamma));
+            decode[i] = ToHalf(powf(i / 65536.0f, kGamma));
+        }
+    }
+
+    inline const cHalfTables& HalfTables()
+    {
+        static cHalfTables tables;
+        return tables;
+    }
+
+    void ApplyLUT64Half(tApplyLUT64Func* kernel, const RGBLUT64& lut, int n, const RGBA16F dataIn[], RGBA16F dataOut[])
+    {
+        const cHalfTables& tables = HalfTables();
+        const int kBlockSize = 256;
+
+        RGBA64 block[kBlockSize];
+
+        for (int i = 0; i < n; i += kBlockSize)
+        {
+            int count = n - i < kBlockSize ? n - i : kBlockSize;
+
+            for (int j = 0; j < count; j++)
+            {
+                const uint16_t* c = dataIn[i + j].c;
+                block[j] = MakeRGBA64(tables.encode[c[0]], tables.encode[c[1]], tables.encode[c[2]]);
+            }
+
+            kernel(lut, count, block, block);
+
+            for (int j = 0; j < count; j++)
+            {
+                uint16_t* c = dataOut[i + j].c;
+
+                c[0] = tables.decode[block[j].c[0]];
+                c[1] = tables.decode[block[j].c[1]];
+                c[2] = tables.decode[block[j].c[2]];
+                c[3] = 0x3C00;  // 1.0
+            }
+        }
+    }
+}
+
+void CBLut::ApplyLUT(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[], tLUTInterp interp)
+{
+    LUTKernel64(lut, interp)(lut, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyLUT(const RGBLUT64& lut, int n, const RGBA16F dataIn[], RGBA16F dataOut[], tLUTInterp interp)
+{
+    ApplyLUT64Half(LUTKernel64(lut, interp), lut, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyLUTParallel(const RGBLUT64& lut, int n, const RGBA64 dataIn[], RGBA64 dataOut[], tLUTInterp interp, int numThreads)
+{
+    tApplyLUT64Func* kernel = LUTKernel64(lut, interp);
+
+    // Pixels are twice the size, so halve the chunks to keep them in cache
+    ParallelFor(n, kParallelChunkSize / 2, numThreads,
+        [kernel, &lut, dataIn, dataOut](int begin, int end)
+        {
+            kernel(lut, end - begin, dataIn + begin, dataOut + begin);
+        }
+    );
+}
+
+void CBLut::ApplyLUTParallel(const RGBLUT64& lut, int n, const RGBA16F dataIn[], RGBA16F dataOut[], tLUTInterp interp, int numThreads)
+{
+    tApplyLUT64Func* kernel = LUTKernel64(lut, interp);
+
+    ParallelFor(n, kParallelChunkSize / 2, numThreads,
+        [kernel, &lut, dataIn, dataOut](int begin, int end)
+        {
+            ApplyLUT64Half(kernel, lut, end - begin, dataIn + begin, dataOut + begin);
+        }
+    );
+}
+
+// --- Linear-light LUT support ------------------------------------------------
+
+RGBLUTF CBLut::AllocLUTF(int size)
+{
+    assert(2 <= size && size <= kMaxLUTSize);
+
+    return RGBLUTF { size, new RGBA32F[size * size * size] };
+}
+
+void CBLut::FreeLUT(RGBLUTF* lut)
+{
+    delete[] lut->data;
+    lut->data = 0;
+}
+
+void CBLut::LUTSampleValues(const RGBLUTF& lut, float values[])
+{
+    for (int i = 0; i < lut.size; i++)
+        values[i] = i / float(lut.size - 1);
+}
+
+void CBLut::LUTHalfData(const RGBLUTF& lut, RGBA16F dataOut[])
+{
+    const int n = lut.size * lut.size * lut.size;
+
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < 4; j++)
+            dataOut[i].c[j] = ToHalf(lut.data[i].c[j]);
+}
+
+void CBLut::CreateIdentityLUT(const RGBLUTF& lut)
+{
+    float values[kMaxLUTSize];
+    LUTSampleValues(lut, values);
+
+    RGBA32F* p = lut.data;
+
+    for (int i = 0; i < lut.size; i++)
+    for (int j = 0; j < lut.size; j++)
+    for (int k = 0; k < lut.size; k++)
+        *p++ = RGBA32F { { values[k], values[j], values[i], 1.0f } };
+}
+
+namespace
+{
+    struct cLUTGridF
+    {
+        int   size;
+        float scale;    // maps 0-1 to sample indices
+        float maxCell;  // lower index of the last cell
+        int   dy;       // offset to the next sample along green
+        int   dz;       // offset to the next sample along blue
+    };
+
+    inline cLUTGridF LUTGridF(const RGBLUTF& lut)
+    {
+        assert(2 <= lut.size && lut.size <= kMaxLUTSize);
+
+        return cLUTGridF { lut.size, float(lut.size - 1), float(lut.size - 2), lut.size, lut.size * lut.size };
+    }
+
+    // Returns the index of the lower sample of the cell containing c, and in f the fractions towards the upper one.
+    // Colours outside the LUT use the edge cells, with fractions outside [0, 1], so are extrapolated from them.
+    inline int LUTCoordsF(const cLUTGridF& g, Vec3f c, float f[3])
+    {
+        const float ci[3] = { c.x, c.y, c.z };
+        int i0[3];
+
+        for (int j = 0; j < 3; j++)
+        {
+            float x  = ci[j] * g.scale;
+            float xc = x > 0.0f ? (x < g.maxCell ? x : g.maxCell) : 0.0f;  // NaNs go to 0 too
+
+            i0[j] = int(xc);
+            f [j] = x - i0[j];
+        }
+
+        return (i0[2] * g.size + i0[1]) * g.size + i0[0];
+    }
+
+    void ApplyLUTFDiagonal(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            float f[3];
+            const RGBA32F* c000 = lut.data + LUTCoordsF(g, dataIn[i], f);
+            const RGBA32F* c111 = c000 + 1 + g.dy + g.dz;
+
+            float c[3];
+
+            for (int j = 0; j < 3; j++)
+                c[j] = c000->c[j] + f[j] * (c111->c[j] - c000->c[j]);
+
+            dataOut[i] = Vec3f { c[0], c[1], c[2] };
+        }
+    }
+
+    void ApplyLUTFTetrahedral(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            float f[3];
+            const RGBA32F* c000 = lut.data + LUTCoordsF(g, dataIn[i], f);
+
+            int dA, dB;
+            float w[4];
+            LUTTetrahedron(f, 1.0f, 1, g.dy, g.dz, &dA, &dB, w);
+
+            const RGBA32F* lutC[4] = { c000, c000 + dA, c000 + dB, c000 + 1 + g.dy + g.dz };
+
+            float c[3];
+
+            for (int j = 0; j < 3; j++)
+                c[j] = w[0] * lutC[0]->c[j] + w[1] * lutC[1]->c[j] + w[2] * lutC[2]->c[j] + w[3] * lutC[3]->c[j];
+
+            dataOut[i] = Vec3f { c[0], c[1], c[2] };
+        }
+    }
+
+    void ApplyLUTFTrilinear(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            float f[3];
+            const RGBA32F* c000 = lut.data + LUTCoordsF(g, dataIn[i], f);
+
+            const RGBA32F* lutC[8];
+
+            for (int k = 0; k < 8; k++)
+                lutC[k] = c000 + (k & 1) + (k & 2 ? g.dy : 0) + (k & 4 ? g.dz : 0);
+
+            float c[3];
+
+            for (int j = 0; j < 3; j++)
+            {
+                float cx[4], cy[2];
+
+                for (int k = 0; k < 4; k++)
+                    cx[k] = lutC[2 * k]->c[j] + f[0] * (lutC[2 * k + 1]->c[j] - lutC[2 * k]->c[j]);
+                for (int k = 0; k < 2; k++)
+                    cy[k] = cx[2 * k] + f[1] * (cx[2 * k + 1] - cx[2 * k]);
+
+                c[j] = cy[0] + f[2] * (cy[1] - cy[0]);
+            }
+
+            dataOut[i] = Vec3f { c[0], c[1], c[2] };
+        }
+    }
+
+#ifdef CB_X86
+    // SSE2 versions, which handle one pixel at a time, with each sample's channels in one register.
+    // These do the same arithmetic in the same order as the above, and so match them exactly.
+    CB_TARGET_SSE2 inline __m128 LoadSampleSSE2(const RGBA32F* p)
+    {
+        return _mm_loadu_ps(p->c);
+    }
+
+    CB_TARGET_SSE2 inline void StoreVec3SSE2(Vec3f* p, __m128 c)
+    {
+        _mm_storel_pi((__m64*) p, c);
+        _mm_store_ss(&p->z, _mm_movehl_ps(c, c));
+    }
+
+    CB_TARGET_SSE2 inline __m128 LerpSSE2(__m128 a, __m128 b, __m128 s)
+    {
+        return _mm_add_ps(a, _mm_mul_ps(s, _mm_sub_ps(b, a)));
+    }
+
+    CB_TARGET_SSE2 void ApplyLUTFDiagonalSSE2(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            float f[3];
+            const RGBA32F* c000 = lut.data + LUTCoordsF(g, dataIn[i], f);
+
+            __m128 s = _mm_setr_ps(f[0], f[1], f[2], 0.0f);
+
+            StoreVec3SSE2(dataOut + i, LerpSSE2(LoadSampleSSE2(c000), LoadSampleSSE2(c000 + 1 + g.dy + g.dz), s));
+        }
+    }
+
+    CB_TARGET_SSE2 void ApplyLUTFTetrahedralSSE2(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            float f[3];
+            const RGBA32F* c000 = lut.data + LUTCoordsF(g, dataIn[i], f);
+
+            int dA, dB;
+            float w[4];
+            LUTTetrahedron(f, 1.0f, 1, g.dy, g.dz, &dA, &dB, w);
+
+            __m128 c =            _mm_mul_ps(_mm_set1_ps(w[0]), LoadSampleSSE2(c000));
+            c = _mm_add_ps(c, _mm_mul_ps(_mm_set1_ps(w[1]), LoadSampleSSE2(c000 + dA)));
+            c = _mm_add_ps(c, _mm_mul_ps(_mm_set1_ps(w[2]), LoadSampleSSE2(c000 + dB)));
+            c = _mm_add_ps(c, _mm_mul_ps(_mm_set1_ps(w[3]), LoadSampleSSE2(c000 + 1 + g.dy + g.dz)));
+
+            StoreVec3SSE2(dataOut + i, c);
+        }
+    }
+
+    CB_TARGET_SSE2 void ApplyLUTFTrilinearSSE2(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+
+        for (int i = 0; i < n; i++)
+        {
+            float f[3];
+            const RGBA32F* c000 = lut.data + LUTCoordsF(g, dataIn[i], f);
+
+            __m128 sx = _mm_set1_ps(f[0]);
+            __m128 sy = _mm_set1_ps(f[1]);
+            __m128 sz = _mm_set1_ps(f[2]);
+
+            __m128 cx[4];
+
+            for (int k = 0; k < 4; k++)
+            {
+                const RGBA32F* p = c000 + (k & 1 ? g.dy : 0) + (k & 2 ? g.dz : 0);
+                cx[k] = LerpSSE2(LoadSampleSSE2(p), LoadSampleSSE2(p + 1), sx);
+            }
+
+            StoreVec3SSE2(dataOut + i, LerpSSE2(LerpSSE2(cx[0], cx[1], sy), LerpSSE2(cx[2], cx[3], sy), sz));
+        }
+    }
+
+    // AVX2 versions, which handle eight pixels at a time, gathering their channels from the samples
+    CB_TARGET_AVX2 inline void LoadVec3AVX2(const Vec3f dataIn[], __m256 c[3])    // deinterleave eight Vec3fs
+    {
+        const float* p = &dataIn->x;
+
+        // Each register holds a 128-bit lane from the first and second four colours
+        __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 0)), _mm_loadu_ps(p + 12), 1);  // x0 y0 z0 x1
+        __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);  // y1 z1 x2 y2
+        __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);  // z2 x3 y3 z3
+
+        __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));   // x2 y2 x3 y3
+        __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));   // y0 z0 y1 z1
+
+        c[0] = _mm256_shuffle_ps(m03, xy , _MM_SHUFFLE(2, 0, 3, 0));
+        c[1] = _mm256_shuffle_ps(yz , xy , _MM_SHUFFLE(3, 1, 2, 0));
+        c[2] = _mm256_shuffle_ps(yz , m25, _MM_SHUFFLE(3, 0, 3, 1));
+    }
+
+    CB_TARGET_AVX2 inline void StoreVec3AVX2(Vec3f dataOut[], const __m256 c[3])  // the reverse of LoadVec3AVX2
+    {
+        float* p = &dataOut->x;
+
+        __m256 xy = _mm256_shuffle_ps(c[0], c[1], _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 yz = _mm256_shuffle_ps(c[1], c[2], _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 zx = _mm256_shuffle_ps(c[2], c[0], _MM_SHUFFLE(3, 1, 2, 0));
+
+        __m256 m03 = _mm256_shuffle_ps(xy, zx, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 m14 = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+        __m256 m25 = _mm256_shuffle_ps(zx, yz, _MM_SHUFFLE(3, 1, 3, 1));
+
+        _mm_storeu_ps(p +  0, _mm256_castps256_ps128(m03));
+        _mm_storeu_ps(p +  4, _mm256_castps256_ps128(m14));
+        _mm_storeu_ps(p +  8, _mm256_castps256_ps128(m25));
+        _mm_storeu_ps(p + 12, _mm256_extractf128_ps(m03, 1));
+        _mm_storeu_ps(p + 16, _mm256_extractf128_ps(m14, 1));
+        _mm_storeu_ps(p + 20, _mm256_extractf128_ps(m25, 1));
+    }
+
+    CB_TARGET_AVX2 inline __m256i LUTCoordsFAVX2(const cLUTGridF& g, const Vec3f dataIn[], __m256 f[3])  // returns the float offset of c000
+    {
+        const __m256  scale   = _mm256_set1_ps(g.scale);
+        const __m256  maxCell = _mm256_set1_ps(g.maxCell);
+        const __m256i size    = _mm256_set1_epi32(g.size);
+
+        __m256 ci[3];
+        LoadVec3AVX2(dataIn, ci);
+
+        __m256i i0[3];
+
+        for (int j = 0; j < 3; j++)
+        {
+            __m256 x  = _mm256_mul_ps(ci[j], scale);
+            __m256 xc = _mm256_min_ps(_mm256_max_ps(x, _mm256_setzero_ps()), maxCell);  // max returns 0 for NaNs
+
+            i0[j] = _mm256_cvttps_epi32(xc);
+            f [j] = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i0[j]));
+        }
+
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(i0[2], size), i0[1]), size), i0[0]);
+
+        return _mm256_slli_epi32(index, 2);
+    }
+
+    CB_TARGET_AVX2 inline void GatherSampleFAVX2(const RGBLUTF& lut, __m256i offset, __m256 c[3])
+    {
+        for (int j = 0; j < 3; j++)
+            c[j] = _mm256_i32gather_ps(lut.data->c + j, offset, 4);
+    }
+
+    CB_TARGET_AVX2 inline __m256 LerpAVX2(__m256 a, __m256 b, __m256 s)
+    {
+        return _mm256_add_ps(a, _mm256_mul_ps(s, _mm256_sub_ps(b, a)));
+    }
+
+    CB_TARGET_AVX2 void ApplyLUTFDiagonalAVX2(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+        const __m256i d111 = _mm256_set1_epi32(4 * (1 + g.dy + g.dz));
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 f[3];
+            __m256i i000 = LUTCoordsFAVX2(g, dataIn + i, f);
+
+            __m256 c0[3], c1[3];
+            GatherSampleFAVX2(lut, i000, c0);
+            GatherSampleFAVX2(lut, _mm256_add_epi32(i000, d111), c1);
+
+            for (int j = 0; j < 3; j++)
+                c0[j] = LerpAVX2(c0[j], c1[j], f[j]);
+
+            StoreVec3AVX2(dataOut + i, c0);
+        }
+
+        ApplyLUTFDiagonalSSE2(lut, n - i, dataIn + i, dataOut + i);
+    }
+
+    CB_TARGET_AVX2 void ApplyLUTFTetrahedralAVX2(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+        const __m256i dx   = _mm256_set1_epi32(4);
+        const __m256i dy   = _mm256_set1_epi32(4 * g.dy);
+        const __m256i dz   = _mm256_set1_epi32(4 * g.dz);
+        const __m256i dxyz = _mm256_set1_epi32(4 * (1 + g.dy + g.dz));
+        const __m256  one  = _mm256_set1_ps(1.0f);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 f[3];
+            __m256i i000 = LUTCoordsFAVX2(g, dataIn + i, f);
+
+            // As LUTTetrahedronAVX2, but with the median taken directly, so the weights match LUTTetrahedron's exactly
+            __m256i xGEy = _mm256_castps_si256(_mm256_cmp_ps(f[0], f[1], _CMP_GE_OQ));
+            __m256i xGEz = _mm256_castps_si256(_mm256_cmp_ps(f[0], f[2], _CMP_GE_OQ));
+            __m256i yGEz = _mm256_castps_si256(_mm256_cmp_ps(f[1], f[2], _CMP_GE_OQ));
+
+            __m256i xMax = _mm256_and_si256(xGEy, xGEz);
+            __m256i yMax = _mm256_andnot_si256(xMax, yGEz);
+            __m256i zMin = _mm256_and_si256(xGEz, yGEz);
+            __m256i yMin = _mm256_andnot_si256(zMin, xGEy);
+
+            __m256i iA = _mm256_add_epi32(i000, _mm256_blendv_epi8(_mm256_blendv_epi8(dz, dy, yMax), dx, xMax));
+            __m256i iB = _mm256_add_epi32(i000, _mm256_sub_epi32(dxyz, _mm256_blendv_epi8(_mm256_blendv_epi8(dx, dy, yMin), dz, zMin)));
+
+            __m256 sMax = _mm256_max_ps(_mm256_max_ps(f[0], f[1]), f[2]);
+            __m256 sMin = _mm256_min_ps(_mm256_min_ps(f[0], f[1]), f[2]);
+            __m256 sMid = _mm256_max_ps(_mm256_min_ps(f[0], f[1]), _mm256_min_ps(_mm256_max_ps(f[0], f[1]), f[2]));
+
+            __m256 w[4] =
+            {
+                _mm256_sub_ps(one, sMax),
+                _mm256_sub_ps(sMax, sMid),
+                _mm256_sub_ps(sMid, sMin),
+                sMin
+            };
+
+            __m256 c[4][3];
+            GatherSampleFAVX2(lut, i000, c[0]);
+            GatherSampleFAVX2(lut, iA, c[1]);
+            GatherSampleFAVX2(lut, iB, c[2]);
+            GatherSampleFAVX2(lut, _mm256_add_epi32(i000, dxyz), c[3]);
+
+            __m256 result[3];
+
+            for (int j = 0; j < 3; j++)
+            {
+                result[j] =                       _mm256_mul_ps(w[0], c[0][j]);
+                result[j] = _mm256_add_ps(result[j], _mm256_mul_ps(w[1], c[1][j]));
+                result[j] = _mm256_add_ps(result[j], _mm256_mul_ps(w[2], c[2][j]));
+                result[j] = _mm256_add_ps(result[j], _mm256_mul_ps(w[3], c[3][j]));
+            }
+
+            StoreVec3AVX2(dataOut + i, result);
+        }
+
+        ApplyLUTFTetrahedralSSE2(lut, n - i, dataIn + i, dataOut + i);
+    }
+
+    CB_TARGET_AVX2 void ApplyLUTFTrilinearAVX2(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[])
+    {
+        const cLUTGridF g = LUTGridF(lut);
+        const __m256i dx = _mm256_set1_epi32(4);
+        const __m256i dy = _mm256_set1_epi32(4 * g.dy);
+        const __m256i dz = _mm256_set1_epi32(4 * g.dz);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 f[3];
+            __m256i i000 = LUTCoordsFAVX2(g, dataIn + i, f);
+
+            __m256 cx[4][3];
+
+            for (int k = 0; k < 4; k++)
+            {
+                __m256i ik = _mm256_add_epi32(i000, _mm256_add_epi32(k & 1 ? dy : _mm256_setzero_si256(), k & 2 ? dz : _mm256_setzero_si256()));
+
+                __m256 c0[3], c1[3];
+                GatherSampleFAVX2(lut, ik, c0);
+                GatherSampleFAVX2(lut, _mm256_add_epi32(ik, dx), c1);
+
+                for (int j = 0; j < 3; j++)
+                    cx[k][j] = LerpAVX2(c0[j], c1[j], f[0]);
+            }
+
+            __m256 result[3];
+
+            for (int j = 0; j < 3; j++)
+                result[j] = LerpAVX2(LerpAVX2(cx[0][j], cx[1][j], f[1]), LerpAVX2(cx[2][j], cx[3][j], f[1]), f[2]);
+
+            StoreVec3AVX2(dataOut + i, result);
+        }
+
+        ApplyLUTFTrilinearSSE2(lut, n - i, dataIn + i, dataOut + i);
+    }
+#endif
+
+    typedef void tApplyLUTFFunc(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[]);
+
+    tApplyLUTFFunc* LUTKernelF(tLUTInterp interp)
+    {
+    #ifdef CB_X86
+        if (SIMDLevel() >= kSIMDAVX2)
+            return interp == kInterpTetrahedral ? ApplyLUTFTetrahedralAVX2 : interp == kInterpTrilinear ? ApplyLUTFTrilinearAVX2 : ApplyLUTFDiagonalAVX2;
+        if (SIMDLevel() >= kSIMDSSE2)
+            return interp == kInterpTetrahedral ? ApplyLUTFTetrahedralSSE2 : interp == kInterpTrilinear ? ApplyLUTFTrilinearSSE2 : ApplyLUTFDiagonalSSE2;
+    #endif
+
+        return interp == kInterpTetrahedral ? ApplyLUTFTetrahedral : interp == kInterpTrilinear ? ApplyLUTFTrilinear : ApplyLUTFDiagonal;
+    }
+}
+
+void CBLut::ApplyLUT(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[], tLUTInterp interp)
+{
+    LUTKernelF(interp)(lut, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyLUTParallel(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[], tLUTInterp interp, int numThreads)
+{
+    tApplyLUTFFunc* kernel = LUTKernelF(interp);
+
+    // Pixels are three times the size, so quarter the chunks to keep them in cache
+    ParallelFor(n, kParallelChunkSize / 4, numThreads,
+        [kernel, &lut, dataIn, dataOut](int begin, int end)
+        {
+            kernel(lut, end - begin, dataIn + begin, dataOut + begin);
+        }
+    );
+}
+
+// --- Palette support ---------------------------------------------------------
+
+namespace
+{
+    // Open-addressed hash table of RGB values. Alpha is forced to 0xFF in keys,
+    // so that no key is 0, which we use to mark empty slots.
+    struct cColourHash
+    {
+        int       shift;
+        int       mask;
+        uint32_t* keys;
+        int*      values;
+
+        cColourHash(int maxColours);
+        ~cColourHash();
+
+        int Slot(uint32_t key) const;   ///< Returns the slot holding key, or the empty slot where it should go
+    };
+
+    inline uint32_t ColourKey(RGBA32 c)
+    {
+        return c.u32 | 0xFF000000;
+    }
+
+    cColourHash::cColourHash(int maxColours)
+    {
+        int bits = 6;
+
+        while ((1 << bits) < 2 * maxColours)    // keep load factor <= 0.5
+            bits++;
+
+        shift  = 32 - bits;
+        mask   = (1 << bits) - 1;
+        keys   = new uint32_t[mask + 1]();
+        values = new int[mask + 1];
+    }
+
+    cColourHash::~cColourHash()
+    {
+        delete[] values;
+        delete[] keys;
+    }
+
+    inline int cColourHash::Slot(uint32_t key) const
+    {
+        int slot = (key * 0x9E3779B1u) >> shift;   // Fibonacci hashing
+
+        while (keys[slot] != key && keys[slot] != 0)
+            slot = (slot + 1) & mask;
+
+        return slot;
+    }
+}
+
+int CBLut::FindColours(int n, const RGBA32 dataIn[], int maxColours, RGBA32 colours[])
+{
+    cColourHash hash(maxColours);
+    int numColours = 0;
+    uint32_t lastKey = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t key = ColourKey(dataIn[i]);
+
+        if (key == lastKey)     // flat areas are common in the images we're aimed at
+            continue;
+
+        lastKey = key;
+
+        int slot = hash.Slot(key);
+
+        if (hash.keys[slot])
+            continue;
+
+        if (numColours == maxColours)
+            return -1;
+
+        hash.keys[slot] = key;
+        colours[numColours++].u32 = key;
+    }
+
+    return numColours;
+}
+
+void CBLut::RemapColours(int n, const RGBA32 dataIn[], RGBA32 dataOut[], int numColours, const RGBA32 coloursIn[], const RGBA32 coloursOut[])
+{
+    cColourHash hash(numColours);
+
+    for (int i = 0; i < numColours; i++)
+    {
+        uint32_t key = ColourKey(coloursIn[i]);
+        int slot = hash.Slot(key);
+
+        hash.keys  [slot] = key;
+        hash.values[slot] = i;
+    }
+
+    uint32_t lastKey = 0;
+    RGBA32   lastOut = {};
+
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t key = ColourKey(dataIn[i]);
+
+        if (key != lastKey)
+        {
+            int slot = hash.Slot(key);
+
+            lastKey = key;
+            lastOut = hash.keys[slot] ? coloursOut[hash.values[slot]] : dataIn[i];
+        }
+
+        dataOut[i] = lastOut;
+    }
+}
+
+// --- Mono LUT support --------------------------------------------------------
+
+void CBLut::ApplyMonoLUT(const RGBA32 monoLUT[256], int n, const RGBA32 dataIn[], RGBA32 dataOut[], int channel)
+{
+    if (channel < 0)
+    {
+        const cGammaEncoder& encode = GammaTables().encode;
+
+        for (int i = 0; i < n; i++)
+        {
+            Vec3f c = FromRGBA32Fast(dataIn[i]);    // now linear
+            float lumD65 = dot(Vec3f{0.2126f, 0.7152f, 0.0722f}, c);
+            
+            uint8_t lumU8 = encode.Encode(lumD65);  // lookup tables are in gamma space
+        
+            dataOut[i] = monoLUT[lumU8];
+        }
+        return;
+    }
+    
+    for (int i = 0; i < n; i++)
+        dataOut[i] = monoLUT[dataIn[i].c[channel]];
+}
+
+void CBLut::ApplyMonoLUTParallel(const RGBA32 monoLUT[256], int n, const RGBA32 dataIn[], RGBA32 dataOut[], int channel, int numThreads)
+{
+    ParallelFor(n, kParallelChunkSize, numThreads,
+        [monoLUT, dataIn, dataOut, channel](int begin, int end)
+        {
+            ApplyMonoLUT(monoLUT, end - begin, dataIn + begin, dataOut + begin, channel);
+        }
+    );
 }
     
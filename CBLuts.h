@@ -9,6 +9,9 @@
 #ifndef CB_LUTS_H
 #define CB_LUTS_H
 
+#include "CBThreads.h"
+
+#include <stddef.h>
 #include <stdint.h>
 
 namespace CBLut
@@ -37,6 +40,23 @@ namespace CBLut
     Vec3f Daltonise(Vec3f rgb, tLMS lmsType, float strength = 1.0f); ///< "Daltonise" 'rgb' to enhance it for the given type of colour blindness, using Fidaner et al.
     Vec3f Correct  (Vec3f rgb, tLMS lmsType, float strength = 1.0f); ///< Correct image for given type of colour blindness using a mixture of amplification and hue shifting.
 
+    // Batch versions of the above, which transform n linear RGB colours held in planar arrays, in place.
+    // Type dispatch and matrix setup is done once per call rather than per colour, and colours are processed
+    // 4 or 8 at a time via SSE2/AVX2 where available. Results are identical to the above.
+    void Simulate (int n, float r[], float g[], float b[], tLMS lmsType, float strength = 1.0f);
+    void Daltonise(int n, float r[], float g[], float b[], tLMS lmsType, float strength = 1.0f);
+    void Correct  (int n, float r[], float g[], float b[], tLMS lmsType, float strength = 1.0f);
+
+    // All three of the above are linear in linear RGB, and can be composed into single 3x3 matrices, which
+    // give the same results up to rounding. These can, e.g., be used as shader constants in place of a LUT.
+    Mat3f SimulateMatrix (tLMS lmsType, float strength = 1.0f);
+    Mat3f DaltoniseMatrix(tLMS lmsType, float strength = 1.0f);
+    Mat3f CorrectMatrix  (tLMS lmsType, float strength = 1.0f);
+
+    void TransformMatrix(const Mat3f& m, int n, float r[], float g[], float b[]);  ///< Apply m to n linear RGB colours in planar form, in place
+
+    uint64_t ModelHash();   ///< Fingerprint of the model's constants and results, e.g., for keying cached LUTs. Changes if either does
+
 
     // Simple 32-bit RGBA handling
     struct RGBA32
@@ -53,17 +73,552 @@ namespace CBLut
     Vec3f  FromRGBA32 (RGBA32 rgb);
     Vec3f  FromRGBA32u(RGBA32 rgb);
 
+    RGBA32 ToRGBA32Fast   (Vec3f c);    ///< Table-driven versions of the above, avoiding powf(). Results are identical
+    RGBA32 ToRGBA32uFast  (Vec3f c);
+    Vec3f  FromRGBA32Fast (RGBA32 rgb);
+    Vec3f  FromRGBA32uFast(RGBA32 rgb);
+
+    void ToRGBA32uFast(int n, const float r[], const float g[], const float b[], RGBA32 dataOut[]);  ///< Batch version of ToRGBA32uFast, for planar colours
+
+    void TransformMatrix(const Mat3f& m, int n, const RGBA32 dataIn[], RGBA32 dataOut[]);  ///< Apply the linear-space matrix m to the given image, e.g., from SimulateMatrix()
+
     // RGB LUT support
     constexpr int kLUTBits = 5; // 32 x 32 x 32, compromise between accuracy and memory.
     constexpr int kLUTSize = 1 << kLUTBits;
 
+    enum tLUTInterp
+    {
+        kInterpDiagonal,    ///< Blend the two samples along the cell diagonal. Fastest, but can band on strongly non-linear LUTs
+        kInterpTetrahedral, ///< Blend the four samples of the enclosing tetrahedron
+        kInterpTrilinear,   ///< Blend all eight samples of the enclosing cell
+    };
+
     void CreateIdentityLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize]);    // Create identity
-    void ApplyLUT      (RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]); ///< Apply lut to the given image 
+    void ApplyLUT      (RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp = kInterpDiagonal); ///< Apply lut to the given image 
     void ApplyLUTNoLerp(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]); ///< Apply lut to the given image, using point sampling
 
+    // Runtime-sized RGB LUTs. These have either 2^b samples per axis, centred in
+    // each cell like the fixed-size LUT above, or 2^b + 1 samples, including
+    // both end points, like the 17/33/65 grids of .cube files.
+    constexpr int kMinLUTBits = 2;
+    constexpr int kMaxLUTBits = 8;
+    constexpr int kMaxLUTSize = (1 << kMaxLUTBits) + 1;
+
+    // Shaped LUTs additionally have a per-channel 1D table mapping each input
+    // value to its LUT coordinate, applied before the 3D lookup. This lets
+    // samples be spaced unevenly, to concentrate them where a transform curves
+    // most, and allows any size from 2 to kMaxLUTSize, e.g., 24^3, which sits
+    // between 17^3 and 33^3 in both accuracy and cache footprint.
+    constexpr int kLUTShaperBits    = 7;            ///< Fractional bits of shaper entries, i.e., they are in 1/128ths of a cell
+    constexpr int kLUTShaperEntries = 3 * 256;      ///< Red, green, then blue, one entry per channel value
+
+    struct RGBLUT
+    {
+        int       size;     ///< Samples per axis
+        int       bits;     ///< log2 of the number of cells per axis, b above
+        RGBA32*   data;     ///< size^3 samples, red varying fastest, then green, then blue
+        uint16_t* shaper;   ///< Optional kLUTShaperEntries LUT coordinates, 0..(size - 1) << kLUTShaperBits, or 0 if none
+    };
+
+    bool   IsValidLUTSize(int size);                        ///< Returns true if size is 2^b or 2^b + 1, for kMinLUTBits <= b <= kMaxLUTBits
+    RGBLUT AllocLUT(int size);                              ///< Allocate LUT data of the given size, which must be valid. Release with FreeLUT
+    RGBLUT AllocShapedLUT(int size, float power = 1.0f);    ///< Allocate a shaped LUT, for 2 <= size <= kMaxLUTSize, with samples along the given power curve. Release with FreeLUT
+    void   FreeLUT(RGBLUT* lut);
+
+    RGBLUT LUTView(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize]);       ///< Returns RGBLUT referencing the given fixed-size LUT
+    RGBLUT LUTView(int size, RGBA32 data[], uint16_t shaper[] = 0);    ///< Returns RGBLUT referencing existing data of the given size, e.g., a mapped file
+    void   LUTSampleValues(const RGBLUT& lut, float values[]);         ///< Fill 'values' with the linear-space position of each sample along an axis. Shaped LUTs use red's shaper for all axes
+
+    // Binary LUT files: this header, followed by the samples exactly as in RGBLUT::data, all little-endian.
+    // This means a file can be mapped into memory and used in place, with no decoding step.
+    // Shaped LUTs use version 2, with the shaper entries between the header and the samples.
+    constexpr uint32_t kLUTFileMagic         = 0x544c4243;   ///< "CBLT"
+    constexpr uint16_t kLUTFileVersion       = 1;
+    constexpr uint16_t kLUTFileVersionShaper = 2;
+    constexpr uint32_t kLUTFileLayoutRGBA    = 0x41424752;   ///< "RGBA": channel order within a sample, whose red varies fastest, then green, then blue
+
+    struct LUTFileHeader
+    {
+        uint32_t magic;         ///< kLUTFileMagic
+        uint16_t version;       ///< kLUTFileVersion, or kLUTFileVersionShaper
+        uint16_t headerSize;    ///< Offset of the samples from the start of the file
+        uint16_t size;          ///< Samples per axis
+        uint8_t  channels;      ///< Channels per sample, currently always 4
+        uint8_t  bitDepth;      ///< Bits per channel, currently always 8
+        uint32_t layout;        ///< kLUTFileLayoutRGBA
+        uint32_t checksum;      ///< LUTChecksum() of the shaper and samples
+        uint32_t reserved;
+        uint64_t userData;      ///< Free for the application, e.g., a cache key
+    };
+
+    uint32_t      LUTChecksum(const RGBLUT& lut);                                  ///< 32-bit hash of the lut's shaper, if any, and samples
+    LUTFileHeader MakeLUTFileHeader(const RGBLUT& lut, uint64_t userData = 0);     ///< Header for writing lut as a binary file, to be followed by lut.shaper if set, then lut.data
+    bool          LUTFromFileData(const void* data, size_t dataSize, RGBLUT* lut, bool verify = true);
+    ///< If data holds a complete binary LUT file, e.g., as mapped via mmap, sets lut to reference its samples in place, and returns true.
+    ///< If verify is set, the samples must also match the header's checksum.
+
+    void CreateIdentityLUT(const RGBLUT& lut);
+    void ApplyLUT      (const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp = kInterpDiagonal);  ///< Apply lut to the given image. Common sizes (16/17/32/33/64/65) use specialised kernels
+    void ApplyLUTNoLerp(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[]);     ///< Apply lut to the given image, using point sampling
+
+    // Multithreaded versions of the above. The image is split into cache-sized
+    // chunks, which are spread across 'numThreads' threads, or all hardware
+    // threads if numThreads <= 0. Results match the single-threaded versions exactly.
+    constexpr int kParallelChunkSize = 16384;  ///< Pixels per chunk: 64KB in and out, leaving L2 room for the LUT
+
+    void ApplyLUTParallel      (const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp = kInterpDiagonal, int numThreads = 0);
+    void ApplyLUTNoLerpParallel(const RGBLUT& lut, int n, const RGBA32 dataIn[], RGBA32 dataOut[], int numThreads = 0);
+
+    // Strength LUT stacks. Rather than rebuilding a LUT whenever the strength of colour blindness changes, e.g.,
+    // via a UI slider, build LUTs at a range of strengths once, and blend between the nearest two when applying.
+    constexpr int kLUTStackSlices = 9;  ///< Default number of slices, at strengths 0, 1/8, 2/8, ... 1
+
+    struct RGBLUTStack
+    {
+        RGBLUT lut;         ///< Geometry of each slice, with data holding all of them, slice by slice
+        int    numSlices;   ///< Slice i is for strength i / (numSlices - 1)
+    };
+
+    RGBLUTStack AllocLUTStack(int size, int numSlices = kLUTStackSlices);  ///< Release with FreeLUTStack
+    void        FreeLUTStack(RGBLUTStack* stack);
+    RGBLUT      LUTStackSlice(const RGBLUTStack& stack, int i);             ///< Returns RGBLUT referencing the given slice
+
+    void ApplyLUTStack(const RGBLUTStack& stack, float strength, int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp = kInterpDiagonal);
+    ///< Apply stack for the given strength, clamped to [0, 1]. Each pixel is looked up in the two slices either side, and the results blended
+    void ApplyLUTStackParallel(const RGBLUTStack& stack, float strength, int n, const RGBA32 dataIn[], RGBA32 dataOut[], tLUTInterp interp = kInterpDiagonal, int numThreads = 0);
+    void BlendLUTStack(const RGBLUTStack& stack, float strength, const RGBLUT& lut);
+    ///< Fill lut, which must be the same size as the stack's slices, by blending the two slices either side of strength.
+    ///< This is a small fraction of the cost of CreateLUT, and the result can then be applied as normal, or uploaded to the GPU
+
+    // Affine LUTs. Where an op's result is affine in strength, as with Simulate and Daltonise, each sample is
+    // base + strength * delta in linear RGB. Keeping these in a float side table means a LUT can be rebuilt for a
+    // new strength via just a multiply-add and re-encode per sample, rather than re-evaluating the op.
+    struct RGBLUTAffine
+    {
+        int    size;    ///< Samples per axis
+        float* base;    ///< size^3 linear RGB samples at strength 0, in planar rows: a row's red values, then green, then blue
+        float* delta;   ///< Change in each sample per unit strength, in the same layout
+    };
+
+    RGBLUTAffine AllocLUTAffine(int size);  ///< Release with FreeLUTAffine
+    void         FreeLUTAffine(RGBLUTAffine* alut);
+
+    void UpdateLUTAffine(const RGBLUTAffine& alut, float strength, const RGBLUT& lut, int numThreads = 1);
+    ///< Fill lut, which must be the same size as alut, with the samples for the given strength
+
+    // YCbCr LUTs, for applying ops to video in its native format, rather than converting it to RGB and back. These
+    // are indexed by 8-bit Y, Cb, Cr in place of R, G, B, and hold the YCbCr result in the same channels, so the usual
+    // ApplyLUT() works on packed YCbCr pixels, and the YUVPlanes versions below on planar and semi-planar frames.
+    // (CreateIdentityLUT() gives the identity for these too.)
+    enum tYUVSpace
+    {
+        kYUV601,        ///< BT.601 (SD video), video range: Y in 16-235, Cb/Cr in 16-240
+        kYUV709,        ///< BT.709 (HD video), video range
+        kYUV601Full,    ///< BT.601, full 0-255 range, as in JPEG
+        kYUV709Full,    ///< BT.709, full range
+    };
+
+    struct YUVPlanes    ///< 8-bit YCbCr frame, whose chroma planes may be subsampled
+    {
+        int      w;             ///< Size of the luma plane
+        int      h;
+        int      chromaShiftX;  ///< log2 of the chroma subsampling along each axis: 1, 1 for 4:2:0, 1, 0 for 4:2:2, and 0, 0 for 4:4:4
+        int      chromaShiftY;
+        uint8_t* y;
+        uint8_t* cb;
+        uint8_t* cr;
+        int      yStride;       ///< Bytes between luma rows
+        int      cStride;       ///< Bytes between chroma rows
+        int      cStep;         ///< Bytes between chroma samples: 1 for planar formats, 2 for interleaved ones such as NV12
+    };
+
+    YUVPlanes I420Planes(int w, int h, uint8_t* data);     ///< Planes of a contiguous I420 (4:2:0) frame: Y, then Cb, then Cr, each with rows rounded up to whole chroma samples
+    YUVPlanes NV12Planes(int w, int h, uint8_t* data);     ///< Planes of a contiguous NV12 (4:2:0) frame: Y, then interleaved CbCr
+
+    void YUVSampleColours(const RGBLUT& lut, int j, int i, tYUVSpace space, float r[], float g[], float b[]);
+    ///< Fill r/g/b with the linear RGB of samples (0..size - 1, j, i) of a YCbCr lut, see CreateYUVLUTBatch. Out-of-gamut colours are clamped
+    void ToYUV(int n, const float r[], const float g[], const float b[], tYUVSpace space, RGBA32 dataOut[]);
+    ///< Encode n linear RGB colours as 8-bit YCbCr, in the form held by a YCbCr lut
+
+    void ApplyLUT        (const RGBLUT& lut, const YUVPlanes& in, const YUVPlanes& out, tLUTInterp interp = kInterpDiagonal);
+    ///< Apply the YCbCr lut to frame 'in', writing the result to 'out', which must have the same geometry, and may be the same frame.
+    ///< Each pixel is looked up with its chroma sample, and each output chroma sample is the average of its pixels' results
+    void ApplyLUTParallel(const RGBLUT& lut, const YUVPlanes& in, const YUVPlanes& out, tLUTInterp interp = kInterpDiagonal, int numThreads = 0);
+
+    // Deep colour support, for 16-bit and half-float images, which would band if quantised to 8 bits first. RGBA64
+    // channels are gamma-encoded as with RGBA32, but over 0-65535, and 16-bit LUTs hold RGBA64 samples at the same
+    // positions as 8-bit LUTs of the same size. Their kernels interpolate with up to 12 fractional bits per cell,
+    // rather than 8 - bits, which is the full input precision for LUTs with 16 or more samples per axis.
+    struct RGBA64
+    {
+        union
+        {
+            uint16_t c[4];
+            uint64_t u64;
+        };
+    };
+
+    struct RGBA16F      ///< Linear RGBA as IEEE half floats, e.g., from a floating-point render target
+    {
+        uint16_t c[4];
+    };
+
+    uint16_t ToHalf  (float f);     ///< Round to the nearest half float
+    float    FromHalf(uint16_t h);
+
+    RGBA64 ToRGBA64   (Vec3f c);
+    RGBA64 ToRGBA64u  (Vec3f c);    ///< 0-65536 variant, for LUT construction, as with ToRGBA32u
+    Vec3f  FromRGBA64 (RGBA64 rgb);
+    Vec3f  FromRGBA64u(RGBA64 rgb);
+
+    void ToRGBA64u(int n, const float r[], const float g[], const float b[], RGBA64 dataOut[]);  ///< Batch version of ToRGBA64u, for planar colours
+
+    struct RGBLUT64
+    {
+        int     size;   ///< Samples per axis, as for RGBLUT
+        int     bits;   ///< log2 of the number of cells per axis
+        RGBA64* data;   ///< size^3 samples, red varying fastest, then green, then blue
+    };
+
+    RGBLUT64 AllocLUT64(int size);      ///< Allocate 16-bit LUT data of the given size, which must be valid. Release with FreeLUT
+    void     FreeLUT(RGBLUT64* lut);
+    void     WidenLUT(const RGBLUT& lut, const RGBLUT64& lut64);    ///< Fill lut64, which must be the same size, from unshaped 8-bit lut, e.g., one loaded from a png
+
+    void CreateIdentityLUT(const RGBLUT64& lut);
+    void ApplyLUT(const RGBLUT64& lut, int n, const RGBA64  dataIn[], RGBA64  dataOut[], tLUTInterp interp = kInterpDiagonal);
+    void ApplyLUT(const RGBLUT64& lut, int n, const RGBA16F dataIn[], RGBA16F dataOut[], tLUTInterp interp = kInterpDiagonal);
+    ///< Apply lut to linear half-float colours. These are encoded to 16 bits for the lookup, and so clamped to [0, 1]
+    void ApplyLUTParallel(const RGBLUT64& lut, int n, const RGBA64  dataIn[], RGBA64  dataOut[], tLUTInterp interp = kInterpDiagonal, int numThreads = 0);
+    void ApplyLUTParallel(const RGBLUT64& lut, int n, const RGBA16F dataIn[], RGBA16F dataOut[], tLUTInterp interp = kInterpDiagonal, int numThreads = 0);
+
+    // Linear-light LUTs, for renderers working in linear float, which can apply these without encoding to 8 bits and
+    // back. Samples are linear RGB floats, placed uniformly in linear space, with sample i at i / (size - 1). As all
+    // the operations bar the -X/-Y style clamped ones are linear in linear RGB, tetrahedral lookups of them are exact
+    // to float precision, including for colours outside [0, 1], e.g., HDR ones, which are extrapolated from the edge
+    // cells. Trilinear lookups extrapolate too, but their cross terms grow with the overshoot, so only tetrahedral is
+    // exact there. Diagonal lookups are approximate throughout.
+    struct RGBA32F
+    {
+        float c[4];
+    };
+
+    struct RGBLUTF
+    {
+        int      size;  ///< Samples per axis, from 2 to kMaxLUTSize
+        RGBA32F* data;  ///< size^3 samples, red varying fastest, then green, then blue. Alpha is always 1
+    };
+
+    RGBLUTF AllocLUTF(int size);    ///< Release with FreeLUT
+    void    FreeLUT(RGBLUTF* lut);
+    void    LUTSampleValues(const RGBLUTF& lut, float values[]);   ///< Fill 'values' with the linear-space position of each sample along an axis
+    void    LUTHalfData(const RGBLUTF& lut, RGBA16F dataOut[]);     ///< Convert lut's samples to half floats, e.g., for upload as an RGBA16F 3D texture
+
+    void CreateIdentityLUT(const RGBLUTF& lut);
+    void ApplyLUT(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[], tLUTInterp interp = kInterpTetrahedral);  ///< In place is fine
+    void ApplyLUTParallel(const RGBLUTF& lut, int n, const Vec3f dataIn[], Vec3f dataOut[], tLUTInterp interp = kInterpTetrahedral, int numThreads = 0);
+
+    // Generic transform support, where 'xform' maps a linear RGB Vec3f to another, e.g., a lambda calling Simulate()
+    template<class T> void CreateLUT(T xform, RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize]);   ///< Create lut by applying xform to the identity
+    template<class T> void CreateLUT(T xform, const RGBLUT& lut);
+    template<class T> void CreateLUTBatch(T xform, const RGBLUT& lut, int numThreads = 1);
+    ///< As CreateLUT, but xform(n, r[], g[], b[]) transforms planar colours in place, e.g., via the batch Simulate() above.
+    ///< The LUT's blue slices are spread across numThreads threads (0 = all available), so xform must be thread-safe.
+    template<class T> void CreateLUTBatch(T xform, const RGBLUT64& lut, int numThreads = 1);   ///< As above, for a 16-bit lut
+    template<class T> void CreateLUTBatch(T xform, const RGBLUTF&  lut, int numThreads = 1);   ///< As above, for a linear-light lut
+    template<class T> void CreateYUVLUTBatch(T xform, const RGBLUT& lut, tYUVSpace space, int numThreads = 1);
+    ///< As CreateLUTBatch, but creates a YCbCr lut, by converting each sample from YCbCr to linear RGB, applying xform, and converting back
+    template<class T> void CreateLUTStackBatch(T xform, const RGBLUTStack& stack, int numThreads = 1);
+    ///< As CreateLUTBatch, but xform(n, r[], g[], b[], strength) is called with the strength of each slice in turn
+    template<class T> void CreateLUTAffineBatch(T xform, const RGBLUTAffine& alut, int numThreads = 1);
+    ///< Fill alut from xform(n, r[], g[], b[], strength), which must be affine in strength, by evaluating it at strengths 0 and 1
+    template<class T> void Transform(T xform, int n, const RGBA32 dataIn[], RGBA32 dataOut[]);  ///< Apply xform directly to the given image
+    template<class T> void Transform(T xform, int n, const RGBA64 dataIn[], RGBA64 dataOut[]);
+
+    // Palette support, for images with relatively few distinct colours, e.g., UI screenshots or Ishihara plates
+    constexpr int kMaxPaletteColours = 16384;
+
+    int  FindColours (int n, const RGBA32 dataIn[], int maxColours, RGBA32 colours[]);  ///< Fill 'colours' with the distinct RGB values in dataIn, and return their count, or -1 if there are more than maxColours
+    void RemapColours(int n, const RGBA32 dataIn[], RGBA32 dataOut[], int numColours, const RGBA32 coloursIn[], const RGBA32 coloursOut[]); ///< Replace each occurrence of coloursIn[i] with coloursOut[i], ignoring alpha
+
+    template<class T> bool TransformPalette(T xform, int n, const RGBA32 dataIn[], RGBA32 dataOut[], int maxColours = kMaxPaletteColours);
+    ///< Same result as Transform(), but applies xform only once per distinct colour. If there are more than maxColours colours, falls back to Transform(), and returns false
+
     // Mono LUT support
     void ApplyMonoLUT(const RGBA32 monoLUT[256], int n, const RGBA32 dataIn[], RGBA32 dataOut[], int channel = -1);
-    ///< Apply given mono->rgba ramp to either sRGB (D65) luminance, or the specified channel. 
+    ///< Apply given mono->rgba ramp to either sRGB (D65) luminance, or the specified channel.
+    void ApplyMonoLUTParallel(const RGBA32 monoLUT[256], int n, const RGBA32 dataIn[], RGBA32 dataOut[], int channel = -1, int numThreads = 0);
+    ///< Multithreaded version of ApplyMonoLUT, see ApplyLUTParallel
+
+    // SIMD support. The best available instruction set is detected at startup,
+    // and kernels with no SIMD variant fall back to scalar code.
+    enum tSIMD
+    {
+        kSIMDNone,  ///< Scalar code only
+        kSIMDSSE2,  ///< x86 SSE2 (all x64 CPUs)
+        kSIMDAVX2,  ///< x86 AVX2 (Haswell onwards)
+    };
+
+    tSIMD SIMDLevel();                  ///< Returns the instruction set currently used by the above kernels
+    void  SetSIMDLevel(tSIMD level);    ///< Restrict kernels to the given level, e.g., kSIMDNone for testing. Levels the CPU doesn't support are ignored.
+}
+
+
+// --- Inlines -----------------------------------------------------------------
+
+inline CBLut::RGBLUT CBLut::LUTView(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
+{
+    return RGBLUT { kLUTSize, kLUTBits, &rgbLUT[0][0][0], 0 };
+}
+
+template<class T> void CBLut::CreateLUT(T xform, const RGBLUT& lut)
+{
+    float values[kMaxLUTSize];
+    LUTSampleValues(lut, values);
+
+    RGBA32* p = lut.data;
+
+    for (int i = 0; i < lut.size; i++)
+    for (int j = 0; j < lut.size; j++)
+    for (int k = 0; k < lut.size; k++)
+    {
+        Vec3f c = { values[k], values[j], values[i] };
+
+        c = xform(c);
+
+        *p++ = ToRGBA32uFast(c);
+    }
+}
+
+template<class T> void CBLut::CreateLUTBatch(T xform, const RGBLUT& lut, int numThreads)
+{
+    float values[kMaxLUTSize];
+    LUTSampleValues(lut, values);
+
+    const int size = lut.size;
+
+    ParallelFor(size, 1, numThreads,
+        [xform, &lut, &values, size](int begin, int end)
+        {
+            float r[kMaxLUTSize];
+            float g[kMaxLUTSize];
+            float b[kMaxLUTSize];
+
+            for (int i = begin; i < end; i++)
+            for (int j = 0; j < size; j++)
+            {
+                for (int k = 0; k < size; k++)
+                {
+                    r[k] = values[k];
+                    g[k] = values[j];
+                    b[k] = values[i];
+                }
+
+                xform(size, r, g, b);
+
+                ToRGBA32uFast(size, r, g, b, lut.data + (i * size + j) * size);
+            }
+        }
+    );
+}
+
+template<class T> void CBLut::CreateLUTBatch(T xform, const RGBLUT64& lut, int numThreads)
+{
+    float values[kMaxLUTSize];
+    LUTSampleValues(LUTView(lut.size, 0), values);
+
+    const int size = lut.size;
+
+    ParallelFor(size, 1, numThreads,
+        [xform, &lut, &values, size](int begin, int end)
+        {
+            float r[kMaxLUTSize];
+            float g[kMaxLUTSize];
+            float b[kMaxLUTSize];
+
+            for (int i = begin; i < end; i++)
+            for (int j = 0; j < size; j++)
+            {
+                for (int k = 0; k < size; k++)
+                {
+                    r[k] = values[k];
+                    g[k] = values[j];
+                    b[k] = values[i];
+                }
+
+                xform(size, r, g, b);
+
+                ToRGBA64u(size, r, g, b, lut.data + (i * size + j) * size);
+            }
+        }
+    );
+}
+
+template<class T> void CBLut::CreateLUTBatch(T xform, const RGBLUTF& lut, int numThreads)
+{
+    float values[kMaxLUTSize];
+    LUTSampleValues(lut, values);
+
+    const int size = lut.size;
+
+    ParallelFor(size, 1, numThreads,
+        [xform, &lut, &values, size](int begin, int end)
+        {
+            float r[kMaxLUTSize];
+            float g[kMaxLUTSize];
+            float b[kMaxLUTSize];
+
+            for (int i = begin; i < end; i++)
+            for (int j = 0; j < size; j++)
+            {
+                for (int k = 0; k < size; k++)
+                {
+                    r[k] = values[k];
+                    g[k] = values[j];
+                    b[k] = values[i];
+                }
+
+                xform(size, r, g, b);
+
+                RGBA32F* p = lut.data + (i * size + j) * size;
+
+                for (int k = 0; k < size; k++)
+                {
+                    p[k].c[0] = r[k];
+                    p[k].c[1] = g[k];
+                    p[k].c[2] = b[k];
+                    p[k].c[3] = 1.0f;
+                }
+            }
+        }
+    );
+}
+
+template<class T> void CBLut::CreateYUVLUTBatch(T xform, const RGBLUT& lut, tYUVSpace space, int numThreads)
+{
+    const int size = lut.size;
+
+    ParallelFor(size, 1, numThreads,
+        [xform, &lut, space, size](int begin, int end)
+        {
+            float r[kMaxLUTSize];
+            float g[kMaxLUTSize];
+            float b[kMaxLUTSize];
+
+            for (int i = begin; i < end; i++)
+            for (int j = 0; j < size; j++)
+            {
+                YUVSampleColours(lut, j, i, space, r, g, b);
+
+                xform(size, r, g, b);
+
+                ToYUV(size, r, g, b, space, lut.data + (i * size + j) * size);
+            }
+        }
+    );
+}
+
+template<class T> void CBLut::CreateLUTStackBatch(T xform, const RGBLUTStack& stack, int numThreads)
+{
+    for (int i = 0; i < stack.numSlices; i++)
+    {
+        float strength = i / float(stack.numSlices - 1);
+
+        CreateLUTBatch([xform, strength](int n, float r[], float g[], float b[]) { xform(n, r, g, b, strength); }, LUTStackSlice(stack, i), numThreads);
+    }
+}
+
+template<class T> void CBLut::CreateLUTAffineBatch(T xform, const RGBLUTAffine& alut, int numThreads)
+{
+    float values[kMaxLUTSize];
+    LUTSampleValues(LUTView(alut.size, 0), values);
+
+    const int size = alut.size;
+
+    ParallelFor(size, 1, numThreads,
+        [xform, &alut, &values, size](int begin, int end)
+        {
+            float r[kMaxLUTSize];
+            float g[kMaxLUTSize];
+            float b[kMaxLUTSize];
+
+            for (int i = begin; i < end; i++)
+            for (int j = 0; j < size; j++)
+            {
+                float* base  = alut.base  + (i * size + j) * size * 3;
+                float* delta = alut.delta + (i * size + j) * size * 3;
+
+                for (int strength = 0; strength < 2; strength++)
+                {
+                    for (int k = 0; k < size; k++)
+                    {
+                        r[k] = values[k];
+                        g[k] = values[j];
+                        b[k] = values[i];
+                    }
+
+                    xform(size, r, g, b, float(strength));
+
+                    float* p = strength ? delta : base;
+
+                    for (int k = 0; k < size; k++)
+                    {
+                        p[k           ] = r[k];
+                        p[k + size    ] = g[k];
+                        p[k + size * 2] = b[k];
+                    }
+                }
+
+                for (int k = 0; k < size * 3; k++)
+                    delta[k] -= base[k];
+            }
+        }
+    );
+}
+
+template<class T> void CBLut::CreateLUT(T xform, RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
+{
+    CreateLUT(xform, LUTView(rgbLUT));
+}
+
+template<class T> void CBLut::Transform(T xform, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    for (int i = 0; i < n; i++)
+    {
+        Vec3f c = FromRGBA32Fast(dataIn[i]);
+
+        c = xform(c);
+
+        dataOut[i] = ToRGBA32Fast(c);
+    }
+}
+
+template<class T> void CBLut::Transform(T xform, int n, const RGBA64 dataIn[], RGBA64 dataOut[])
+{
+    for (int i = 0; i < n; i++)
+    {
+        Vec3f c = FromRGBA64(dataIn[i]);
+
+        c = xform(c);
+
+        dataOut[i] = ToRGBA64(c);
+    }
+}
+
+template<class T> bool CBLut::TransformPalette(T xform, int n, const RGBA32 dataIn[], RGBA32 dataOut[], int maxColours)
+{
+    RGBA32* colours = new RGBA32[2 * maxColours];
+    int numColours = FindColours(n, dataIn, maxColours, colours);
+
+    if (numColours >= 0)
+    {
+        Transform(xform, numColours, colours, colours + numColours);
+        RemapColours(n, dataIn, dataOut, numColours, colours, colours + numColours);
+    }
+    else
+        Transform(xform, n, dataIn, dataOut);
+
+    delete[] colours;
+    return numColours >= 0;
 }
 
 #endif
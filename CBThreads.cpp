@@ -0,0 +1,243 @@
+//
+//  File:       CBThreads.cpp
+//
+//  Function:   Simple persistent thread pool for data-parallel loops
+//
+//  Copyright:  Andrew Willmott 2018
+//
+
+#include "CBThreads.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace CBLut;
+
+namespace
+{
+    // Remaining chunks of one thread's run, as [begin, end) packed into 32 bits each.
+    // The owner takes chunks from the front, and thieves from the back.
+    struct cRun
+    {
+        std::atomic<uint64_t> range;
+        char                  pad[64 - sizeof(uint64_t)];  ///< Avoid false sharing between threads
+    };
+
+    inline uint64_t PackRange(uint32_t begin, uint32_t end) { return (uint64_t(end) << 32) | begin; }
+
+    struct cJob
+    {
+        const tRangeFunc*   func;
+        int                 n;
+        int                 chunkSize;
+        int                 numRuns;        ///< One per participating thread, run 0 belongs to the caller
+        cRun*               runs;
+        std::atomic<int>    active;         ///< Participants yet to finish
+    };
+
+    void CallChunk(const cJob& job, uint32_t chunk)
+    {
+        int begin = chunk * job.chunkSize;
+        int end   = job.n - begin > job.chunkSize ? begin + job.chunkSize : job.n;
+
+        (*job.func)(begin, end);
+    }
+
+    void ProcessRuns(cJob& job, int self)
+    {
+        // Work through our own run front-to-back, for locality
+        std::atomic<uint64_t>& own = job.runs[self].range;
+        uint64_t r = own.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            uint32_t begin = uint32_t(r);
+            uint32_t end   = uint32_t(r >> 32);
+
+            if (begin >= end)
+                break;
+
+            if (own.compare_exchange_weak(r, PackRange(begin + 1, end), std::memory_order_relaxed))
+            {
+                CallChunk(job, begin);
+                r = own.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Then steal from the back of everyone else's
+        for (int i = 1; i < job.numRuns; i++)
+        {
+            std::atomic<uint64_t>& other = job.runs[(self + i) % job.numRuns].range;
+            r = other.load(std::memory_order_relaxed);
+
+            for (;;)
+            {
+                uint32_t begin = uint32_t(r);
+                uint32_t end   = uint32_t(r >> 32);
+
+                if (begin >= end)
+                    break;
+
+                if (other.compare_exchange_weak(r, PackRange(begin, end - 1), std::memory_order_relaxed))
+                {
+                    CallChunk(job, end - 1);
+                    r = other.load(std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    class cThreadPool
+    {
+    public:
+        ~cThreadPool();
+
+        bool Run(int n, int chunkSize, int numThreads, const tRangeFunc& func);  ///< Returns false if the pool is busy
+
+    protected:
+        void WorkerMain(int index, uint32_t seen);
+
+        std::vector<std::thread> mWorkers;
+        std::mutex               mRunMutex;     ///< Held for the duration of a Run
+        std::mutex               mMutex;        ///< Guards the below
+        std::condition_variable  mWakeCV;
+        std::condition_variable  mDoneCV;
+        cJob*                    mJob        = 0;
+        int                      mJobThreads = 0;
+        uint32_t                 mGeneration = 0;
+        bool                     mQuit       = false;
+    };
+
+    cThreadPool::~cThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mQuit = true;
+        }
+        mWakeCV.notify_all();
+
+        for (std::thread& worker : mWorkers)
+            worker.join();
+    }
+
+    bool cThreadPool::Run(int n, int chunkSize, int numThreads, const tRangeFunc& func)
+    {
+        std::unique_lock<std::mutex> runLock(mRunMutex, std::try_to_lock);
+
+        if (!runLock.owns_lock())
+            return false;
+
+        int numChunks = (n + chunkSize - 1) / chunkSize;
+
+        if (numThreads > numChunks)
+            numThreads = numChunks;
+
+        while (int(mWorkers.size()) < numThreads - 1)
+            mWorkers.emplace_back(&cThreadPool::WorkerMain, this, int(mWorkers.size()) + 1, mGeneration);
+
+        cRun* runs = new cRun[numThreads];
+
+        for (int i = 0; i < numThreads; i++)
+        {
+            uint32_t begin = uint32_t(int64_t(numChunks) *  i      / numThreads);
+            uint32_t end   = uint32_t(int64_t(numChunks) * (i + 1) / numThreads);
+
+            runs[i].range.store(PackRange(begin, end), std::memory_order_relaxed);
+        }
+
+        cJob job;
+        job.func      = &func;
+        job.n         = n;
+        job.chunkSize = chunkSize;
+        job.numRuns   = numThreads;
+        job.runs      = runs;
+        job.active.store(numThreads, std::memory_order_relaxed);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJob = &job;
+            mJobThreads = numThreads;
+            mGeneration++;
+        }
+        mWakeCV.notify_all();
+
+        ProcessRuns(job, 0);
+
+        if (job.active.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mDoneCV.wait(lock, [&job] { return job.active.load(std::memory_order_acquire) == 0; });
+        }
+
+        delete[] runs;
+        return true;
+    }
+
+    void cThreadPool::WorkerMain(int index, uint32_t seen)
+    {
+        for (;;)
+        {
+            cJob* job = 0;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mWakeCV.wait(lock, [this, seen] { return mQuit || mGeneration != seen; });
+
+                if (mQuit)
+                    return;
+
+                seen = mGeneration;
+
+                if (index < mJobThreads)
+                    job = mJob;
+            }
+
+            // Only participants may touch 'job', which stays valid until they have all checked out
+            if (!job)
+                continue;
+
+            ProcessRuns(*job, index);
+
+            if (job->active.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mDoneCV.notify_one();
+            }
+        }
+    }
+
+    cThreadPool& ThreadPool()
+    {
+        static cThreadPool pool;
+        return pool;
+    }
+}
+
+int CBLut::HardwareThreads()
+{
+    static int numThreads = std::thread::hardware_concurrency();
+
+    return numThreads > 0 ? numThreads : 1;
+}
+
+void CBLut::ParallelFor(int n, int chunkSize, int numThreads, const tRangeFunc& func)
+{
+    if (n <= 0)
+        return;
+
+    if (chunkSize <= 0)
+        chunkSize = n;
+
+    if (numThreads <= 0)
+        numThreads = HardwareThreads();
+
+    if (numThreads > 1 && n > chunkSize && ThreadPool().Run(n, chunkSize, numThreads, func))
+        return;
+
+    for (int begin = 0; begin < n; begin += chunkSize)
+        func(begin, n - begin > chunkSize ? begin + chunkSize : n);
+}
@@ -0,0 +1,27 @@
+//
+//  File:       CBThreads.h
+//
+//  Function:   Simple persistent thread pool for data-parallel loops
+//
+//  Copyright:  Andrew Willmott 2018
+//
+
+#ifndef CB_THREADS_H
+#define CB_THREADS_H
+
+#include <functional>
+
+namespace CBLut
+{
+    typedef std::function<void(int begin, int end)> tRangeFunc;
+
+    int  HardwareThreads();     ///< Returns the number of hardware threads available
+
+    void ParallelFor(int n, int chunkSize, int numThreads, const tRangeFunc& func);
+    ///< Calls func on consecutive [begin, end) chunks of [0, n), using up to numThreads threads, including the caller.
+    ///< numThreads <= 0 means use all hardware threads. Each thread starts on its own contiguous run of chunks, and
+    ///< then steals from the end of the others' runs. Calls made while the pool is busy, e.g., from within func,
+    ///< are run serially on the calling thread.
+}
+
+#endif
@@ -2,13 +2,17 @@
 // See the original for documentation and full licenses at the URLs below.
 // (License is MIT or public domain.)
 // Generated via:
-//   unifdef -USTBI_NO_JPEG -USTBI_NEON -USTBI_SSE2 -DSTBI_NO_BMP -DSTBI_NO_PSD -DSTBI_NO_TGA -DSTBI_NO_GIF -DSTBI_NO_HDR -DSTBI_NO_PIC -DSTBI_NO_PNM  -DSTBI_NO_LINEAR -DSTBI_NO_SIMD -USTBI_NEON -USTBI_NO_STDIO -USTBI_NO_PNG -USTB_IMAGE_STATIC  stb_image.h > stb_image_mini.h
+//   unifdef -USTBI_NO_JPEG -DSTBI_NO_BMP -DSTBI_NO_PSD -DSTBI_NO_TGA -DSTBI_NO_GIF -DSTBI_NO_HDR -DSTBI_NO_PIC -DSTBI_NO_PNM  -DSTBI_NO_LINEAR -USTBI_NEON -USTBI_NO_STDIO -USTBI_NO_PNG -USTB_IMAGE_STATIC  stb_image.h > stb_image_mini.h
 // + stb_image_write.h
-// - 16-bit API
+// - 16-bit API other than stbi_load_16*, stbi_is_16_bit*
 // - STBI_ONLY_XXX block
 // - unused functions
 // - doc comments
 // + STB_IMAGE_DECLARATION if you only want the declarations
+// + stbi_set_jpeg_simd(), for comparing the SSE2 and scalar jpeg kernels
+// + png compression levels 0 (store) and 1 (run-length only), and banded png writing
+// + streaming png reading and writing, a row at a time
+// + 16-bit png writing
 //
 // stb_image - v2.19 - public domain image loader - http://nothings.org/stb/stb_image.h
 //                                  no warranty implied; use at your own risk
@@ -62,6 +66,12 @@ STBIDEF stbi_uc *stbi_load            (char const *filename, int *x, int *y, int
 STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 
+// 16-bits-per-channel interface. 8-bit images are widened, mapping 255 to 65535
+
+STBIDEF stbi_us *stbi_load_16_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_us *stbi_load_16           (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_us *stbi_load_from_file_16 (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
+
 // get a VERY brief reason for failure
 // NOT THREADSAFE
 STBIDEF const char *stbi_failure_reason  (void);
@@ -75,6 +85,8 @@ STBIDEF int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *u
 
 STBIDEF int      stbi_info               (char const *filename,     int *x, int *y, int *comp);
 STBIDEF int      stbi_info_from_file     (FILE *f,                  int *x, int *y, int *comp);
+STBIDEF int      stbi_is_16_bit          (char const *filename);
+STBIDEF int      stbi_is_16_bit_from_file(FILE *f);
 
 
 
@@ -90,6 +102,16 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// use the SSE2 jpeg kernels where available (the default). results are identical either way
+STBIDEF void stbi_set_jpeg_simd(int flag_true_if_should_use_simd);
+
+// Streaming png decoding, for images too large to hold in memory: callback is passed each row in turn, as
+// RGBA, with *x and *y already set. Returns 0 on failure, including if callback returns 0. Only 8-bit
+// non-interlaced pngs are supported, and vertical flipping is ignored.
+typedef int stbi_png_row_callback(void *user, int y, stbi_uc *rgba);
+
+STBIDEF int stbi_load_png_rows(char const *filename, int *x, int *y, stbi_png_row_callback *callback, void *user);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -108,6 +130,39 @@ STBIDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const v
 
 STBIDEF stbi_uc *stbi_write_png_to_mem(stbi_uc *pixels, int stride_bytes, int x, int y, int n, int *out_len);
 
+// 16 bits per channel, with data in native byte order, and stride_bytes 0 meaning x * n * 2
+STBIDEF int      stbi_write_png_16       (char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes);
+STBIDEF stbi_uc *stbi_write_png_16_to_mem(const stbi_us *pixels, int stride_bytes, int x, int y, int n, int *out_len);
+
+// png compression: 0 stores the data uncompressed, 1 only run-length encodes it, and 2+ searches hash
+// chains of that length for matches; higher is smaller but slower. (default 8)
+STBIDEF int stbi_write_png_compression_level;
+// png filter: -1 picks the best filter for each row (default), 0-4 uses that filter for all rows
+STBIDEF int stbi_write_force_png_filter;
+
+// For writing pngs in parallel: each band of rows can be filtered and compressed independently, e.g.,
+// on its own thread, via stbi_write_png_band(), and then the bands stitched into one png, in order,
+// via stbi_write_png_bands_to_mem(), which frees their data.
+typedef struct
+{
+   stbi_uc     *data;       // deflate blocks, ending on a byte boundary
+   int          len;
+   int          raw_len;    // length of the filtered data it encodes
+   unsigned int adler;      // adler32 of the filtered data
+} stbi_png_band;
+
+STBIDEF int      stbi_write_png_band        (stbi_png_band *band, stbi_uc *pixels, int stride_bytes, int x, int y, int n, int y0, int y1);
+STBIDEF stbi_uc *stbi_write_png_bands_to_mem(stbi_png_band *bands, int num_bands, int x, int y, int n, int *out_len);
+
+// For writing pngs too large to hold in memory: rows are passed in order, and each band_rows of them
+// are compressed and written out as a separate IDAT chunk. stbi_write_png_end() closes the file and
+// frees the writer, and returns 0 if anything failed, including not being given exactly y rows.
+typedef struct stbi_png_writer stbi_png_writer;
+
+STBIDEF stbi_png_writer *stbi_write_png_begin(char const *filename, int x, int y, int n, int band_rows);
+STBIDEF int              stbi_write_png_rows (stbi_png_writer *writer, const void *rows, int num_rows, int stride_in_bytes);
+STBIDEF int              stbi_write_png_end  (stbi_png_writer *writer);
+
 #ifdef __cplusplus
 }
 #endif
@@ -200,11 +255,64 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI__X86_TARGET
 #endif
 
+#if defined(__GNUC__) && defined(STBI__X86_TARGET) && !defined(__SSE2__) && !defined(STBI_NO_SIMD)
+// gcc doesn't support sse2 intrinsics unless you compile with -msse2,
+// which in turn means it gets to use SSE2 everywhere. This is unfortunate,
+// but previous attempts to provide the SSE2 functions with runtime
+// detection caused numerous issues. The way architecture extensions are
+// exposed in GCC/Clang is, sadly, not really suited for one-file libs.
+// New behavior: if compiled with -msse2, we use SSE2 without any
+// detection; if not, we don't use it at all.
+#define STBI_NO_SIMD
+#endif
+
+#if !defined(STBI_NO_SIMD) && (defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET))
+#define STBI_SSE2
+#include <emmintrin.h>
 
+#ifdef _MSC_VER
 
+#if _MSC_VER >= 1400  // not VC6
+#include <intrin.h> // __cpuid
+static int stbi__cpuid3(void)
+{
+   int info[4];
+   __cpuid(info,1);
+   return info[3];
+}
+#else
+static int stbi__cpuid3(void)
+{
+   int res;
+   __asm {
+      mov  eax,1
+      cpuid
+      mov  res,edx
+   }
+   return res;
+}
+#endif
+
+#define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-// ARM NEON
+static int stbi__sse2_available(void)
+{
+   int info3 = stbi__cpuid3();
+   return ((info3 >> 26) & 1) != 0;
+}
 
+#else // assume GCC-style if not VC++
+#define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
+
+static int stbi__sse2_available(void)
+{
+   // If we're even attempting to compile this on GCC/Clang, that means
+   // -msse2 is on, which means the compiler is allowed to use SSE2
+   // instructions at will, and so are we.
+   return 1;
+}
+#endif
+#endif
 
 #ifndef STBI_SIMD_ALIGN
 #define STBI_SIMD_ALIGN(type, name) type name
@@ -472,6 +580,38 @@ static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
    }
 }
 
+static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int channels)
+{
+   int i;
+   int img_len = w * h * channels;
+   stbi_uc *reduced;
+
+   reduced = (stbi_uc *) stbi__malloc(img_len);
+   if (reduced == NULL) return stbi__errpuc("outofmem", "Out of memory");
+
+   for (i = 0; i < img_len; ++i)
+      reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
+
+   STBI_FREE(orig);
+   return reduced;
+}
+
+static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int channels)
+{
+   int i;
+   int img_len = w * h * channels;
+   stbi__uint16 *enlarged;
+
+   enlarged = (stbi__uint16 *) stbi__malloc(img_len*2);
+   if (enlarged == NULL) return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+
+   for (i = 0; i < img_len; ++i)
+      enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
+
+   STBI_FREE(orig);
+   return enlarged;
+}
+
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
@@ -480,6 +620,12 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    if (result == NULL)
       return NULL;
 
+   if (ri.bits_per_channel != 8) {
+      STBI_ASSERT(ri.bits_per_channel == 16);
+      result = stbi__convert_16_to_8((stbi__uint16 *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
+      ri.bits_per_channel = 8;
+   }
+
    // @TODO: move stbi__convert_format to here
 
    if (stbi__vertically_flip_on_load) {
@@ -490,6 +636,28 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    return (unsigned char *) result;
 }
 
+static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__result_info ri;
+   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+
+   if (result == NULL)
+      return NULL;
+
+   if (ri.bits_per_channel != 16) {
+      STBI_ASSERT(ri.bits_per_channel == 8);
+      result = stbi__convert_8_to_16((stbi_uc *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
+      ri.bits_per_channel = 16;
+   }
+
+   if (stbi__vertically_flip_on_load) {
+      int channels = req_comp ? req_comp : *comp;
+      stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
+   }
+
+   return (stbi__uint16 *) result;
+}
+
 static FILE *stbi__fopen(char const *filename, char const *mode)
 {
    FILE *f;
@@ -526,6 +694,36 @@ STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req
    return result;
 }
 
+STBIDEF stbi__uint16 *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__uint16 *result;
+   if (!f) return (stbi__uint16 *) stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_from_file_16(f,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__uint16 *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF stbi_us *stbi_load_16_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_and_postprocess_16bit(&s,x,y,channels_in_file,desired_channels);
+}
+
 STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
 {
    stbi__context s;
@@ -711,6 +909,55 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
    return good;
 }
 
+static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
+{
+   return (stbi__uint16) (((r*77) + (g*150) +  (29*b)) >> 8);
+}
+
+static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+{
+   int i,j;
+   stbi__uint16 *good;
+
+   if (req_comp == img_n) return data;
+   STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
+
+   good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
+   if (good == NULL) {
+      STBI_FREE(data);
+      return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+   }
+
+   for (j=0; j < (int) y; ++j) {
+      stbi__uint16 *src  = data + j * x * img_n   ;
+      stbi__uint16 *dest = good + j * x * req_comp;
+
+      #define STBI__COMBO(a,b)  ((a)*8+(b))
+      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+      // convert source image with img_n components to one with req_comp components;
+      // avoid switch per pixel, so use switch per scanline and massive macros
+      switch (STBI__COMBO(img_n, req_comp)) {
+         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+         default: STBI_ASSERT(0);
+      }
+      #undef STBI__CASE
+   }
+
+   STBI_FREE(data);
+   return good;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 //  "baseline" JPEG/JFIF decoder
@@ -1310,6 +1557,187 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+#ifdef STBI_SSE2
+// sse2 integer IDCT. not the fastest possible implementation but it
+// produces bit-identical results to the generic C version so it's
+// fully "transparent".
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   // This is constructed to match our regular (generic) integer IDCT exactly.
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_SSE2
+
 
 
 #define STBI__MARKER_none  0xff
@@ -1897,6 +2325,87 @@ static stbi_uc *stbi__resample_row_hv_2(stbi_uc *out, stbi_uc *in_near, stbi_uc
    return out;
 }
 
+#ifdef STBI_SSE2
+static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // need to generate 2x2 samples for every one in input
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   // process groups of 8 pixels for as long as we can.
+   // note we can't handle the last pixel in a row in this loop
+   // because we need to handle the filter boundary conditions.
+   for (; i < ((w-1) & ~7); i += 8) {
+      // load and perform the vertical filtering pass
+      // this uses 3*x + y = 4*x + (y - x)
+      __m128i zero  = _mm_setzero_si128();
+      __m128i farb  = _mm_loadl_epi64((__m128i *) (in_far + i));
+      __m128i nearb = _mm_loadl_epi64((__m128i *) (in_near + i));
+      __m128i farw  = _mm_unpacklo_epi8(farb, zero);
+      __m128i nearw = _mm_unpacklo_epi8(nearb, zero);
+      __m128i diff  = _mm_sub_epi16(farw, nearw);
+      __m128i nears = _mm_slli_epi16(nearw, 2);
+      __m128i curr  = _mm_add_epi16(nears, diff); // current row
+
+      // horizontal filter works the same based on shifted vers of current
+      // row. "prev" is current row shifted right by 1 pixel; we need to
+      // insert the previous pixel value (from t1).
+      // "next" is current row shifted left by 1 pixel, with first pixel
+      // of next block of 8 pixels added in.
+      __m128i prv0 = _mm_slli_si128(curr, 2);
+      __m128i nxt0 = _mm_srli_si128(curr, 2);
+      __m128i prev = _mm_insert_epi16(prv0, t1, 0);
+      __m128i next = _mm_insert_epi16(nxt0, 3*in_near[i+8] + in_far[i+8], 7);
+
+      // horizontal filter, polyphase implementation since it's convenient:
+      // even pixels = 3*cur + prev = cur*4 + (prev - cur)
+      // odd  pixels = 3*cur + next = cur*4 + (next - cur)
+      // note the shared term.
+      __m128i bias  = _mm_set1_epi16(8);
+      __m128i curs = _mm_slli_epi16(curr, 2);
+      __m128i prvd = _mm_sub_epi16(prev, curr);
+      __m128i nxtd = _mm_sub_epi16(next, curr);
+      __m128i curb = _mm_add_epi16(curs, bias);
+      __m128i even = _mm_add_epi16(prvd, curb);
+      __m128i odd  = _mm_add_epi16(nxtd, curb);
+
+      // interleave even and odd pixels, then undo scaling.
+      __m128i int0 = _mm_unpacklo_epi16(even, odd);
+      __m128i int1 = _mm_unpackhi_epi16(even, odd);
+      __m128i de0  = _mm_srli_epi16(int0, 4);
+      __m128i de1  = _mm_srli_epi16(int1, 4);
+
+      // pack and write output
+      __m128i outv = _mm_packus_epi16(de0, de1);
+      _mm_storeu_si128((__m128i *) (out + i*2), outv);
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+7] + in_far[i+7];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
@@ -1937,6 +2446,99 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
    }
 }
 
+#ifdef STBI_SSE2
+static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   // step == 3 is pretty ugly on the final interleave, and i'm not convinced
+   // it's useful in practice (you wouldn't use it for textures, for example).
+   // so just accelerate step == 4 case.
+   if (step == 4) {
+      // this is a fairly straightforward implementation and not super-optimized.
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
+      __m128i xw = _mm_set1_epi16(255); // alpha channel
+
+      for (; i+7 < count; i += 8) {
+         // load
+         __m128i y_bytes = _mm_loadl_epi64((__m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadl_epi64((__m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadl_epi64((__m128i *) (pcb+i));
+         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+         // unpack to short (and left-shift cr, cb by 8)
+         __m128i yw  = _mm_unpacklo_epi8(y_bias, y_bytes);
+         __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), cr_biased);
+         __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cb_biased);
+
+         // color transform
+         __m128i yws = _mm_srli_epi16(yw, 4);
+         __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
+         __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
+         __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
+         __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
+         __m128i rws = _mm_add_epi16(cr0, yws);
+         __m128i gwt = _mm_add_epi16(cb0, yws);
+         __m128i bws = _mm_add_epi16(yws, cb1);
+         __m128i gws = _mm_add_epi16(gwt, cr1);
+
+         // descale
+         __m128i rw = _mm_srai_epi16(rws, 4);
+         __m128i bw = _mm_srai_epi16(bws, 4);
+         __m128i gw = _mm_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m128i brb = _mm_packus_epi16(rw, bw);
+         __m128i gxb = _mm_packus_epi16(gw, xw);
+
+         // transpose to interleave channels
+         __m128i t0 = _mm_unpacklo_epi8(brb, gxb);
+         __m128i t1 = _mm_unpackhi_epi8(brb, gxb);
+         __m128i o0 = _mm_unpacklo_epi16(t0, t1);
+         __m128i o1 = _mm_unpackhi_epi16(t0, t1);
+
+         // store
+         _mm_storeu_si128((__m128i *) (out + 0), o0);
+         _mm_storeu_si128((__m128i *) (out + 16), o1);
+         out += 32;
+      }
+   }
+
+   for (; i < count; ++i) {
+      int y_fixed = (y[i] << 20) + (1<<19); // rounding
+      int r,g,b;
+      int cr = pcr[i] - 128;
+      int cb = pcb[i] - 128;
+      r = y_fixed + cr* stbi__float2fixed(1.40200f);
+      g = y_fixed + cr*-stbi__float2fixed(0.71414f) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
+      b = y_fixed                                   +   cb* stbi__float2fixed(1.77200f);
+      r >>= 20;
+      g >>= 20;
+      b >>= 20;
+      if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
+      if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
+      if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
+      out[0] = (stbi_uc)r;
+      out[1] = (stbi_uc)g;
+      out[2] = (stbi_uc)b;
+      out[3] = 255;
+      out += step;
+   }
+}
+#endif
+
+static int stbi__jpeg_simd = 1;
+
+STBIDEF void stbi_set_jpeg_simd(int flag_true_if_should_use_simd)
+{
+   stbi__jpeg_simd = flag_true_if_should_use_simd;
+}
 
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
@@ -1945,7 +2547,13 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
-
+#ifdef STBI_SSE2
+   if (stbi__jpeg_simd && stbi__sse2_available()) {
+      j->idct_block_kernel = stbi__idct_simd;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+   }
+#endif
 }
 
 // clean up the temporary component buffers
@@ -2283,11 +2891,19 @@ typedef struct
    int   z_expandable;
 
    stbi__zhuffman z_length, z_distance;
+
+   // for streaming png decoding: input is refilled from successive IDAT chunks, and rather than
+   // expanding, output is passed on a row at a time, keeping only the last 32K as a window
+   struct stbi__png_stream *stream;
 } stbi__zbuf;
 
+static int stbi__png_stream_refill(stbi__zbuf *z);
+static int stbi__png_stream_flush(stbi__zbuf *z, int n);
+
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
 {
-   if (z->zbuffer >= z->zbuffer_end) return 0;
+   if (z->zbuffer >= z->zbuffer_end)
+      if (!z->stream || !stbi__png_stream_refill(z)) return 0;
    return *z->zbuffer++;
 }
 
@@ -2347,6 +2963,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    int cur, limit, old_limit;
    z->zout = zout;
+   if (z->stream) return stbi__png_stream_flush(z, n);
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = old_limit = (int) (z->zout_end - z->zout_start);
@@ -2486,6 +3103,21 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
+   if (a->stream) {
+      // the block may span several IDAT chunks
+      if (a->zout + len > a->zout_end)
+         if (!stbi__zexpand(a, a->zout, len)) return 0;
+      while (len > 0) {
+         int avail = (int) (a->zbuffer_end - a->zbuffer);
+         if (avail == 0 && (avail = stbi__png_stream_refill(a)) == 0) return stbi__err("read past buffer","Corrupt PNG");
+         if (avail > len) avail = len;
+         memcpy(a->zout, a->zbuffer, avail);
+         a->zbuffer += avail;
+         a->zout += avail;
+         len -= avail;
+      }
+      return 1;
+   }
    if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
@@ -2571,6 +3203,7 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->stream = NULL;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -3311,7 +3944,10 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       result = p->out;
       p->out = NULL;
       if (req_comp && req_comp != p->s->img_out_n) {
-         result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+         if (ri->bits_per_channel == 8)
+            result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+         else
+            result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          p->s->img_out_n = req_comp;
          if (result == NULL) return result;
       }
@@ -3360,6 +3996,310 @@ static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
    return stbi__png_info_raw(&p, x, y, comp);
 }
 
+static int stbi__png_is16(stbi__context *s)
+{
+   stbi__png p;
+   p.s = s;
+   if (!stbi__png_info_raw(&p, NULL, NULL, NULL))
+      return 0;
+   if (p.depth != 16) {
+      stbi__rewind(p.s);
+      return 0;
+   }
+   return 1;
+}
+
+// Streaming decode, for 8-bit non-interlaced pngs. Rather than collecting all IDAT chunks up front, the
+// zlib decoder pulls them in as it goes, and each row is unfiltered and converted to RGBA as soon as it
+// has been decompressed, so only two rows and the 32K zlib window are held at any one time.
+
+#define STBI__PNG_STREAM_OUT  (128*1024)   // must hold the 32K window plus the largest stored block
+
+struct stbi__png_stream
+{
+   stbi__context *s;
+   stbi__uint32   chunk_left;       // unread bytes of the current IDAT chunk
+   int            idat_done;
+   stbi_uc        in[16384];        // compressed data, read from the IDAT chunks
+
+   char          *flushed;          // decompressed output not yet passed on starts here
+   stbi_uc       *cur, *prior;      // filter type byte followed by row_bytes, for this row and the last
+   int            cur_len;
+   int            x, y, rows, row_bytes;
+   int            img_n;            // components per pixel before conversion, 1 for palettes
+   int            is_palette, has_trans;
+   stbi_uc        tc[3];
+   stbi_uc        palette[1024];
+   stbi_uc       *rgba;
+
+   stbi_png_row_callback *callback;
+   void          *user;
+};
+
+static int stbi__png_stream_refill(stbi__zbuf *z)
+{
+   struct stbi__png_stream *ps = z->stream;
+   int n;
+   while (ps->chunk_left == 0) {
+      stbi__pngchunk c;
+      if (ps->idat_done) return 0;
+      stbi__get32be(ps->s); // skip the crc
+      c = stbi__get_chunk_header(ps->s);
+      if (c.type != STBI__PNG_TYPE('I','D','A','T')) {
+         ps->idat_done = 1;
+         return 0;
+      }
+      ps->chunk_left = c.length;
+   }
+   n = ps->chunk_left < sizeof(ps->in) ? (int) ps->chunk_left : (int) sizeof(ps->in);
+   if (!stbi__getn(ps->s, ps->in, n)) {
+      ps->idat_done = 1;
+      return 0;
+   }
+   ps->chunk_left -= n;
+   z->zbuffer     = ps->in;
+   z->zbuffer_end = ps->in + n;
+   return n;
+}
+
+static int stbi__png_stream_row(struct stbi__png_stream *ps)
+{
+   stbi_uc *cur = ps->cur + 1, *prior = ps->prior + 1, *o = ps->rgba, *t;
+   int n = ps->img_n, len = ps->row_bytes, i;
+
+   // the row before the first is treated as zero, which ps->prior is initialised to
+   switch (ps->cur[0]) {
+      case STBI__F_none:
+         break;
+      case STBI__F_sub:
+         for (i=n; i < len; ++i) cur[i] = STBI__BYTECAST(cur[i] + cur[i-n]);
+         break;
+      case STBI__F_up:
+         for (i=0; i < len; ++i) cur[i] = STBI__BYTECAST(cur[i] + prior[i]);
+         break;
+      case STBI__F_avg:
+         for (i=0; i < n; ++i)   cur[i] = STBI__BYTECAST(cur[i] + (prior[i]>>1));
+         for (   ; i < len; ++i) cur[i] = STBI__BYTECAST(cur[i] + ((prior[i] + cur[i-n])>>1));
+         break;
+      case STBI__F_paeth:
+         for (i=0; i < n; ++i)   cur[i] = STBI__BYTECAST(cur[i] + prior[i]);
+         for (   ; i < len; ++i) cur[i] = STBI__BYTECAST(cur[i] + stbi__paeth(cur[i-n], prior[i], prior[i-n]));
+         break;
+      default:
+         return stbi__err("invalid filter","Corrupt PNG");
+   }
+
+   if (ps->is_palette) {
+      for (i=0; i < ps->x; ++i, o += 4)
+         memcpy(o, ps->palette + 4*cur[i], 4);
+   } else if (n == 1) {
+      for (i=0; i < ps->x; ++i, o += 4) {
+         o[0] = o[1] = o[2] = cur[i];
+         o[3] = ps->has_trans && cur[i] == ps->tc[0] ? 0 : 255;
+      }
+   } else if (n == 2) {
+      for (i=0; i < ps->x; ++i, o += 4) {
+         o[0] = o[1] = o[2] = cur[2*i];
+         o[3] = cur[2*i+1];
+      }
+   } else if (n == 3) {
+      for (i=0; i < ps->x; ++i, o += 4) {
+         o[0] = cur[3*i];
+         o[1] = cur[3*i+1];
+         o[2] = cur[3*i+2];
+         o[3] = ps->has_trans && o[0] == ps->tc[0] && o[1] == ps->tc[1] && o[2] == ps->tc[2] ? 0 : 255;
+      }
+   } else
+      memcpy(o, cur, len);
+
+   if (!ps->callback(ps->user, ps->rows, ps->rgba))
+      return stbi__err("stopped","Stopped by callback");
+   ps->rows++;
+
+   t = ps->prior;
+   ps->prior = ps->cur;
+   ps->cur = t;
+   return 1;
+}
+
+static int stbi__png_stream_flush(stbi__zbuf *z, int n)
+{
+   struct stbi__png_stream *ps = z->stream;
+   char *p = ps->flushed;
+
+   while (p < z->zout && ps->rows < ps->y) {
+      int take = (int) (z->zout - p), need = ps->row_bytes + 1 - ps->cur_len;
+      if (take > need) take = need;
+      memcpy(ps->cur + ps->cur_len, p, take);
+      p += take;
+      ps->cur_len += take;
+      if (ps->cur_len == ps->row_bytes + 1) {
+         if (!stbi__png_stream_row(ps)) return 0;
+         ps->cur_len = 0;
+      }
+   }
+
+   // slide the output down, keeping the last 32K for matches to refer back to
+   if (z->zout - z->zout_start > 32768) {
+      memmove(z->zout_start, z->zout - 32768, 32768);
+      z->zout = z->zout_start + 32768;
+   }
+   ps->flushed = z->zout;
+   if (z->zout + n > z->zout_end) return stbi__err("output buffer limit","Corrupt PNG");
+   return 1;
+}
+
+static int stbi__png_stream_idat(struct stbi__png_stream *ps)
+{
+   stbi__zbuf z;
+   int result;
+
+   ps->cur   = (stbi_uc *) stbi__malloc(ps->row_bytes + 1);
+   ps->prior = (stbi_uc *) stbi__malloc(ps->row_bytes + 1);
+   ps->rgba  = (stbi_uc *) stbi__malloc_mad2(ps->x, 4, 0);
+   z.zout_start = (char *) stbi__malloc(STBI__PNG_STREAM_OUT);
+
+   if (!ps->cur || !ps->prior || !ps->rgba || !z.zout_start)
+      result = stbi__err("outofmem", "Out of memory");
+   else {
+      memset(ps->prior, 0, ps->row_bytes + 1);
+      z.zbuffer      = ps->in;
+      z.zbuffer_end  = ps->in;
+      z.zout         = z.zout_start;
+      z.zout_end     = z.zout_start + STBI__PNG_STREAM_OUT;
+      z.z_expandable = 0;
+      z.stream       = ps;
+      ps->flushed    = z.zout_start;
+
+      result = stbi__parse_zlib(&z, 1) && stbi__png_stream_flush(&z, 0);
+      if (result && ps->rows < ps->y)
+         result = stbi__err("not enough pixels","Corrupt PNG");
+   }
+
+   STBI_FREE(ps->cur);
+   STBI_FREE(ps->prior);
+   STBI_FREE(ps->rgba);
+   STBI_FREE(z.zout_start);
+   return result;
+}
+
+static int stbi__png_stream_rows(stbi__context *s, int *x, int *y, stbi_png_row_callback *callback, void *user)
+{
+   struct stbi__png_stream *ps;
+   stbi__uint32 i, pal_len = 0;
+   int first = 1, color = 0, k, result = 0;
+
+   if (!stbi__check_png_header(s)) return 0;
+
+   ps = (struct stbi__png_stream *) stbi__malloc(sizeof(*ps));
+   if (!ps) return stbi__err("outofmem", "Out of memory");
+   memset(ps, 0, sizeof(*ps));
+   ps->s        = s;
+   ps->callback = callback;
+   ps->user     = user;
+
+   for (;;) {
+      stbi__pngchunk c = stbi__get_chunk_header(s);
+      switch (c.type) {
+         case STBI__PNG_TYPE('C','g','B','I'):
+            result = stbi__err("not streamable","PNG not supported: iphone png");
+            goto done;
+
+         case STBI__PNG_TYPE('I','H','D','R'): {
+            int depth, comp, filter, interlace;
+            if (!first) { result = stbi__err("multiple IHDR","Corrupt PNG"); goto done; }
+            first = 0;
+            if (c.length != 13) { result = stbi__err("bad IHDR len","Corrupt PNG"); goto done; }
+            ps->x = stbi__get32be(s); if (ps->x > (1 << 24)) { result = stbi__err("too large","Very large image (corrupt?)"); goto done; }
+            ps->y = stbi__get32be(s); if (ps->y > (1 << 24)) { result = stbi__err("too large","Very large image (corrupt?)"); goto done; }
+            depth     = stbi__get8(s);
+            color     = stbi__get8(s);
+            comp      = stbi__get8(s);
+            filter    = stbi__get8(s);
+            interlace = stbi__get8(s);
+            if (color > 6 || (color != 3 && (color & 1))) { result = stbi__err("bad ctype","Corrupt PNG"); goto done; }
+            if (comp)   { result = stbi__err("bad comp method","Corrupt PNG"); goto done; }
+            if (filter) { result = stbi__err("bad filter method","Corrupt PNG"); goto done; }
+            if (depth != 8 || interlace) { result = stbi__err("not streamable","PNG not supported: streaming needs 8-bit non-interlaced"); goto done; }
+            if (!ps->x || !ps->y) { result = stbi__err("0-pixel image","Corrupt PNG"); goto done; }
+            ps->is_palette = color == 3;
+            ps->img_n      = ps->is_palette ? 1 : (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+            ps->row_bytes  = ps->x * ps->img_n;
+            break;
+         }
+
+         case STBI__PNG_TYPE('P','L','T','E'):
+            if (first) { result = stbi__err("first not IHDR", "Corrupt PNG"); goto done; }
+            if (c.length > 256*3) { result = stbi__err("invalid PLTE","Corrupt PNG"); goto done; }
+            pal_len = c.length / 3;
+            if (pal_len * 3 != c.length) { result = stbi__err("invalid PLTE","Corrupt PNG"); goto done; }
+            for (i=0; i < pal_len; ++i) {
+               ps->palette[i*4+0] = stbi__get8(s);
+               ps->palette[i*4+1] = stbi__get8(s);
+               ps->palette[i*4+2] = stbi__get8(s);
+               ps->palette[i*4+3] = 255;
+            }
+            break;
+
+         case STBI__PNG_TYPE('t','R','N','S'):
+            if (first) { result = stbi__err("first not IHDR", "Corrupt PNG"); goto done; }
+            if (ps->is_palette) {
+               if (pal_len == 0) { result = stbi__err("tRNS before PLTE","Corrupt PNG"); goto done; }
+               if (c.length > pal_len) { result = stbi__err("bad tRNS len","Corrupt PNG"); goto done; }
+               for (i=0; i < c.length; ++i)
+                  ps->palette[i*4+3] = stbi__get8(s);
+            } else {
+               if (!(ps->img_n & 1)) { result = stbi__err("tRNS with alpha","Corrupt PNG"); goto done; }
+               if (c.length != (stbi__uint32) ps->img_n*2) { result = stbi__err("bad tRNS len","Corrupt PNG"); goto done; }
+               ps->has_trans = 1;
+               for (k=0; k < ps->img_n; ++k)
+                  ps->tc[k] = (stbi_uc) (stbi__get16be(s) & 255);
+            }
+            break;
+
+         case STBI__PNG_TYPE('I','D','A','T'):
+            if (first) { result = stbi__err("first not IHDR", "Corrupt PNG"); goto done; }
+            if (ps->is_palette && !pal_len) { result = stbi__err("no PLTE","Corrupt PNG"); goto done; }
+            *x = ps->x;
+            *y = ps->y;
+            ps->chunk_left = c.length;
+            result = stbi__png_stream_idat(ps);
+            goto done;
+
+         case STBI__PNG_TYPE('I','E','N','D'):
+            result = stbi__err("no IDAT","Corrupt PNG");
+            goto done;
+
+         default:
+            // if critical, fail
+            if (first || (c.type & (1 << 29)) == 0) {
+               result = stbi__err("unknown chunk", "PNG not supported: unknown PNG chunk type");
+               goto done;
+            }
+            stbi__skip(s, c.length);
+            break;
+      }
+      // end of PNG chunk, read and skip CRC
+      stbi__get32be(s);
+   }
+
+done:
+   STBI_FREE(ps);
+   return result;
+}
+
+STBIDEF int stbi_load_png_rows(char const *filename, int *x, int *y, stbi_png_row_callback *callback, void *user)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   int result;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s, f);
+   result = stbi__png_stream_rows(&s, x, y, callback, user);
+   fclose(f);
+   return result;
+}
+
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 {
    if (stbi__jpeg_info(s, x, y, comp)) return 1;
@@ -3390,6 +4330,27 @@ STBIDEF int stbi_info_from_file(FILE *f, int *x, int *y, int *comp)
    return r;
 }
 
+STBIDEF int stbi_is_16_bit(char const *filename)
+{
+    FILE *f = stbi__fopen(filename, "rb");
+    int result;
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+    result = stbi_is_16_bit_from_file(f);
+    fclose(f);
+    return result;
+}
+
+STBIDEF int stbi_is_16_bit_from_file(FILE *f)
+{
+   int r;
+   stbi__context s;
+   long pos = ftell(f);
+   stbi__start_file(&s, f);
+   r = stbi__png_is16(&s);
+   fseek(f,pos,SEEK_SET);
+   return r;
+}
+
 STBIDEF int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
 {
    stbi__context s;
@@ -3436,6 +4397,16 @@ STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int
 #define STBIW_ASSERT(x) assert(x)
 #endif
 
+// for publishing lazily-built tables to other threads
+#if defined(__GNUC__)
+#define STBIW_MEMORY_BARRIER() __sync_synchronize()
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define STBIW_MEMORY_BARRIER() _ReadWriteBarrier()
+#else
+#define STBIW_MEMORY_BARRIER()
+#endif
+
 #ifndef _CRT_SECURE_NO_WARNINGS
     #define _CRT_SECURE_NO_WARNINGS
     #define STB_UNDEF_CRT_SECURE_NO_WARNINGS
@@ -3616,12 +4587,12 @@ static unsigned char *stbiw__zlib_flushf(unsigned char *data, unsigned int *bitb
 
 static int stbiw__zlib_bitrev(int code, int codebits)
 {
-   int res=0;
-   while (codebits--) {
-      res = (res << 1) | (code & 1);
-      code >>= 1;
-   }
-   return res;
+   // reverse all 16 bits, then shift down to the codebits we want
+   code = ((code & 0x5555) << 1) | ((code >> 1) & 0x5555);
+   code = ((code & 0x3333) << 2) | ((code >> 2) & 0x3333);
+   code = ((code & 0x0f0f) << 4) | ((code >> 4) & 0x0f0f);
+   code = ((code & 0x00ff) << 8) | ((code >> 8) & 0x00ff);
+   return code >> (16 - codebits);
 }
 
 static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
@@ -3658,7 +4629,31 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #define stbiw__ZHASH   16384
 
-unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+int stbi_write_png_compression_level = 8;
+int stbi_write_force_png_filter = -1;
+
+static unsigned char *stbiw__zlib_store(unsigned char *out, unsigned char *data, int data_len, int final)
+{
+   // stored blocks of at most 65535 bytes, each starting on a byte boundary
+   int i=0;
+   do {
+      int len = data_len-i < 65535 ? data_len-i : 65535;
+      stbiw__sbpush(out, (unsigned char) (final && i+len == data_len)); // BFINAL, BTYPE = 0 -- stored
+      stbiw__sbpush(out, (unsigned char) len);
+      stbiw__sbpush(out, (unsigned char) (len >> 8));
+      stbiw__sbpush(out, (unsigned char) ~len);
+      stbiw__sbpush(out, (unsigned char) (~len >> 8));
+      stbiw__sbmaybegrow(out, len);
+      STBIW_MEMMOVE(out + stbiw__sbn(out), data+i, len);
+      stbiw__sbn(out) += len;
+      i += len;
+   } while (i < data_len);
+   return out;
+}
+
+// append deflate blocks for data to out. if not final, ends with an empty stored block, so that
+// further blocks can follow on a byte boundary
+static unsigned char *stbiw__zlib_deflate(unsigned char *out, unsigned char *data, int data_len, int quality, int final)
 {
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
@@ -3666,13 +4661,12 @@ unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_l
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
    unsigned int bitbuf=0;
    int i,j, bitcount=0;
-   unsigned char *out = NULL;
    unsigned char **hash_table[stbiw__ZHASH]; // 64KB on the stack!
-   if (quality < 5) quality = 5;
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   if (quality <= 0)
+      return stbiw__zlib_store(out, data, data_len, final);
+
+   stbiw__zlib_add(final ? 1 : 0,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
    for (i=0; i < stbiw__ZHASH; ++i)
@@ -3680,35 +4674,45 @@ unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_l
 
    i=0;
    while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed
-      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
+      int best=3;
       unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) best=d,bestloc=hlist[j];
-         }
-      }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
-      }
-      stbiw__sbpush(hash_table[h],data+i);
 
-      if (bestloc) {
-         // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
+      if (quality == 1) {
+         // run-length encoding only, i.e., matches at distance 1
+         if (i > 0) {
+            int d = stbiw__zlib_countm(data+i-1, data+i, data_len-i);
+            if (d >= best) best=d,bestloc=data+i-1;
+         }
+      } else {
+         // hash next 3 bytes of data to be compressed
+         int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1);
+         unsigned char **hlist = hash_table[h];
+         int n = stbiw__sbcount(hlist);
          for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
-               if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
-                  break;
+            if (hlist[j]-data > i-32768) { // if entry lies within window
+               int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
+               if (d >= best) best=d,bestloc=hlist[j];
+            }
+         }
+         // when hash table entry is too long, delete half the entries
+         if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
+            STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
+            stbiw__sbn(hash_table[h]) = quality;
+         }
+         stbiw__sbpush(hash_table[h],data+i);
+
+         if (bestloc) {
+            // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
+            h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
+            hlist = hash_table[h];
+            n = stbiw__sbcount(hlist);
+            for (j=0; j < n; ++j) {
+               if (hlist[j]-data > i-32767) {
+                  int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
+                  if (e > best) { // if next match is better, bail on current match
+                     bestloc = NULL;
+                     break;
+                  }
                }
             }
          }
@@ -3733,28 +4737,68 @@ unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_l
    for (;i < data_len; ++i)
       stbiw__zlib_huffb(data[i]);
    stbiw__zlib_huff(256); // end of block
+   if (!final)
+      stbiw__zlib_add(0,3); // BFINAL = 0, BTYPE = 0 -- empty stored block
    // pad with 0 bits to byte boundary
    while (bitcount)
       stbiw__zlib_add(0,1);
+   if (!final) {
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0xff);
+      stbiw__sbpush(out, 0xff);
+   }
 
    for (i=0; i < stbiw__ZHASH; ++i)
       (void) stbiw__sbfree(hash_table[i]);
 
-   {
-      // compute adler32 on input
-      unsigned int i=0, s1=1, s2=0, blocklen = data_len % 5552;
-      int j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
-         s1 %= 65521, s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, (unsigned char) (s2 >> 8));
-      stbiw__sbpush(out, (unsigned char) s2);
-      stbiw__sbpush(out, (unsigned char) (s1 >> 8));
-      stbiw__sbpush(out, (unsigned char) s1);
+   return out;
+}
+
+static unsigned int stbiw__adler32(unsigned char *data, int data_len)
+{
+   unsigned int i=0, s1=1, s2=0, blocklen = data_len % 5552;
+   int j=0;
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
+      s1 %= 65521, s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
    }
+   return (s2 << 16) | s1;
+}
+
+// adler32 of the concatenation of two buffers, given the adler32 of each, and the length of the second
+static unsigned int stbiw__adler32_combine(unsigned int adler1, unsigned int adler2, int len2)
+{
+   unsigned int rem  = (unsigned int) len2 % 65521;
+   unsigned int sum1 = adler1 & 0xffff;
+   unsigned int sum2 = (rem * sum1) % 65521;
+   sum1 += (adler2 & 0xffff) + 65521 - 1;
+   sum2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum2 >= 65521*2) sum2 -= 65521*2;
+   if (sum2 >= 65521) sum2 -= 65521;
+   return (sum2 << 16) | sum1;
+}
+
+unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+   unsigned char *out = NULL;
+   unsigned int adler;
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   out = stbiw__zlib_deflate(out, data, data_len, quality, 1);
+
+   // compute adler32 on input
+   adler = stbiw__adler32(data, data_len);
+   stbiw__sbpush(out, (unsigned char) (adler >> 24));
+   stbiw__sbpush(out, (unsigned char) (adler >> 16));
+   stbiw__sbpush(out, (unsigned char) (adler >> 8));
+   stbiw__sbpush(out, (unsigned char) adler);
+
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
@@ -3763,15 +4807,30 @@ unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_l
 
 unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
-   static unsigned int crc_table[256];
+   // slicing-by-8: crc_table[k][b] is the crc of byte b followed by k zero bytes
+   static unsigned int crc_table[8][256];
+   static volatile int crc_table_ready = 0;
    unsigned int crc = ~0u;
    int i,j;
-   if (crc_table[1] == 0)
+   // threads that race to build the tables all write the same values, but mustn't see the flag before the tables
+   if (!crc_table_ready) {
       for(i=0; i < 256; i++)
-         for (crc_table[i]=i, j=0; j < 8; ++j)
-            crc_table[i] = (crc_table[i] >> 1) ^ (crc_table[i] & 1 ? 0xedb88320 : 0);
-   for (i=0; i < len; ++i)
-      crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
+         for (crc_table[0][i]=i, j=0; j < 8; ++j)
+            crc_table[0][i] = (crc_table[0][i] >> 1) ^ (crc_table[0][i] & 1 ? 0xedb88320 : 0);
+      for (i=0; i < 256; i++)
+         for (j=1; j < 8; ++j)
+            crc_table[j][i] = (crc_table[j-1][i] >> 8) ^ crc_table[0][crc_table[j-1][i] & 0xff];
+      STBIW_MEMORY_BARRIER();
+      crc_table_ready = 1;
+   }
+   STBIW_MEMORY_BARRIER();
+   for (i=0; i+8 <= len; i += 8) {
+      unsigned int a = crc ^ (buffer[i] | (buffer[i+1] << 8) | (buffer[i+2] << 16) | ((unsigned int) buffer[i+3] << 24));
+      crc = crc_table[7][a & 0xff] ^ crc_table[6][(a >> 8) & 0xff] ^ crc_table[5][(a >> 16) & 0xff] ^ crc_table[4][a >> 24]
+          ^ crc_table[3][buffer[i+4]] ^ crc_table[2][buffer[i+5]] ^ crc_table[1][buffer[i+6]] ^ crc_table[0][buffer[i+7]];
+   }
+   for (; i < len; ++i)
+      crc = (crc >> 8) ^ crc_table[0][buffer[i] ^ (crc & 0xff)];
    return ~crc;
 }
 
@@ -3793,67 +4852,128 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return (unsigned char) c;
 }
 
-unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// z is the row to encode; unless first_row is set, the previous row is at z - stride_bytes
+static void stbiw__encode_png_line(unsigned char *z, int stride_bytes, int width, int first_row, int n, int filter_type, signed char *line_buffer)
 {
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
+   static int mapping[] = { 0,1,2,3,4 };
+   static int firstmap[] = { 0,1,0,5,6 };
+   int *mymap = first_row ? firstmap : mapping;
+   int i;
+   int type = mymap[filter_type];
+
+   if (type == 0) {
+      STBIW_MEMMOVE(line_buffer, z, width*n);
+      return;
+   }
+
+   // first loop isn't optimized since it's just one pixel
+   for (i=0; i < n; ++i) {
+      switch (type) {
+         case 1: line_buffer[i] = z[i]; break;
+         case 2: line_buffer[i] = z[i] - z[i-stride_bytes]; break;
+         case 3: line_buffer[i] = z[i] - (z[i-stride_bytes]>>1); break;
+         case 4: line_buffer[i] = (signed char) (z[i] - stbiw__paeth(0,z[i-stride_bytes],0)); break;
+         case 5: line_buffer[i] = z[i]; break;
+         case 6: line_buffer[i] = z[i]; break;
+      }
+   }
+   switch (type) {
+      case 1: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
+      case 2: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-stride_bytes]; break;
+      case 3: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-stride_bytes])>>1); break;
+      case 4: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-stride_bytes], z[i-stride_bytes-n]); break;
+      case 5: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
+      case 6: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
+   }
+}
+
+// encodes num_rows rows starting at 'rows'. unless first_band is set, the row before them is at rows - stride_bytes
+static int stbiw__write_png_rows_band(stbi_png_band *band, unsigned char *rows, int stride_bytes, int x, int n, int num_rows, int first_band, int final)
+{
+   int force_filter = stbi_write_force_png_filter;
+   unsigned char *filt, *zlib;
    signed char *line_buffer;
-   int i,j,k,p,zlen;
+   int j;
 
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
+   if (force_filter >= 5)
+      force_filter = -1;
+
+   band->data = 0;
+   band->raw_len = (x*n+1) * num_rows;
 
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   filt = (unsigned char *) STBIW_MALLOC(band->raw_len); if (!filt) return 0;
    line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
-      static int mapping[] = { 0,1,2,3,4 };
-      static int firstmap[] = { 0,1,0,5,6 };
-      int *mymap = j ? mapping : firstmap;
-      int best = 0, bestval = 0x7fffffff;
-      for (p=0; p < 2; ++p) {
-         for (k= p?best:0; k < 5; ++k) {
-            int type = mymap[k],est=0;
-            unsigned char *z = pixels + stride_bytes*j;
-            for (i=0; i < n; ++i)
-               switch (type) {
-                  case 0: line_buffer[i] = z[i]; break;
-                  case 1: line_buffer[i] = z[i]; break;
-                  case 2: line_buffer[i] = z[i] - z[i-stride_bytes]; break;
-                  case 3: line_buffer[i] = z[i] - (z[i-stride_bytes]>>1); break;
-                  case 4: line_buffer[i] = (signed char) (z[i] - stbiw__paeth(0,z[i-stride_bytes],0)); break;
-                  case 5: line_buffer[i] = z[i]; break;
-                  case 6: line_buffer[i] = z[i]; break;
-               }
-            for (i=n; i < x*n; ++i) {
-               switch (type) {
-                  case 0: line_buffer[i] = z[i]; break;
-                  case 1: line_buffer[i] = z[i] - z[i-n]; break;
-                  case 2: line_buffer[i] = z[i] - z[i-stride_bytes]; break;
-                  case 3: line_buffer[i] = z[i] - ((z[i-n] + z[i-stride_bytes])>>1); break;
-                  case 4: line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-stride_bytes], z[i-stride_bytes-n]); break;
-                  case 5: line_buffer[i] = z[i] - (z[i-n]>>1); break;
-                  case 6: line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
-               }
-            }
-            if (p) break;
-            for (i=0; i < x*n; ++i)
+   for (j=0; j < num_rows; ++j) {
+      unsigned char *z = rows + stride_bytes*j;
+      int first_row = first_band && j == 0;
+      int filter_type;
+      if (force_filter > -1) {
+         filter_type = force_filter;
+         stbiw__encode_png_line(z, stride_bytes, x, first_row, n, force_filter, line_buffer);
+      } else { // Estimate the best filter by running through all of them:
+         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+         for (filter_type = 0; filter_type < 5; filter_type++) {
+            stbiw__encode_png_line(z, stride_bytes, x, first_row, n, filter_type, line_buffer);
+
+            // Estimate the entropy of the line using this filter; the less, the better.
+            est = 0;
+            for (i = 0; i < x*n; ++i)
                est += abs((signed char) line_buffer[i]);
-            if (est < bestval) { bestval = est; best = k; }
+            if (est < best_filter_val) {
+               best_filter_val = est;
+               best_filter = filter_type;
+            }
+         }
+         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
+            stbiw__encode_png_line(z, stride_bytes, x, first_row, n, best_filter, line_buffer);
+            filter_type = best_filter;
          }
       }
-      // when we get here, best contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) best;
+      // when we get here, filter_type contains the filter type, and line_buffer contains the data
+      filt[j*(x*n+1)] = (unsigned char) filter_type;
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
    }
    STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, 8); // increase 8 to get smaller but use more memory
+
+   zlib = stbiw__zlib_deflate(NULL, filt, band->raw_len, stbi_write_png_compression_level, final);
+   band->adler = stbiw__adler32(filt, band->raw_len);
    STBIW_FREE(filt);
    if (!zlib) return 0;
 
+   band->len = stbiw__sbn(zlib);
+   // make returned pointer freeable
+   STBIW_MEMMOVE(stbiw__sbraw(zlib), zlib, band->len);
+   band->data = (unsigned char *) stbiw__sbraw(zlib);
+   return 1;
+}
+
+int stbi_write_png_band(stbi_png_band *band, unsigned char *pixels, int stride_bytes, int x, int y, int n, int y0, int y1)
+{
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+   return stbiw__write_png_rows_band(band, pixels + stride_bytes*y0, stride_bytes, x, n, y1-y0, y0 == 0, y1 == y);
+}
+
+static unsigned char *stbiw__png_bands_to_mem(stbi_png_band *bands, int num_bands, int x, int y, int n, int depth, int *out_len)
+{
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char *out,*o;
+   unsigned int adler = 1;
+   int i, zlen = 2 + 4; // zlib header and adler32
+
+   for (i=0; i < num_bands; ++i) {
+      if (!bands[i].data) break;
+      zlen += bands[i].len;
+   }
+
    // each tag requires 12 bytes of overhead
-   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
+   out = i < num_bands ? 0 : (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
+   if (!out) {
+      for (i=0; i < num_bands; ++i)
+         STBIW_FREE(bands[i].data);
+      return 0;
+   }
    *out_len = 8 + 12+13 + 12+zlen + 12;
 
    o=out;
@@ -3862,7 +4982,7 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
    stbiw__wptag(o, "IHDR");
    stbiw__wp32(o, x);
    stbiw__wp32(o, y);
-   *o++ = 8;
+   *o++ = (unsigned char) depth;
    *o++ = (unsigned char) ctype[n];
    *o++ = 0;
    *o++ = 0;
@@ -3871,9 +4991,16 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
 
    stbiw__wp32(o, zlen);
    stbiw__wptag(o, "IDAT");
-   STBIW_MEMMOVE(o, zlib, zlen);
-   o += zlen;
-   STBIW_FREE(zlib);
+   *o++ = 0x78;   // DEFLATE 32K window
+   *o++ = 0x5e;   // FLEVEL = 1
+   for (i=0; i < num_bands; ++i) {
+      STBIW_MEMMOVE(o, bands[i].data, bands[i].len);
+      o += bands[i].len;
+      adler = stbiw__adler32_combine(adler, bands[i].adler, bands[i].raw_len);
+      STBIW_FREE(bands[i].data);
+      bands[i].data = 0;
+   }
+   stbiw__wp32(o, adler);
    stbiw__wpcrc(&o, zlen);
 
    stbiw__wp32(o,0);
@@ -3885,6 +5012,19 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
    return out;
 }
 
+unsigned char *stbi_write_png_bands_to_mem(stbi_png_band *bands, int num_bands, int x, int y, int n, int *out_len)
+{
+   return stbiw__png_bands_to_mem(bands, num_bands, x, y, n, 8, out_len);
+}
+
+unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   stbi_png_band band;
+   if (!stbi_write_png_band(&band, pixels, stride_bytes, x, y, n, 0, y))
+      return 0;
+   return stbi_write_png_bands_to_mem(&band, 1, x, y, n, out_len);
+}
+
 int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
 {
    FILE *f;
@@ -3899,6 +5039,166 @@ int stbi_write_png(char const *filename, int x, int y, int comp, const void *dat
    return 1;
 }
 
+unsigned char *stbi_write_png_16_to_mem(const stbi_us *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   // png samples are big-endian, so swap into a copy, and then filter that as 8-bit data with twice the channels
+   stbi_png_band band;
+   unsigned char *swapped, *o;
+   int i, j, ok;
+   if (stride_bytes == 0)
+      stride_bytes = x * n * 2;
+   swapped = (unsigned char *) STBIW_MALLOC((size_t) x * n * 2 * y);
+   if (!swapped) return 0;
+   for (j=0, o=swapped; j < y; ++j) {
+      const stbi_us *row = (const stbi_us *) ((const unsigned char *) pixels + (size_t) stride_bytes*j);
+      for (i=0; i < x*n; ++i) {
+         *o++ = (unsigned char) (row[i] >> 8);
+         *o++ = (unsigned char) row[i];
+      }
+   }
+   ok = stbi_write_png_band(&band, swapped, 0, x, y, n * 2, 0, y);
+   STBIW_FREE(swapped);
+   if (!ok)
+      return 0;
+   return stbiw__png_bands_to_mem(&band, 1, x, y, n, 16, out_len);
+}
+
+int stbi_write_png_16(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   FILE *f;
+   int len;
+   unsigned char *png = stbi_write_png_16_to_mem((const stbi_us *) data, stride_bytes, x, y, comp, &len);
+   if (!png) return 0;
+   f = fopen(filename, "wb");
+   if (!f) { STBIW_FREE(png); return 0; }
+   fwrite(png, 1, len, f);
+   fclose(f);
+   STBIW_FREE(png);
+   return 1;
+}
+
+struct stbi_png_writer
+{
+   FILE          *f;
+   int            x, y, n, band_rows;
+   int            rows_done;     // rows written out so far
+   int            rows_pending;  // rows buffered after the previous one
+   unsigned char *pixels;        // the last row written out, then up to band_rows pending rows
+   unsigned int   adler;
+   int            ok;
+};
+
+static int stbiw__write_png_chunk(FILE *f, const char *tag, const unsigned char *data, int len)
+{
+   unsigned char *chunk = (unsigned char *) STBIW_MALLOC(len + 12), *o = chunk;
+   int ok;
+   if (!chunk) return 0;
+   stbiw__wp32(o, len);
+   stbiw__wptag(o, tag);
+   STBIW_MEMMOVE(o, data, len);
+   o += len;
+   stbiw__wpcrc(&o, len);
+   ok = fwrite(chunk, 1, len + 12, f) == (size_t) (len + 12);
+   STBIW_FREE(chunk);
+   return ok;
+}
+
+static int stbiw__png_writer_flush(stbi_png_writer *w)
+{
+   int stride = w->x * w->n;
+   stbi_png_band band;
+   if (w->rows_pending == 0) return 1;
+   if (!stbiw__write_png_rows_band(&band, w->pixels + stride, stride, w->x, w->n, w->rows_pending,
+                                   w->rows_done == 0, w->rows_done + w->rows_pending == w->y))
+      return 0;
+   if (!stbiw__write_png_chunk(w->f, "IDAT", band.data, band.len)) {
+      STBIW_FREE(band.data);
+      return 0;
+   }
+   STBIW_FREE(band.data);
+   w->adler = stbiw__adler32_combine(w->adler, band.adler, band.raw_len);
+   w->rows_done += w->rows_pending;
+   // keep the last row for filtering the next band against
+   STBIW_MEMMOVE(w->pixels, w->pixels + stride*w->rows_pending, stride);
+   w->rows_pending = 0;
+   return 1;
+}
+
+stbi_png_writer *stbi_write_png_begin(char const *filename, int x, int y, int n, int band_rows)
+{
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char ihdr[13], *o = ihdr;
+   unsigned char zlib_header[2] = { 0x78, 0x5e };   // DEFLATE 32K window, FLEVEL = 1
+   stbi_png_writer *w;
+
+   if (band_rows < 1)
+      band_rows = 1;
+   w = (stbi_png_writer *) STBIW_MALLOC(sizeof(stbi_png_writer));
+   if (!w) return 0;
+   w->pixels = (unsigned char *) STBIW_MALLOC((size_t) x * n * (band_rows + 1));
+   w->f = fopen(filename, "wb");
+   if (!w->pixels || !w->f) {
+      if (w->f) fclose(w->f);
+      STBIW_FREE(w->pixels);
+      STBIW_FREE(w);
+      return 0;
+   }
+   w->x = x;
+   w->y = y;
+   w->n = n;
+   w->band_rows = band_rows;
+   w->rows_done = 0;
+   w->rows_pending = 0;
+   w->adler = 1;
+
+   stbiw__wp32(o, x);
+   stbiw__wp32(o, y);
+   *o++ = 8;
+   *o++ = (unsigned char) ctype[n];
+   *o++ = 0;
+   *o++ = 0;
+   *o++ = 0;
+
+   // the zlib stream is split over IDAT chunks: its header, one per band, and its adler32
+   w->ok = fwrite(sig, 1, 8, w->f) == 8
+        && stbiw__write_png_chunk(w->f, "IHDR", ihdr, 13)
+        && stbiw__write_png_chunk(w->f, "IDAT", zlib_header, 2);
+   return w;
+}
+
+int stbi_write_png_rows(stbi_png_writer *w, const void *rows, int num_rows, int stride_bytes)
+{
+   int stride = w->x * w->n, j;
+   if (stride_bytes == 0)
+      stride_bytes = stride;
+   for (j=0; j < num_rows && w->ok; ++j) {
+      if (w->rows_done + w->rows_pending >= w->y) {
+         w->ok = 0;
+         break;
+      }
+      STBIW_MEMMOVE(w->pixels + stride*(1 + w->rows_pending), (const unsigned char *) rows + stride_bytes*j, stride);
+      if (++w->rows_pending == w->band_rows)
+         w->ok = stbiw__png_writer_flush(w);
+   }
+   return w->ok;
+}
+
+int stbi_write_png_end(stbi_png_writer *w)
+{
+   unsigned char adler[4], *o = adler;
+   int ok = w->ok && stbiw__png_writer_flush(w) && w->rows_done == w->y;
+
+   stbiw__wp32(o, w->adler);
+   ok = ok
+     && stbiw__write_png_chunk(w->f, "IDAT", adler, 4)
+     && stbiw__write_png_chunk(w->f, "IEND", adler, 0);
+   ok = (fclose(w->f) == 0) && ok;
+   STBIW_FREE(w->pixels);
+   STBIW_FREE(w);
+   return ok;
+}
+
 #ifdef STB_UNDEF_CRT_SECURE_NO_WARNINGS
     #undef _CRT_SECURE_NO_WARNINGS
     #undef STB_UNDEF_CRT_SECURE_NO_WARNINGS